@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
@@ -7,6 +8,8 @@
 #include<stdbool.h>
 #include<limits.h>
 #include<pthread.h>
+#include<sched.h>
+#include<getopt.h>
 
 #define SERVERPORT 8989
 #define BUFSIZE 4096
@@ -18,20 +21,94 @@ typedef struct sockaddr SA;
 
 void * handle_connection(void* p_client_socket);
 int check(int exp, const char* msg);
+int open_listener(bool reuseport, int port);
+void * accept_loop(void* p_server_socket);
+void * shard_thread(void* p_shard);
+
+//-r: one SO_REUSEPORT listener per CPU, each with its own accept loop pinned to that CPU.
+//the kernel spreads incoming connections between the listeners, so nothing is shared between cores from accept to close.
+typedef struct shard {
+    int server_socket;
+    int cpu;
+} shard_t;
 
 int main(int argc, char** argv) {
-    int server_socket, client_socket, addr_size;
-    SA_IN server_addr, client_addr;
+    bool reuseport = false;
+    int port = SERVERPORT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "rp:")) != -1) {
+        switch (opt) {
+            case 'r':
+                reuseport = true;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-r] [-p port]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if (!reuseport) {
+        int server_socket = open_listener(false, port);
+        accept_loop(&server_socket);
+        return 0;
+    }
+
+    cpu_set_t allowed;
+    check(sched_getaffinity(0, sizeof(allowed), &allowed), "sched_getaffinity failed");
+    for (int cpu=0;cpu<CPU_SETSIZE;cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        pthread_t t;
+        shard_t* shard = malloc(sizeof(shard_t));
+        shard->server_socket = open_listener(true, port);
+        shard->cpu = cpu;
+        pthread_create(&t, NULL, shard_thread, shard);
+    }
+    printf("Serving with %d pinned listeners...\n", CPU_COUNT(&allowed));
+    pthread_exit(NULL);
+}
+
+int open_listener(bool reuseport, int port) {
+    int server_socket;
+    SA_IN server_addr;
 
     check((server_socket = socket(AF_INET, SOCK_STREAM, 0)), "Failed to create socket");
+    if (reuseport) {
+        int reuse = 1;
+        check(setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)), "setsockopt(SO_REUSEPORT) failed");
+    }
 
     //initialize the address struct
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SERVERPORT);
+    server_addr.sin_port = htons(port);
 
     check(bind(server_socket, (SA*)&server_addr, sizeof(server_addr)), "Bind Failed!");
     check(listen(server_socket, SERVER_BACKLOG), "Listen Failed!");
+    return server_socket;
+}
+
+void * shard_thread(void* p_shard) {
+    shard_t* shard = p_shard;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(shard->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    //prefer this listener for connections whose packets arrive on our CPU.
+    setsockopt(shard->server_socket, SOL_SOCKET, SO_INCOMING_CPU, &shard->cpu, sizeof(shard->cpu));
+    return accept_loop(&shard->server_socket);
+}
+
+void * accept_loop(void* p_server_socket) {
+    int server_socket = *((int*)p_server_socket);
+    int client_socket, addr_size;
+    SA_IN client_addr;
 
     while(true) {
         printf("Waiting for connections...\n");
@@ -50,7 +127,7 @@ int main(int argc, char** argv) {
         handle_connection(pclient);
     }
 
-    return 0;
+    return NULL;
 }
 
 int check(int exp, const char* msg) {
@@ -0,0 +1,74 @@
+#include<unistd.h>
+#include<sys/socket.h>
+#include<sys/resource.h>
+#include "server.h"
+#include "admission.h"
+#include "log.h"
+#include "tls.h"
+
+int admission_max_inflight = ADMISSION_MAX_INFLIGHT;
+int admission_max_queued = ADMISSION_MAX_QUEUED;
+
+const char admission_503[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+const int admission_503_len = sizeof(admission_503) - 1;
+
+static atomic_int inflight;
+
+void admission_fit_fd_limit(int fds_per_connection) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY) {
+        return;
+    }
+    long reserve = rl.rlim_cur / 8 > ADMISSION_FD_RESERVE ? rl.rlim_cur / 8 : ADMISSION_FD_RESERVE;
+    long fit = ((long)rl.rlim_cur - reserve) / fds_per_connection;
+    if (fit < 1) {
+        fit = 1;
+    }
+    if (admission_max_inflight == 0 || admission_max_inflight > fit) {
+        log_info("admission: in-flight limit %d -> %ld, to stay within %ld fds", admission_max_inflight, fit, (long)rl.rlim_cur);
+        admission_max_inflight = fit;
+    }
+}
+static atomic_long shed[SHED_REASONS];
+
+bool admission_admit() {
+    if (admission_max_inflight == 0) {
+        atomic_fetch_add_explicit(&inflight, 1, memory_order_relaxed);
+        return true;
+    }
+    //optimistic: take a slot and give it back if that went over. cheaper than a CAS loop when we're not at the limit.
+    if (atomic_fetch_add_explicit(&inflight, 1, memory_order_relaxed) >= admission_max_inflight) {
+        atomic_fetch_sub_explicit(&inflight, 1, memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void admission_release() {
+    atomic_fetch_sub_explicit(&inflight, 1, memory_order_relaxed);
+}
+
+void admission_count_shed(shed_reason_t reason) {
+    atomic_fetch_add_explicit(&shed[reason], 1, memory_order_relaxed);
+}
+
+void admission_reject(int client_socket, shed_reason_t reason) {
+    admission_count_shed(reason);
+    char request[BUFSIZE];
+    //a fresh socket's send buffer is empty, so this practically never blocks. if it would, the client just sees the close.
+    //a TLS client can't read a plaintext 503 and we won't do a handshake just to turn it away: it sees the close either way.
+    if (!tls_enabled) {
+        send(client_socket, admission_503, admission_503_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    //closing with the request still unread would send a RST, which can overtake the 503 and throw it away on the client's side.
+    recv(client_socket, request, sizeof(request), MSG_DONTWAIT);
+    close(client_socket);
+}
+
+int admission_inflight() {
+    return atomic_load_explicit(&inflight, memory_order_relaxed);
+}
+
+long admission_shed(shed_reason_t reason) {
+    return atomic_load_explicit(&shed[reason], memory_order_relaxed);
+}
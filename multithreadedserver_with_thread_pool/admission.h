@@ -0,0 +1,52 @@
+#ifndef ADMISSION_H_
+#define ADMISSION_H_
+
+#include<stdbool.h>
+#include<stdatomic.h>
+
+//admission control: how many connections the server takes on at once, and what happens to the rest.
+//every accepted connection has to be admitted first. past the in-flight limit (-L) it gets a canned 503 and is closed straight away,
+//which costs the client one round trip instead of a slot in a queue it would time out in anyway.
+//pool mode also bounds its queues and sheds by queue wait (see workpool.c).
+#define ADMISSION_MAX_INFLIGHT 16384    //default for -L, 0 = no limit (but the fd limit's)
+#define ADMISSION_MAX_QUEUED 1024       //default for -q: connections waiting for a pool worker, per shard
+//-L never goes past what RLIMIT_NOFILE leaves room for: a connection accept() can't get an fd for can't even be told 503.
+//this many fds (or 1/8 of the limit, if that's more) are kept back for listeners, the log, the cache, eventfds and the like.
+#define ADMISSION_FD_RESERVE 64
+
+//why a connection was turned away, for the metrics.
+typedef enum {
+    SHED_INFLIGHT,  //over -L
+    SHED_QUEUE,     //pool queue over -q
+    SHED_CODEL,     //pool queue wait stayed above target (CoDel)
+    SHED_FAIR,      //pool mode: too many of the client's connections already waiting for its share (see ratelimit.h)
+    SHED_REASONS,
+} shed_reason_t;
+
+extern int admission_max_inflight;
+extern int admission_max_queued;
+
+//what rejected connections are told.
+extern const char admission_503[];
+extern const int admission_503_len;
+
+// lowers admission_max_inflight to what the fd limit has room for, at fds_per_connection each (the socket, the file it's sending,
+// a splice pipe...). call once the limit is final.
+void admission_fit_fd_limit(int fds_per_connection);
+
+// takes an in-flight slot for a new connection. false if the server is full.
+bool admission_admit();
+
+// gives the slot back once the connection is closed.
+void admission_release();
+
+// answers a connection we're not going to serve with a 503 (if the socket takes it without blocking) and closes it.
+void admission_reject(int client_socket, shed_reason_t reason);
+
+// counts a connection turned away by someone who answers it themselves (uring sends its 503 through the ring).
+void admission_count_shed(shed_reason_t reason);
+
+int admission_inflight();
+long admission_shed(shed_reason_t reason);
+
+#endif
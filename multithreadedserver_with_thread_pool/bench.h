@@ -0,0 +1,15 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include<stdio.h>
+#include<stdbool.h>
+
+//-j: the benchmarks print one JSON object per line and per result instead of their tables. bench.sh collects them into bench.json
+//and compares them with a baseline, so every result says which way is better.
+static inline void bench_json(const char* bench, const char* name, double value, const char* unit, bool lower_is_better) {
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",\"value\":%.6g,\"unit\":\"%s\",\"better\":\"%s\"}\n",
+           bench, name, value, unit, lower_is_better ? "lower" : "higher");
+    fflush(stdout);
+}
+
+#endif
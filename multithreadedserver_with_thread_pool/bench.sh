@@ -0,0 +1,218 @@
+#!/bin/bash
+#runs every benchmark, writes the results to bench.json and compares them with the stored baseline (bench-baseline.json).
+#usage: ./bench.sh [-u] [-d seconds] [-n runs]
+#  -u  store these results as the new baseline instead of comparing
+#  -d  seconds per end-to-end run (default 5)
+#  -n  runs of each micro-benchmark (default 3). the best one counts: on a busy machine the others measure the neighbours
+#exits 1 if any result is more than BENCH_TOLERANCE percent (default 20) worse than the baseline's, is missing, or a benchmark
+#failed to run. with no baseline yet, the first complete run becomes it. baselines only mean something on the machine that made them, so it isn't committed.
+#the micro-benchmarks: queuebench (myqueue.c), scanbench (the request parser), sendbench (the file send loop) and hexbench
+#(bin2hex() in ../singlethreadedserver). end to end: loadgen against each server variant on localhost.
+
+cd "$(dirname "$0")" || exit 1
+OUT=bench.json
+BASELINE=bench-baseline.json
+TOLERANCE=${BENCH_TOLERANCE:-20}
+PORT=${BENCH_PORT:-18989}
+ORIGINAL_PORT=${BENCH_ORIGINAL_PORT:-18988}     #the thread-per-connection server's
+FILES=$PWD/../multithreadedserver/tmp/testfiles
+DURATION=5
+RUNS=3
+update=false
+failures=0
+
+while getopts "ud:n:" opt; do
+    case $opt in
+        u) update=true ;;
+        d) DURATION=$OPTARG ;;
+        n) RUNS=$OPTARG ;;
+        *) echo "usage: $0 [-u] [-d seconds] [-n runs]" >&2; exit 2 ;;
+    esac
+done
+
+results=$(mktemp)
+runs=$(mktemp)
+server=
+trap 'rm -f "$results" "$runs"; [ -n "$server" ] && kill $server 2>/dev/null' EXIT
+
+make -s server queuebench sendbench loadgen scanbench && make -s -C ../multithreadedserver && make -s -C ../singlethreadedserver hexbench || exit 1
+
+#waits for something to listen on port, for up to 5s.
+wait_for_port() {
+    for _ in $(seq 50); do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+#keeps the best of each result in the JSON lines on stdin, in the order they first appeared.
+best_of() {
+    awk '
+        {
+            match($0, /"case":"[^"]*"/)
+            key = substr($0, RSTART, RLENGTH)
+            match($0, /"value":[-+.0-9eE]+/)
+            value = substr($0, RSTART + 8, RLENGTH - 8) + 0
+            lower = $0 ~ /"better":"lower"/
+            if (!(key in line)) {
+                order[n++] = key
+            } else if (lower ? value >= best[key] : value <= best[key]) {
+                next
+            }
+            line[key] = $0
+            best[key] = value
+        }
+        END {
+            for (i=0;i<n;i++) {
+                print line[order[i]]
+            }
+        }
+    '
+}
+
+#micro name command...: runs it RUNS times.
+micro() {
+    local name=$1
+    shift
+    : > "$runs"
+    for _ in $(seq "$RUNS"); do
+        if ! "$@" >> "$runs"; then
+            echo "$name failed" >&2
+            failures=$((failures+1))
+        fi
+    done
+    best_of < "$runs" >> "$results"
+}
+
+#e2e name port warmup_seconds loadgen_args... -- server command...
+#starts the server, warms it up (the first request for each file goes to disk and fills the cache), then measures.
+e2e() {
+    local name=$1 port=$2 warmup=$3
+    shift 3
+    local args=()
+    while [ "$1" != "--" ]; do
+        args+=("$1")
+        shift
+    done
+    shift
+    #the original server doesn't set SO_REUSEADDR, so it can't bind while the last run's connections are still in TIME_WAIT
+    #(up to a minute) and exits straight away. keep trying until they're gone.
+    local tries=0
+    while true; do
+        "$@" >/dev/null 2>&1 &
+        server=$!
+        if wait_for_port "$port" && kill -0 $server 2>/dev/null; then
+            break
+        fi
+        kill $server 2>/dev/null
+        wait $server 2>/dev/null
+        server=
+        tries=$((tries+1))
+        if [ $tries -ge 12 ]; then
+            echo "$name: server didn't start" >&2
+            failures=$((failures+1))
+            return
+        fi
+        [ $tries = 1 ] && echo "$name: server didn't start, retrying for a minute" >&2
+        sleep 5
+    done
+    if [ "$warmup" != 0 ]; then
+        ./loadgen -p "$port" -d "$warmup" "${args[@]}" "$FILES"/{1..5}.txt >/dev/null
+    fi
+    if ! ./loadgen -p "$port" -d "$DURATION" -j "$name" "${args[@]}" "$FILES"/{1..5}.txt >> "$results"; then
+        echo "$name: no successful requests" >&2
+        failures=$((failures+1))
+    fi
+    kill $server 2>/dev/null
+    wait $server 2>/dev/null
+    server=
+}
+
+echo "micro-benchmarks..." >&2
+micro queuebench ./queuebench -j
+micro scanbench ./scanbench -j
+micro sendbench ./sendbench -j "$FILES/5.txt" 256
+micro hexbench ../singlethreadedserver/hexbench -j
+
+echo "end to end, ${DURATION}s per server..." >&2
+#the original server answers one connection at a time and sleeps a second in each, so a handful of connections is plenty. it has
+#no cache to warm, and a warm-up would only leave it a backlog of sleeps.
+e2e thread-per-connection "$ORIGINAL_PORT" 0 -c 4 -l -- ../multithreadedserver/server -p "$ORIGINAL_PORT"
+e2e pool "$PORT" 2 -c 50 -- ./server -m pool -p "$PORT"
+e2e epoll "$PORT" 2 -c 50 -- ./server -m epoll -p "$PORT"
+e2e uring "$PORT" 2 -c 50 -- ./server -m uring -p "$PORT"
+
+{
+    printf '{\n  "commit": "%s",\n  "date": "%s",\n  "host": "%s",\n  "cpus": %d,\n  "results": [\n' \
+        "$(git rev-parse --short HEAD 2>/dev/null)" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(uname -n)" "$(nproc)"
+    sed -e 's/^/    /' -e '$!s/$/,/' "$results"
+    printf '  ]\n}\n'
+} > "$OUT"
+echo "results in $OUT" >&2
+
+if [ $failures -gt 0 ]; then
+    echo "$failures benchmark(s) failed" >&2
+fi
+if $update || [ ! -f "$BASELINE" ]; then
+    #a baseline with holes in it would quietly stop checking whatever is missing.
+    if [ $failures -gt 0 ]; then
+        echo "not storing an incomplete baseline" >&2
+        exit 1
+    fi
+    cp "$OUT" "$BASELINE"
+    echo "stored as the baseline ($BASELINE)" >&2
+    exit 0
+fi
+
+#one result per line, so awk can pick them apart without a JSON parser.
+awk -v tolerance="$TOLERANCE" '
+    function field(line, key,    v) {
+        if (!match(line, "\"" key "\":(\"[^\"]*\"|[-+.0-9eE]+)")) {
+            return ""
+        }
+        v = substr(line, RSTART + length(key) + 3, RLENGTH - length(key) - 3)
+        gsub("\"", "", v)
+        return v
+    }
+    !/"bench":/ { next }
+    {
+        key = field($0, "bench") ": " field($0, "case")
+        value = field($0, "value")
+    }
+    NR == FNR { baseline[key] = value; order[n++] = key; next }
+    {
+        seen[key] = 1
+        if (!(key in baseline)) {
+            printf "%-40s %12s %12g  new\n", key, "-", value
+            next
+        }
+        base = baseline[key]
+        change = base != 0 ? (value - base) / base * 100 : 0
+        worse = field($0, "better") == "higher" ? -change : change
+        verdict = worse > tolerance ? "REGRESSION" : ""
+        if (verdict != "") {
+            regressions++
+        }
+        printf "%-40s %12g %12g %+7.1f%% %s\n", key, base, value, change, verdict
+    }
+    END {
+        for (i=0;i<n;i++) {
+            if (!(order[i] in seen)) {
+                printf "%-40s %12g %12s  MISSING\n", order[i], baseline[order[i]], "-"
+                missing++
+            }
+        }
+        if (missing > 0) {
+            printf "%d result(s) in the baseline missing from this run\n", missing
+        }
+        if (regressions > 0) {
+            printf "%d result(s) more than %s%% worse than the baseline\n", regressions, tolerance
+        }
+        if (missing > 0 || regressions > 0) {
+            exit 1
+        }
+        printf "no regressions (tolerance %s%%)\n", tolerance
+    }
+' "$BASELINE" "$OUT" || exit 1
+[ $failures -eq 0 ]
@@ -0,0 +1,967 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<limits.h>
+#include<stddef.h>
+#include<pthread.h>
+#include<sys/socket.h>
+#include<sys/uio.h>
+#include<sys/stat.h>
+#include<netinet/in.h>
+#include<sys/random.h>
+#include<sys/resource.h>
+#include<sched.h>
+#include<linux/tcp.h>     //glibc's tcp_info stops short of tcpi_bytes_acked
+#include "connection.h"
+#include "log.h"
+#include "metrics.h"
+#include "docroot.h"
+#include "admission.h"
+#include "encoding.h"
+#include "reload.h"
+#include "tls.h"
+#include "ratelimit.h"
+
+int connection_max_age = 0;
+
+//separates the parts of multipart/byteranges bodies. random per run, so no file is likely to contain it.
+static char boundary[17];
+static pthread_once_t boundary_once = PTHREAD_ONCE_INIT;
+
+//pool mode's deadlines. a worker writes its connection's deadline (and only when it moves), and a watchdog thread scans for the
+//ones that have passed. no lock between them: the table is indexed by fd, and each slot belongs to one connection at a time.
+#define WATCHDOG_BUSY ((connection_t*)1)   //the watchdog is looking at the slot's connection. closing it waits until it's done
+static connection_t* _Atomic* watched;
+static int watched_size;
+static atomic_int watched_high;             //one past the highest fd ever watched: the scan stops there
+static pthread_once_t watchdog_once = PTHREAD_ONCE_INIT;
+
+static const uint64_t wait_timeout_ms[] = {
+    [CONN_WAIT_REQUEST] = CONN_REQUEST_TIMEOUT_MS,
+    [CONN_WAIT_IDLE] = CONN_IDLE_TIMEOUT_MS,
+    [CONN_WAIT_SEND] = CONN_SEND_TIMEOUT_MS,
+    [CONN_WAIT_NONE] = CONN_REQUEST_TIMEOUT_MS,
+};
+
+//what the connection is waiting on its client for, if it waits now.
+static conn_wait_t wait_of(const connection_t* conn) {
+    if (conn->state != CONN_READING && conn->state != CONN_HANDSHAKE) {
+        return CONN_WAIT_SEND;
+    }
+    if (conn->in_len == 0 && conn->body_left == 0 && conn->wait != CONN_WAIT_REQUEST) {
+        return CONN_WAIT_IDLE;
+    }
+    //part of a request is in (or nothing yet, on a new connection). the deadline stays wherever the request started it.
+    return CONN_WAIT_REQUEST;
+}
+
+//bytes of the connection the client has acked, over its whole life.
+static uint64_t bytes_acked(const connection_t* conn) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    return getsockopt(conn->client_socket, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 ? info.tcpi_bytes_acked : 0;
+}
+
+static void watchdog_check(connection_t* conn, uint64_t now) {
+    uint64_t deadline = atomic_load_explicit(&conn->deadline_ms, memory_order_acquire);
+    //the worker is busy with the connection rather than waiting on it (e.g. opening a file). it looks at the deadline before it
+    //waits again.
+    if (deadline == 0 || now < deadline || !__atomic_load_n(&conn->blocked, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (conn->wait == CONN_WAIT_SEND) {
+        //the worker is stuck inside one send() or sendfile() and can't tell us how it's going, but the kernel can: if the client
+        //acked anything since the deadline was set, give it another round.
+        uint64_t acked = bytes_acked(conn);
+        if (acked != conn->acked) {
+            conn->acked = acked;
+            atomic_compare_exchange_strong(&conn->deadline_ms, &deadline, now + CONN_SEND_TIMEOUT_MS);
+            return;
+        }
+    }
+    atomic_store(&conn->deadline_ms, 0);
+    connection_count_timeout(conn);
+    //wakes the worker with an EOF (or EPIPE) and it closes the connection. closing the fd here could hand its number to someone else.
+    shutdown(conn->client_socket, SHUT_RDWR);
+}
+
+static void* watchdog_thread(void* arg) {
+    while (true) {
+        //deadlines are seconds away. a scan every CONN_WATCHDOG_SCAN_MS is plenty, and costs a load per fd.
+        usleep(1000 * CONN_WATCHDOG_SCAN_MS);
+        uint64_t now = wheel_clock_ms();
+        int high = atomic_load(&watched_high);
+        for (int fd=0;fd<high;fd++) {
+            connection_t* conn = atomic_load_explicit(&watched[fd], memory_order_relaxed);
+            if (conn == NULL || conn == WATCHDOG_BUSY || !atomic_compare_exchange_strong(&watched[fd], &conn, WATCHDOG_BUSY)) {
+                continue;
+            }
+            watchdog_check(conn, now);
+            atomic_store(&watched[fd], conn);
+        }
+    }
+    return NULL;
+}
+
+static void start_watchdog() {
+    struct rlimit rl;
+    pthread_t t;
+    watched_size = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? (int)rl.rlim_cur : 65536;
+    watched = calloc(watched_size, sizeof(*watched));
+    pthread_create(&t, NULL, watchdog_thread, NULL);
+    pthread_detach(t);
+}
+
+static void watch(connection_t* conn) {
+    pthread_once(&watchdog_once, start_watchdog);
+    int fd = conn->client_socket;
+    if (fd < 0 || fd >= watched_size) {
+        return;     //past the fd limit we started with. it goes without deadlines
+    }
+    atomic_store(&watched[fd], conn);
+    int high = atomic_load(&watched_high);
+    while (fd >= high && !atomic_compare_exchange_weak(&watched_high, &high, fd + 1)) {
+    }
+}
+
+//before the close: once the fd is closed its number can be reused, and the watchdog mustn't shut down a stranger.
+static void unwatch(connection_t* conn) {
+    int fd = conn->client_socket;
+    if (fd < 0 || fd >= watched_size) {
+        return;
+    }
+    connection_t* expected = conn;
+    while (!atomic_compare_exchange_weak(&watched[fd], &expected, NULL)) {
+        //the watchdog is in the middle of looking at it. that's a getsockopt() at most.
+        expected = conn;
+        sched_yield();
+    }
+}
+
+//pool mode: the worker is about to block on the socket. puts the wait under the watchdog. the deadline is only written when the
+//kind of wait changes: while a response goes out, the watchdog pushes it back itself as long as the client acks something.
+static void block_begin(connection_t* conn) {
+    if (!conn->blocking) {
+        return;
+    }
+    conn_wait_t wait = wait_of(conn);
+    if (wait != conn->wait || atomic_load_explicit(&conn->deadline_ms, memory_order_relaxed) == 0) {
+        if (wait == CONN_WAIT_SEND) {
+            conn->acked = bytes_acked(conn);
+        }
+        conn->wait = wait;
+        atomic_store_explicit(&conn->deadline_ms, wheel_clock_ms() + wait_timeout_ms[wait], memory_order_release);
+    }
+    __atomic_store_n(&conn->blocked, true, __ATOMIC_RELAXED);
+}
+
+static void block_end(connection_t* conn) {
+    if (conn->blocking) {
+        __atomic_store_n(&conn->blocked, false, __ATOMIC_RELAXED);
+    }
+}
+
+connection_t* connection_of_timer(wheel_timer_t* t) {
+    return (connection_t*)((char*)t - offsetof(connection_t, timer));
+}
+
+void connection_count_timeout(connection_t* conn) {
+    static const metric_counter_t counter[] = {
+        [CONN_WAIT_REQUEST] = M_TIMEOUTS_REQUEST,
+        [CONN_WAIT_IDLE] = M_TIMEOUTS_IDLE,
+        [CONN_WAIT_SEND] = M_TIMEOUTS_SEND,
+        [CONN_WAIT_NONE] = M_TIMEOUTS_REQUEST,
+    };
+    metrics_count(counter[conn->wait], 1);
+    log_debug("connection timed out");
+}
+
+void connection_arm_timer(connection_t* conn, timer_wheel_t* w) {
+    bool pending = wheel_pending(&conn->timer);
+
+    //the client isn't holding us up, and the connection can't be closed under the I/O thread anyway. the response that follows
+    //gets a fresh send deadline.
+    if (conn->state == CONN_OPENING) {
+        wheel_cancel(w, &conn->timer);
+        return;
+    }
+    conn_wait_t wait = wait_of(conn);
+    if (wait == CONN_WAIT_SEND) {
+        //pushed back whenever more of the response has gone out since.
+        uint64_t progress = conn->head_off + (conn->send_body ? conn->sender.offset : 0);
+        if (conn->wait == CONN_WAIT_SEND && progress == conn->progress && pending) {
+            return;
+        }
+        conn->progress = progress;
+    } else if (conn->wait == wait && pending) {
+        return;
+    }
+    conn->wait = wait;
+    wheel_schedule(w, &conn->timer, wait_timeout_ms[wait]);
+}
+
+void connection_init(connection_t* conn, int client_socket, bool blocking) {
+    conn->client_socket = client_socket;
+    conn->blocking = blocking;
+    conn->state = CONN_READING;
+    http_parser_reset(&conn->parser);
+    conn->in_len = 0;
+    conn->body_left = 0;
+    conn->keep_alive = false;
+    conn->legacy = false;
+    conn->head_len = conn->head_off = 0;
+    conn->send_body = false;
+    conn->file = NULL;
+    filesend_setup(&conn->sender);
+    conn->nranges = conn->part = 0;
+    conn->request_start = conn->send_start = 0;
+    conn->cq = NULL;
+    conn->client = NULL;
+    conn->pacing = 0;
+    wheel_timer_init(&conn->timer);
+    conn->wait = CONN_WAIT_REQUEST;
+    conn->progress = 0;
+    atomic_init(&conn->deadline_ms, 0);
+    conn->acked = 0;
+    conn->blocked = false;
+    conn->tls = NULL;
+    conn->ktls = false;
+    if (tls_enabled) {
+        //a NULL session fails the handshake straight away, and the connection is closed.
+        conn->tls = tls_new(client_socket);
+        conn->state = CONN_HANDSHAKE;
+    }
+
+    if (blocking) {
+        watch(conn);
+    }
+}
+
+void connection_release(connection_t* conn) {
+    if (conn->file != NULL) {
+        cache_put(conn->file);
+        conn->file = NULL;
+    }
+}
+
+static void count_response(int status) {
+    metrics_count(status >= 500 ? M_RESPONSES_5XX : status >= 400 ? M_RESPONSES_4XX : status >= 300 ? M_RESPONSES_3XX : M_RESPONSES_2XX, 1);
+}
+
+//extra is more header lines ("Name: value\r\n"...), or "".
+static void respond_error_with(connection_t* conn, int status, bool head_only, bool close, const char* extra) {
+    const char* text = http_status_text(status);
+    count_response(status);
+    if (close) {
+        conn->keep_alive = false;
+    }
+    conn->send_body = false;
+    conn->head_off = 0;
+    conn->state = CONN_SENDING_HEAD;
+    if (conn->legacy) {
+        //the old protocol has no way to report errors: it just hangs up.
+        conn->head_len = 0;
+        conn->keep_alive = false;
+        return;
+    }
+    //the body is "<status> <text>\n" so a human poking at the server with nc can see what went wrong.
+    conn->head_len = snprintf(conn->head, RESPONSE_HEAD_MAX,
+        "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n%sConnection: %s\r\n\r\n",
+        status, text, strlen(text) + 5, extra, conn->keep_alive ? "keep-alive" : "close");
+    if (!head_only) {
+        conn->head_len += snprintf(conn->head + conn->head_len, RESPONSE_HEAD_MAX - conn->head_len, "%d %s\n", status, text);
+    }
+}
+
+static void respond_error(connection_t* conn, int status, bool head_only, bool close) {
+    respond_error_with(conn, status, head_only, close, "");
+}
+
+static void make_boundary() {
+    unsigned long long r = 0;
+    if (getrandom(&r, sizeof(r), 0) != sizeof(r)) {
+        r = (unsigned long long)time(NULL) * 0x9e3779b97f4a7c15ULL ^ getpid();
+    }
+    snprintf(boundary, sizeof(boundary), "%016llx", r);
+}
+
+//what goes in front of part i of a multipart/byteranges body, or after the last part for i == nranges. out may be NULL, to measure.
+static int part_header(connection_t* conn, int i, char* out, size_t size) {
+    if (i == conn->nranges) {
+        return snprintf(out, size, "\r\n--%s--\r\n", boundary);
+    }
+    return snprintf(out, size, "\r\n--%s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    boundary, conn->ranges[i].first, conn->ranges[i].last, (long long)conn->file->size);
+}
+
+//a multipart response sends head[] and one range of the file per part. this sets up the next one: a part, or the closing boundary.
+static bool next_part(connection_t* conn) {
+    if (conn->part >= conn->nranges) {
+        conn->nranges = conn->part = 0;
+        return false;
+    }
+    conn->part++;
+    conn->head_len = part_header(conn, conn->part, conn->head, RESPONSE_HEAD_MAX);
+    conn->head_off = 0;
+    conn->send_body = conn->part < conn->nranges;
+    if (conn->send_body) {
+        http_range_t* r = &conn->ranges[conn->part];
+        filesend_set_range(&conn->sender, r->first, r->last - r->first + 1);
+    }
+    conn->state = CONN_SENDING_HEAD;
+    return true;
+}
+
+//If-Range: the range only goes out if the file is still the version the client has the rest of. an ETag has to match exactly
+//(weak ones never do), a date has to be the file's Last-Modified.
+static bool if_range_holds(const http_request_t* req, const cache_entry_t* file) {
+    size_t len;
+    const char* value = http_find_header(req, "If-Range", &len);
+    if (value == NULL) {
+        return true;
+    }
+    if (len > 0 && value[0] == '"') {
+        return strlen(file->etag) == len && memcmp(file->etag, value, len) == 0;
+    }
+    time_t t;
+    return http_parse_date(value, len, &t) && t == file->mtime.tv_sec;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+//turns the request target into a filesystem path. legacy requests are taken as-is, HTTP targets lose their query string and are percent-decoded.
+static bool target_to_path(const http_request_t* req, bool legacy, char* path, size_t size) {
+    size_t j = 0;
+    if (legacy) {
+        if (req->target_len >= size) {
+            return false;
+        }
+        memcpy(path, req->target, req->target_len);
+        path[req->target_len] = 0;
+        return true;
+    }
+    if (req->target[0] != '/') {
+        return false;
+    }
+    for (size_t i=0;i<req->target_len;i++) {
+        char c = req->target[i];
+        if (c == '?' || c == '#') {
+            break;
+        }
+        if (c == '%') {
+            int hi, lo;
+            if (i + 2 >= req->target_len || (hi = hex_value(req->target[i+1])) < 0 || (lo = hex_value(req->target[i+2])) < 0) {
+                return false;
+            }
+            c = (char)(hi * 16 + lo);
+            i += 2;
+            if (c == 0) {
+                return false;
+            }
+        }
+        if (j + 1 >= size) {
+            return false;
+        }
+        path[j++] = c;
+    }
+    path[j] = 0;
+    return true;
+}
+
+//a compressed representation is different bytes, so it can't share the file's strong tag. it gets the tag with the coding on the
+//end ("...-gzip"), the way mod_deflate does it.
+static void representation_etag(const char* etag, content_coding_t coding, char* out) {
+    if (coding == CODING_IDENTITY) {
+        snprintf(out, RESPONSE_ETAG_MAX, "%s", etag);
+    } else {
+        snprintf(out, RESPONSE_ETAG_MAX, "%.*s-%s\"", (int)strlen(etag) - 1, etag, encoding_name(coding));
+    }
+}
+
+//true if tag (quotes included) is etag or one of its representations'.
+static bool etag_names(const char* tag, size_t len, const char* etag) {
+    size_t etag_len = strlen(etag);
+    if (len == etag_len) {
+        return memcmp(tag, etag, len) == 0;
+    }
+    if (len < etag_len + 2 || memcmp(tag, etag, etag_len - 1) != 0 || tag[etag_len - 1] != '-') {
+        return false;
+    }
+    for (int c=CODING_IDENTITY+1;c<CODING_COUNT;c++) {
+        const char* name = encoding_name(c);
+        if (len == etag_len + strlen(name) + 1 && memcmp(tag + etag_len, name, strlen(name)) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool connection_etag_listed(const char* list, size_t len, const char* etag, char* matched) {
+    size_t i = 0;
+    while (true) {
+        while (i < len && (list[i] == ' ' || list[i] == '\t' || list[i] == ',')) {
+            i++;
+        }
+        if (i == len) {
+            return false;
+        }
+        if (list[i] == '*') {
+            snprintf(matched, RESPONSE_ETAG_MAX, "%s", etag);
+            return true;
+        }
+        if (i + 1 < len && list[i] == 'W' && list[i+1] == '/') {
+            i += 2;
+        }
+        if (i == len || list[i] != '"') {
+            return false;
+        }
+        const char* end = memchr(list + i + 1, '"', len - i - 1);
+        if (end == NULL) {
+            return false;
+        }
+        size_t tag_len = end + 1 - (list + i);
+        if (etag_names(list + i, tag_len, etag)) {
+            snprintf(matched, RESPONSE_ETAG_MAX, "%.*s", (int)tag_len, list + i);
+            return true;
+        }
+        i += tag_len;
+    }
+}
+
+//true if the client's copy of the file is current. If-None-Match decides if it was sent, If-Modified-Since otherwise.
+static bool not_modified(const http_request_t* req, const char* etag, time_t mtime, char* matched) {
+    size_t len;
+    const char* value = http_find_header(req, "If-None-Match", &len);
+    if (value != NULL) {
+        return connection_etag_listed(value, len, etag, matched);
+    }
+    time_t since;
+    value = http_find_header(req, "If-Modified-Since", &len);
+    //a date in the future is no date at all (RFC 9110 13.1.3): the client's clock or the header is wrong.
+    if (value != NULL && http_parse_date(value, len, &since) && since <= time(NULL) && mtime <= since) {
+        snprintf(matched, RESPONSE_ETAG_MAX, "%s", etag);
+        return true;
+    }
+    return false;
+}
+
+//the ETag, Last-Modified and Cache-Control lines of a response for the file.
+static int validator_headers(char* out, size_t size, const char* etag, struct timespec mtime) {
+    char date[HTTP_DATE_MAX];
+    http_format_date(mtime.tv_sec, date);
+    if (connection_max_age > 0) {
+        return snprintf(out, size, "ETag: %s\r\nLast-Modified: %s\r\nCache-Control: public, max-age=%d\r\n", etag, date, connection_max_age);
+    }
+    return snprintf(out, size, "ETag: %s\r\nLast-Modified: %s\r\nCache-Control: no-cache\r\n", etag, date);
+}
+
+static void respond_not_modified(connection_t* conn, const char* etag, struct timespec mtime) {
+    char validators[192];
+    validator_headers(validators, sizeof(validators), etag, mtime);
+    count_response(304);
+    conn->send_body = false;
+    conn->head_off = 0;
+    conn->state = CONN_SENDING_HEAD;
+    conn->head_len = snprintf(conn->head, RESPONSE_HEAD_MAX, "HTTP/1.1 304 Not Modified\r\n%sConnection: %s\r\n\r\n",
+                              validators, conn->keep_alive ? "keep-alive" : "close");
+}
+
+static bool is_conditional(const connection_t* conn, const http_request_t* req) {
+    size_t len;
+    return !conn->legacy
+        && (http_find_header(req, "If-None-Match", &len) != NULL || http_find_header(req, "If-Modified-Since", &len) != NULL);
+}
+
+//a pool worker's completion queue. it only ever has the one job on it, which the worker waits for.
+static io_completions_t* worker_completions() {
+    static __thread io_completions_t cq;
+    static __thread bool ready;
+    if (!ready) {
+        iocq_init(&cq, true);
+        ready = true;
+    }
+    return &cq;
+}
+
+static void respond_with_file(connection_t* conn, const http_request_t* req, const char* path, bool head_only, bool conditional);
+
+static void start_response(connection_t* conn, const http_request_t* req) {
+    char path[PATH_MAX+1];
+    docroot_file_t file;
+    bool head_only = http_method_is(req, "HEAD");
+
+    conn->legacy = req->version_minor == -1;
+    //a process on its way out after a reload closes every connection after the response in hand.
+    conn->keep_alive = req->keep_alive && !reload_draining();
+    log_info("REQUEST: %.*s %.*s\n", (int)req->method_len, req->method, (int)req->target_len, req->target);
+
+    //-R: the client's out of requests for now. the connection stays, it just has to wait before it asks again.
+    int retry_after;
+    if (!ratelimit_allow_request(conn->client, &retry_after)) {
+        char extra[32];
+        snprintf(extra, sizeof(extra), "Retry-After: %d\r\n", retry_after);
+        metrics_count(M_RATE_LIMITED, 1);
+        respond_error_with(conn, 429, head_only, false, extra);
+        return;
+    }
+    //-B: the kernel paces what we send to the client's current share. it only changes when the client opens or closes connections.
+    uint64_t pacing = ratelimit_pacing(conn->client);
+    if (pacing != conn->pacing) {
+        unsigned int rate = pacing == 0 || pacing > UINT_MAX ? UINT_MAX : (unsigned int)pacing;
+        setsockopt(conn->client_socket, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+        conn->pacing = pacing;
+    }
+
+    //we can't find the end of a chunked body without decoding it, and a body we can't skip would desync the connection.
+    if (req->chunked) {
+        respond_error(conn, 501, head_only, true);
+        return;
+    }
+    if (req->content_length > MAX_REQUEST_BODY) {
+        respond_error(conn, 413, head_only, true);
+        return;
+    }
+    if (!head_only && !http_method_is(req, "GET")) {
+        respond_error(conn, 405, false, false);
+        return;
+    }
+    if (!target_to_path(req, conn->legacy, path, sizeof(path))) {
+        respond_error(conn, 400, head_only, false);
+        return;
+    }
+    //with -d the path is looked up in the docroot index, which also keeps it inside the root. without it, the path is the file.
+    //timed from when the request was parsed: decoding the target is nothing next to realpath's lstat() per component.
+    bool resolved = docroot_enabled ? docroot_lookup(path, &file) : realpath(path, file.path) != NULL;
+    metrics_observe(H_REALPATH, conn->request_start);
+    if (!resolved) {
+        log_info("ERROR(bad path): %s\n", path);
+        respond_error(conn, 404, head_only, false);
+        return;
+    }
+
+    //a conditional request for a file that hasn't changed is answered without opening it. the docroot index has its tag, and
+    //without -d a stat() still costs far less than opening and reading it. content tags (-e) need the contents: see below.
+    //files that don't know their size (/proc) change all the time without their mtime saying so, and are never validated.
+    char matched[RESPONSE_ETAG_MAX];
+    bool conditional = is_conditional(conn, req);
+    if (conditional && !cache_content_etags) {
+        struct stat st;
+        bool known = docroot_enabled;
+        if (!known && stat(file.path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            docroot_etag(st.st_ino, st.st_size, st.st_mtim, file.etag);
+            file.mtime = st.st_mtim;
+            known = true;
+        }
+        if (known && not_modified(req, file.etag, file.mtime.tv_sec, matched)) {
+            respond_not_modified(conn, matched, file.mtime);
+            return;
+        }
+    }
+
+    //a hit is answered on the spot. a miss may have to wait on the disk, so it goes to the I/O threads and the connection waits in
+    //CONN_OPENING (see connection_resume()). with none to hand it to, or none free, we load it ourselves.
+    if ((conn->file = cache_lookup(file.path, docroot_enabled ? &file : NULL)) == NULL) {
+        conn->job.file = file;
+        conn->job.indexed = docroot_enabled;
+        io_completions_t* cq = conn->blocking ? worker_completions() : conn->cq;
+        if (cq != NULL && iopool_submit(&conn->job, cq)) {
+            conn->req = *req;
+            conn->state = CONN_OPENING;
+            return;
+        }
+        iopool_run(&conn->job);
+        if ((conn->file = conn->job.entry) == NULL) {
+            log_info("ERROR(open): %s\n", path);
+            respond_error(conn, 404, head_only, false);
+            return;
+        }
+    }
+    respond_with_file(conn, req, path, head_only, conditional);
+}
+
+//the response for a file we have open: req asked for path, resolved to conn->file.
+static void respond_with_file(connection_t* conn, const http_request_t* req, const char* path, bool head_only, bool conditional) {
+    char matched[RESPONSE_ETAG_MAX];
+    if (conditional && cache_content_etags && conn->file->size > 0 && not_modified(req, conn->file->etag, conn->file->mtime.tv_sec, matched)) {
+        struct timespec mtime = conn->file->mtime;
+        connection_release(conn);
+        respond_not_modified(conn, matched, mtime);
+        return;
+    }
+    //every representation's validators derive from the file's.
+    char plain_etag[DOCROOT_ETAG_MAX];
+    memcpy(plain_etag, conn->file->etag, DOCROOT_ETAG_MAX);
+    struct timespec mtime = conn->file->mtime;
+    //a range is always of the file as it is: a resumed download must get the same bytes it started on, whatever got compressed since.
+    size_t range_len = 0;
+    const char* range = conn->legacy ? NULL : http_find_header(req, "Range", &range_len);
+    if (range != NULL && !if_range_holds(req, conn->file)) {
+        range = NULL;
+    }
+
+    //a compressed representation, if the client takes one and we have it. the legacy protocol has no headers to negotiate with.
+    content_coding_t coding = CODING_IDENTITY;
+    bool vary = false;
+    if (!conn->legacy && range == NULL) {
+        encoding_accept_t accept;
+        encoding_parse_accept(req, &accept);
+        cache_entry_t* encoded = encoding_pick(conn->file, path, &accept, &coding, &vary);
+        if (encoded != NULL) {
+            cache_put(conn->file);
+            conn->file = encoded;
+            metrics_count(coding == CODING_GZIP ? M_ENCODED_GZIP : M_ENCODED_ZSTD, 1);
+        }
+    }
+    if (!cache_sender_init(&conn->sender, conn->file, conn->buffer)) {
+        connection_release(conn);
+        respond_error(conn, 500, head_only, true);
+        return;
+    }
+    //without kTLS the body has to pass through SSL_write(), so it's copied (or sent from memory) whatever -s says.
+    if (conn->tls != NULL && !conn->ktls) {
+        filesend_set_writer(&conn->sender, tls_write, conn->tls);
+    }
+
+    long long size = conn->sender.size;
+    int nranges = range != NULL && conn->sender.sized ? http_parse_ranges(range, range_len, size, conn->ranges, HTTP_MAX_RANGES) : -1;
+    if (nranges == 0) {
+        char content_range[64];
+        snprintf(content_range, sizeof(content_range), "Content-Range: bytes */%lld\r\n", size);
+        connection_release(conn);
+        respond_error_with(conn, 416, head_only, false, content_range);
+        return;
+    }
+
+    count_response(nranges > 0 ? 206 : 200);
+    conn->send_body = !head_only;
+    conn->head_off = 0;
+    conn->state = CONN_SENDING_HEAD;
+    char encoding[64] = "";
+    int n = 0;
+    if (coding != CODING_IDENTITY) {
+        n = snprintf(encoding, sizeof(encoding), "Content-Encoding: %s\r\n", encoding_name(coding));
+    }
+    if (vary) {
+        snprintf(encoding + n, sizeof(encoding) - n, "Vary: Accept-Encoding\r\n");
+    }
+    const char* connection = conn->keep_alive ? "keep-alive" : "close";
+    char etag[RESPONSE_ETAG_MAX];
+    char validators[192];
+    representation_etag(plain_etag, coding, etag);
+    validator_headers(validators, sizeof(validators), etag, mtime);
+    if (conn->legacy) {
+        conn->head_len = 0;
+    } else if (nranges == 1) {
+        http_range_t* r = &conn->ranges[0];
+        filesend_set_range(&conn->sender, r->first, r->last - r->first + 1);
+        conn->head_len = snprintf(conn->head, RESPONSE_HEAD_MAX,
+            "HTTP/1.1 206 Partial Content\r\nContent-Length: %lld\r\nContent-Range: bytes %lld-%lld/%lld\r\n%sConnection: %s\r\n\r\n",
+            r->last - r->first + 1, r->first, r->last, size, validators, connection);
+    } else if (nranges > 1) {
+        //the body is every part's header and range, then the closing boundary. the parts go out one at a time (see next_part()).
+        pthread_once(&boundary_once, make_boundary);
+        conn->nranges = nranges;
+        long long length = part_header(conn, nranges, NULL, 0);
+        for (int i=0;i<nranges;i++) {
+            length += part_header(conn, i, NULL, 0) + conn->ranges[i].last - conn->ranges[i].first + 1;
+        }
+        conn->head_len = snprintf(conn->head, RESPONSE_HEAD_MAX,
+            "HTTP/1.1 206 Partial Content\r\nContent-Length: %lld\r\nContent-Type: multipart/byteranges; boundary=%s\r\n%sConnection: %s\r\n\r\n",
+            length, boundary, validators, connection);
+        if (head_only) {
+            conn->nranges = 0;
+        } else {
+            conn->part = 0;
+            conn->head_len += part_header(conn, 0, conn->head + conn->head_len, RESPONSE_HEAD_MAX - conn->head_len);
+            filesend_set_range(&conn->sender, conn->ranges[0].first, conn->ranges[0].last - conn->ranges[0].first + 1);
+        }
+    } else if (conn->sender.sized) {
+        conn->head_len = snprintf(conn->head, RESPONSE_HEAD_MAX,
+            "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\nAccept-Ranges: bytes\r\n%s%sConnection: %s\r\n\r\n", size, encoding, validators, connection);
+    } else if (req->version_minor >= 1) {
+        //no length up front (e.g. /proc files). HTTP/1.1 clients get it in chunks, and the connection lives on.
+        conn->sender.chunked = true;
+        conn->head_len = snprintf(conn->head, RESPONSE_HEAD_MAX, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n%sConnection: %s\r\n\r\n",
+            encoding, connection);
+    } else {
+        //...and for HTTP/1.0 ones, closing the connection marks the end of the body.
+        conn->keep_alive = false;
+        conn->head_len = snprintf(conn->head, RESPONSE_HEAD_MAX, "HTTP/1.1 200 OK\r\n%sConnection: close\r\n\r\n", encoding);
+    }
+}
+
+//drops the request (and whatever part of its body has arrived) from the front of the input buffer.
+//anything after it is the next pipelined request.
+static void consume_request(connection_t* conn, const http_request_t* req) {
+    size_t consumed = req->header_len;
+    long long body = conn->in_len - consumed;
+    if (body > req->content_length) {
+        body = req->content_length;
+    }
+    consumed += body;
+    conn->body_left = req->content_length - body;
+    memmove(conn->in, conn->in + consumed, conn->in_len - consumed);
+    conn->in_len -= consumed;
+    http_parser_reset(&conn->parser);
+}
+
+bool connection_response_done(connection_t* conn) {
+    metrics_count(M_SENT_BYTES, conn->head_len + (conn->send_body ? conn->sender.offset - conn->sender.start : 0));
+    if (next_part(conn)) {
+        return true;
+    }
+    uint64_t now = metrics_now();
+    if (now != 0) {
+        metrics_observe_ns(H_SEND, now - conn->send_start);
+        metrics_observe_ns(H_REQUEST, now - conn->request_start);
+    }
+    connection_release(conn);
+    conn->head_len = conn->head_off = 0;
+    conn->state = CONN_READING;
+    conn->wait = CONN_WAIT_NONE;
+    return conn->keep_alive;
+}
+
+//headers and an in-memory body (a small cached file, or a mapped one) in one sendmsg(), so a response costs a single syscall.
+static send_result_t send_head_and_body(connection_t* conn) {
+    file_sender_t* s = &conn->sender;
+    while (conn->head_off < conn->head_len || s->offset < s->size) {
+        size_t head_left = conn->head_len - conn->head_off;
+        struct iovec iov[2] = {
+            { conn->head + conn->head_off, head_left },
+            { (char*)s->data + s->offset, s->size - s->offset },
+        };
+        struct msghdr msg = { .msg_iov = head_left > 0 ? iov : iov + 1, .msg_iovlen = head_left > 0 ? 2 : 1 };
+        ssize_t sent = sendmsg(conn->client_socket, &msg, MSG_NOSIGNAL);
+        if (sent > 0) {
+            if ((size_t)sent < head_left) {
+                conn->head_off += sent;
+            } else {
+                conn->head_off = conn->head_len;
+                s->offset += sent - head_left;
+            }
+        } else if (sent == SOCKETERROR && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return SEND_AGAIN;
+        } else if (sent == SOCKETERROR && errno == EINTR) {
+            continue;
+        } else {
+            return SEND_ERROR;
+        }
+    }
+    return SEND_DONE;
+}
+
+//send() for the response head: through OpenSSL unless the kernel does the encrypting.
+static ssize_t send_head(connection_t* conn, int flags) {
+    if (conn->tls != NULL && !conn->ktls) {
+        return tls_write(conn->tls, conn->head + conn->head_off, conn->head_len - conn->head_off);
+    }
+    return send(conn->client_socket, conn->head + conn->head_off, conn->head_len - conn->head_off, flags);
+}
+
+//returns 1 if more bytes arrived, 0 if the (non-blocking) socket has nothing for us yet and -1 if the connection is over.
+static int read_more(connection_t* conn) {
+    while (true) {
+        ssize_t n = conn->tls != NULL ? tls_read(conn->tls, conn->in + conn->in_len, BUFSIZE - conn->in_len)
+                                      : read(conn->client_socket, conn->in + conn->in_len, BUFSIZE - conn->in_len);
+        if (n > 0) {
+            conn->in_len += n;
+            return 1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) && !conn->blocking) {
+            return 0;
+        }
+        return -1;
+    }
+}
+
+//throws away whatever part of the previous request's body is sitting in the buffer.
+static void skip_body(connection_t* conn) {
+    size_t skip = conn->body_left < (long long)conn->in_len ? (size_t)conn->body_left : conn->in_len;
+    memmove(conn->in, conn->in + skip, conn->in_len - skip);
+    conn->in_len -= skip;
+    conn->body_left -= skip;
+}
+
+bool connection_next_request(connection_t* conn) {
+    skip_body(conn);
+    if (conn->body_left > 0 || conn->in_len == 0) {
+        return false;
+    }
+    http_request_t req;
+    http_parse_result_t result = http_parse_request(&conn->parser, conn->in, conn->in_len, &req);
+    if (result == HTTP_PARSE_INCOMPLETE && conn->in_len < BUFSIZE) {
+        return false;
+    }
+    metrics_count(M_REQUESTS, 1);
+    conn->request_start = metrics_now();
+    if (result == HTTP_PARSE_OK) {
+        start_response(conn, &req);
+        if (conn->state == CONN_OPENING) {
+            //the request stays in in[] until connection_resume() is done with it.
+            return false;
+        }
+        consume_request(conn, &req);
+    } else {
+        respond_error(conn, result == HTTP_PARSE_ERROR ? 400 : 431, false, true);
+    }
+    conn->send_start = metrics_now();
+    return true;
+}
+
+connection_t* connection_of_job(io_job_t* job) {
+    return (connection_t*)((char*)job - offsetof(connection_t, job));
+}
+
+void connection_resume(connection_t* conn) {
+    http_request_t* req = &conn->req;
+    char path[PATH_MAX+1];
+    bool head_only = http_method_is(req, "HEAD");
+
+    metrics_observe(H_OFFLOAD, conn->job.queued);
+    //it made it through here once already.
+    target_to_path(req, conn->legacy, path, sizeof(path));
+    if ((conn->file = conn->job.entry) == NULL) {
+        log_info("ERROR(open): %s\n", path);
+        respond_error(conn, 404, head_only, false);
+    } else {
+        respond_with_file(conn, req, path, head_only, is_conditional(conn, req));
+    }
+    consume_request(conn, req);
+    conn->send_start = metrics_now();
+}
+
+conn_status_t connection_run(connection_t* conn) {
+    while (true) {
+        switch (conn->state) {
+            case CONN_HANDSHAKE: {
+                if (conn->tls == NULL) {
+                    return CONN_CLOSE;
+                }
+                block_begin(conn);
+                int done = tls_handshake(conn->tls, &conn->ktls);
+                block_end(conn);
+                if (done == 1) {
+                    conn->state = CONN_READING;
+                } else if (errno == EAGAIN && !conn->blocking) {
+                    return CONN_WANT_READ;
+                } else {
+                    log_debug("TLS handshake failed: %s", strerror(errno));
+                    return CONN_CLOSE;
+                }
+                break;
+            }
+            case CONN_READING: {
+                if (connection_next_request(conn) || conn->state == CONN_OPENING) {
+                    break;
+                }
+                block_begin(conn);
+                int got = read_more(conn);
+                block_end(conn);
+                if (got == 0) {
+                    return CONN_WANT_READ;
+                }
+                if (got < 0) {
+                    return CONN_CLOSE;
+                }
+                break;
+            }
+            case CONN_OPENING:
+                if (!conn->blocking) {
+                    return CONN_WANT_IO;
+                }
+                //the pool grows around a worker that's waiting, like one blocked on its socket.
+                iocq_take(conn->job.cq, true);
+                connection_resume(conn);
+                break;
+            case CONN_SENDING_HEAD:
+                if (conn->send_body && conn->sender.method == SEND_MEMORY && conn->sender.write == NULL) {
+                    block_begin(conn);
+                    send_result_t sent = send_head_and_body(conn);
+                    block_end(conn);
+                    if (sent == SEND_AGAIN) {
+                        return CONN_WANT_WRITE;
+                    }
+                    if (sent == SEND_ERROR || !connection_response_done(conn)) {
+                        return CONN_CLOSE;
+                    }
+                    break;
+                }
+                while (conn->head_off < conn->head_len) {
+                    //MSG_MORE holds the headers back so they share a segment with the start of the body.
+                    block_begin(conn);
+                    ssize_t sent = send_head(conn, MSG_NOSIGNAL | (conn->send_body ? MSG_MORE : 0));
+                    block_end(conn);
+                    if (sent > 0) {
+                        conn->head_off += sent;
+                    } else if (sent == SOCKETERROR && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        return CONN_WANT_WRITE;
+                    } else if (sent == SOCKETERROR && errno == EINTR) {
+                        continue;
+                    } else {
+                        return CONN_CLOSE;
+                    }
+                }
+                if (conn->send_body) {
+                    conn->state = CONN_SENDING_BODY;
+                } else if (!connection_response_done(conn)) {
+                    return CONN_CLOSE;
+                }
+                break;
+            case CONN_SENDING_BODY: {
+                block_begin(conn);
+                send_result_t sent = filesend(&conn->sender, conn->client_socket);
+                block_end(conn);
+                switch (sent) {
+                    case SEND_AGAIN:
+                        return CONN_WANT_WRITE;
+                    case SEND_ERROR:
+                        return CONN_CLOSE;
+                    case SEND_DONE:
+                        if (!connection_response_done(conn)) {
+                            return CONN_CLOSE;
+                        }
+                        break;
+                }
+                break;
+            }
+        }
+    }
+}
+
+void connection_reject(connection_t* conn) {
+    memcpy(conn->head, admission_503, admission_503_len);
+    conn->head_len = admission_503_len;
+    conn->head_off = 0;
+    conn->keep_alive = false;
+    conn->send_body = false;
+    conn->state = CONN_SENDING_HEAD;
+}
+
+void connection_close(connection_t* conn) {
+    if (conn->blocking) {
+        unwatch(conn);
+    }
+    metrics_count(M_CLOSED, 1);
+    connection_release(conn);
+    filesend_release(&conn->sender);
+    ratelimit_detach(conn->client);
+    conn->client = NULL;
+    if (conn->tls != NULL) {
+        tls_close(conn->tls);
+    }
+    close(conn->client_socket);
+}
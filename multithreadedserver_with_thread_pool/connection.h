@@ -0,0 +1,149 @@
+#ifndef CONNECTION_H_
+#define CONNECTION_H_
+
+#include<stdbool.h>
+#include<stdint.h>
+#include<stdatomic.h>
+#include "server.h"
+#include "httpparser.h"
+#include "filesend.h"
+#include "filecache.h"
+#include "timerwheel.h"
+#include "iopool.h"
+
+//one client connection speaking HTTP/1.x (or the legacy "path\n" protocol). the same state machine serves both server modes:
+//pool workers drive it on a blocking socket and it simply runs to completion, the epoll reactors drive it on a non-blocking
+//socket and it hands back control whenever the socket would block.
+//connections are persistent (keep-alive) and pipelined requests are answered in order straight from the input buffer.
+#define RESPONSE_HEAD_MAX 512
+#define RESPONSE_ETAG_MAX (DOCROOT_ETAG_MAX + 8)    //room for a coding on the end ("...-gzip")
+#define MAX_REQUEST_BODY (1 << 20)  //request bodies we are willing to read and throw away to keep a connection alive
+
+//-A: how many seconds a client may reuse a file without asking again (Cache-Control: max-age). 0 sends "no-cache": clients keep
+//the file but check back every time, which the ETag makes a header-only round trip while it hasn't changed.
+extern int connection_max_age;
+
+//how long a connection may wait on its client before it's closed. the request deadline runs from the first byte of a request
+//(or from accept) and isn't pushed back by more bytes trickling in, so a client can't hold on to a connection by sending a header
+//a byte at a time. the send deadline is pushed back whenever the client takes some of the response off our hands.
+//the event loops keep these in a timer wheel each (timerwheel.c). pool workers block in read()/send(), so each of their connections
+//keeps its deadline itself and a watchdog thread scans for the ones that passed. it shuts the socket down under the worker, who then
+//sees EOF or EPIPE and closes up as usual.
+#define CONN_REQUEST_TIMEOUT_MS 10000   //to get a whole request in
+#define CONN_IDLE_TIMEOUT_MS 5000       //keep-alive: for the next request to start
+#define CONN_SEND_TIMEOUT_MS 30000      //for the client to read any of the response
+#define CONN_WATCHDOG_SCAN_MS 100       //how often the pool's watchdog looks at the deadlines
+
+typedef enum {
+    CONN_HANDSHAKE,     //TLS only: the handshake isn't done yet
+    CONN_READING,       //waiting for (the rest of) a request
+    CONN_OPENING,       //an I/O thread is loading the file (see iopool.h). the connection mustn't be closed until it's back
+    CONN_SENDING_HEAD,  //writing the status line and headers
+    CONN_SENDING_BODY,  //streaming the file
+} conn_state_t;
+
+//what the connection's timer is running for.
+typedef enum {
+    CONN_WAIT_REQUEST,
+    CONN_WAIT_IDLE,
+    CONN_WAIT_SEND,
+    CONN_WAIT_NONE,     //a response just finished: whatever comes next starts a new deadline
+} conn_wait_t;
+
+typedef enum {
+    CONN_WANT_READ,     //call connection_run() again once the socket is readable
+    CONN_WANT_WRITE,    //...or writable
+    CONN_WANT_IO,       //...or once its job comes back from the I/O threads: connection_resume() first
+    CONN_CLOSE,         //done. call connection_close()
+} conn_status_t;
+
+typedef struct connection {
+    int client_socket;
+    bool blocking;          //driven by a pool worker rather than a reactor
+    conn_state_t state;
+    struct ssl_st* tls;     //the TLS session with -T, NULL otherwise
+    bool ktls;              //...and the kernel encrypts what we send, so it can go out like plaintext
+
+    http_parser_t parser;
+    size_t in_len;          //bytes of in[] holding unprocessed requests
+    long long body_left;    //bytes of the last request's body still to be read and discarded
+
+    bool keep_alive;
+    bool legacy;            //answer with the raw file only, like the old protocol
+    char head[RESPONSE_HEAD_MAX];
+    size_t head_len;
+    size_t head_off;
+    bool send_body;
+    cache_entry_t* file;
+    file_sender_t sender;
+    http_range_t ranges[HTTP_MAX_RANGES];   //multipart/byteranges: the parts of the file to send, one after the other
+    int nranges;                            //0 for any other response
+    int part;                               //the part in flight. nranges: the closing boundary
+    uint64_t request_start; //metrics_now() when the request was parsed, 0 if metrics are off
+    uint64_t send_start;    //...and when its response was ready to go
+
+    io_job_t job;           //the cache miss in the I/O threads' hands while CONN_OPENING
+    http_request_t req;     //...and the request waiting on it. it points into in[], which stays put until the request is answered
+    io_completions_t* cq;   //the event loop's completion queue. NULL: misses are loaded inline (pool workers have one of their own)
+
+    struct client* client;  //who's at the other end, for the per-client limits (see ratelimit.h). NULL: unlimited
+    uint64_t pacing;        //the socket's SO_MAX_PACING_RATE, 0 if we never set one
+
+    wheel_timer_t timer;
+    conn_wait_t wait;
+    uint64_t progress;      //event loops: response bytes out when the send deadline was last pushed back
+    _Atomic uint64_t deadline_ms;   //pool mode: when the current wait runs out (wheel_clock_ms()), 0 for none
+    uint64_t acked;         //pool mode: the client's bytes acked when the send deadline was last set or pushed back
+    bool blocked;           //pool mode: the worker is in a read or send the watchdog may cut short
+
+    char in[BUFSIZE];
+    char buffer[BUFSIZE];   //scratch for the copy send path
+} connection_t;
+
+void connection_init(connection_t* conn, int client_socket, bool blocking);
+
+// advances the connection as far as the socket allows.
+conn_status_t connection_run(connection_t* conn);
+
+// releases the response in flight (if any) and closes the socket.
+void connection_close(connection_t* conn);
+
+// (re)schedules conn's timer in w for whatever it's waiting on now. call whenever the connection is about to wait on its socket.
+// cheap when nothing changed: a request deadline is left where it is, and a send deadline only moves if bytes went out since.
+void connection_arm_timer(connection_t* conn, timer_wheel_t* w);
+
+// the connection whose timer t is.
+connection_t* connection_of_timer(wheel_timer_t* t);
+
+// counts a connection closed because its timer went off.
+void connection_count_timeout(connection_t* conn);
+
+//the pieces connection_run() is made of, for I/O engines that do their own reads and writes (see uring.c).
+
+// works on what's already in in[] without touching the socket. returns true once a response is ready
+// (state is CONN_SENDING_HEAD: head[] holds the headers, send_body says whether sender follows), false if more input is needed
+// or the file went to the I/O threads (state is CONN_OPENING).
+bool connection_next_request(connection_t* conn);
+
+// the connection whose job this is.
+connection_t* connection_of_job(io_job_t* job);
+
+// picks up where connection_next_request() left off once the job is back: the response is ready (state is CONN_SENDING_HEAD).
+void connection_resume(connection_t* conn);
+
+// call once head[] and the body behind it are out. a multipart response then sets up its next part (state is CONN_SENDING_HEAD
+// again) and returns true. otherwise the response is complete: returns false if the connection should be closed now.
+bool connection_response_done(connection_t* conn);
+
+// sets up the 503 admission control answers with (see admission.h) as the response in flight, to be followed by a close.
+void connection_reject(connection_t* conn);
+
+// lets go of the file behind the response in flight, if any.
+void connection_release(connection_t* conn);
+
+// If-None-Match: true if list (the header's value, a list of tags or "*") names etag or one of its compressed representations'.
+// compared the weak way (a W/ in front doesn't matter), as conditional GETs are. the tag that matched goes into matched
+// (RESPONSE_ETAG_MAX bytes) for the 304 to carry.
+bool connection_etag_listed(const char* list, size_t len, const char* etag, char* matched);
+
+#endif
@@ -0,0 +1,553 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<dirent.h>
+#include<stdint.h>
+#include<stdatomic.h>
+#include<pthread.h>
+#include<sys/stat.h>
+#include<sys/inotify.h>
+#include<sys/syscall.h>
+#include<linux/openat2.h>
+#include "server.h"
+#include "docroot.h"
+#include "log.h"
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+typedef struct doc_entry {
+    char* key;              //relative to the root and normalized: "a/b.txt"
+    uint64_t hash;
+    char* real;
+    off_t size;
+    ino_t ino;
+    struct timespec mtime;
+    char etag[DOCROOT_ETAG_MAX];
+    unsigned generation;    //the walk that last saw it. a rescan drops whatever it didn't see
+    struct doc_entry* next;
+} doc_entry_t;
+
+//readers only ever hold a shard's lock for a probe and a copy, writers (the walkers and the inotify thread) for one update.
+typedef struct doc_shard {
+    pthread_rwlock_t lock;
+    doc_entry_t** buckets;
+    size_t nbuckets;        //grows so chains stay around one entry long
+    size_t count;
+} doc_shard_t;
+
+//the directories being walked. walkers take one, list it, and push the subdirectories they find for whoever is free.
+typedef struct walk {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char** dirs;
+    int ndirs;
+    int cap;
+    int pending;            //queued or being listed. the walk is over when this drops to 0
+} walk_t;
+
+bool docroot_enabled;
+
+static doc_shard_t shards[DOCROOT_SHARDS];
+static char root[PATH_MAX+1];   //canonical, no trailing slash ("" for /)
+static size_t root_len;
+static int root_fd;
+static int inotify_fd;
+static unsigned generation;
+static atomic_long files, watches, rescans;
+
+//inotify watch descriptor -> directory relative to the root.
+static char** watch_dirs;
+static int watch_cap;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hash_path(const char* path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static doc_shard_t* shard_of(uint64_t hash) {
+    return &shards[(hash >> 32) % DOCROOT_SHARDS];
+}
+
+static doc_entry_t* shard_find(doc_shard_t* shard, uint64_t hash, const char* key) {
+    for (doc_entry_t* e = shard->buckets[hash % shard->nbuckets]; e != NULL; e = e->next) {
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void shard_grow(doc_shard_t* shard) {
+    size_t n = shard->nbuckets * 2;
+    doc_entry_t** buckets = calloc(n, sizeof(doc_entry_t*));
+    for (size_t i=0;i<shard->nbuckets;i++) {
+        doc_entry_t* e = shard->buckets[i];
+        while (e != NULL) {
+            doc_entry_t* next = e->next;
+            e->next = buckets[e->hash % n];
+            buckets[e->hash % n] = e;
+            e = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = n;
+}
+
+static void entry_free(doc_entry_t* e) {
+    free(e->key);
+    free(e->real);
+    free(e);
+    atomic_fetch_sub(&files, 1);
+}
+
+static void index_put(const char* key, const char* real, const struct stat* st) {
+    uint64_t hash = hash_path(key);
+    doc_shard_t* shard = shard_of(hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    doc_entry_t* e = shard_find(shard, hash, key);
+    if (e == NULL) {
+        if (shard->count >= shard->nbuckets) {
+            shard_grow(shard);
+        }
+        e = calloc(1, sizeof(doc_entry_t));
+        e->key = strdup(key);
+        e->hash = hash;
+        e->next = shard->buckets[hash % shard->nbuckets];
+        shard->buckets[hash % shard->nbuckets] = e;
+        shard->count++;
+        atomic_fetch_add(&files, 1);
+    }
+    if (e->real == NULL || strcmp(e->real, real) != 0) {
+        free(e->real);
+        e->real = strdup(real);
+    }
+    e->size = st->st_size;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    docroot_etag(st->st_ino, st->st_size, st->st_mtim, e->etag);
+    e->generation = generation;
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+static void index_remove(const char* key) {
+    uint64_t hash = hash_path(key);
+    doc_shard_t* shard = shard_of(hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    for (doc_entry_t** link = &shard->buckets[hash % shard->nbuckets]; *link != NULL; link = &(*link)->next) {
+        doc_entry_t* e = *link;
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            *link = e->next;
+            shard->count--;
+            entry_free(e);
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+//drops everything under directory prefix, or (prefix NULL) everything the current generation's walk didn't see.
+static void index_remove_stale(const char* prefix) {
+    size_t len = prefix != NULL ? strlen(prefix) : 0;
+    for (int s=0;s<DOCROOT_SHARDS;s++) {
+        doc_shard_t* shard = &shards[s];
+        pthread_rwlock_wrlock(&shard->lock);
+        for (size_t i=0;i<shard->nbuckets;i++) {
+            doc_entry_t** link = &shard->buckets[i];
+            while (*link != NULL) {
+                doc_entry_t* e = *link;
+                bool stale = prefix != NULL ? strncmp(e->key, prefix, len) == 0 && e->key[len] == '/' : e->generation != generation;
+                if (stale) {
+                    *link = e->next;
+                    shard->count--;
+                    entry_free(e);
+                } else {
+                    link = &e->next;
+                }
+            }
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+static bool inside_root(const char* real) {
+    return strncmp(real, root, root_len) == 0 && real[root_len] == '/';
+}
+
+//(re)indexes key, named name in directory dirfd, or drops it if it's no longer something we serve.
+//symlinks aren't: the entry would carry the target's metadata, and nothing tells us when the target changes.
+static void index_file(int dirfd, const char* name, const char* key) {
+    struct stat st;
+    char full[PATH_MAX+1];
+
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1
+        || snprintf(full, sizeof(full), "%s/%s", root, key) >= (int)sizeof(full)) {
+        index_remove(key);
+        return;
+    }
+    if (S_ISREG(st.st_mode)) {
+        index_put(key, full, &st);
+    } else {
+        index_remove(key);
+    }
+}
+
+static void add_watch(const char* rel) {
+    char full[PATH_MAX+1];
+    if (snprintf(full, sizeof(full), "%s/%s", root, rel) >= (int)sizeof(full)) {
+        log_warn("docroot: can't watch %s/%s: path too long", root, rel);
+        return;
+    }
+    int wd = inotify_add_watch(inotify_fd, full, WATCH_MASK);
+    if (wd == -1) {
+        //most likely fs.inotify.max_user_watches. the directory is still indexed, it just won't notice changes.
+        log_warn("docroot: can't watch %s: %s", full, strerror(errno));
+        return;
+    }
+    pthread_mutex_lock(&watch_lock);
+    if (wd >= watch_cap) {
+        int cap = watch_cap ? watch_cap : 256;
+        while (cap <= wd) {
+            cap *= 2;
+        }
+        watch_dirs = realloc(watch_dirs, cap * sizeof(char*));
+        memset(watch_dirs + watch_cap, 0, (cap - watch_cap) * sizeof(char*));
+        watch_cap = cap;
+    }
+    if (watch_dirs[wd] == NULL) {
+        atomic_fetch_add(&watches, 1);
+    }
+    free(watch_dirs[wd]);
+    watch_dirs[wd] = strdup(rel);
+    pthread_mutex_unlock(&watch_lock);
+}
+
+//stops watching directory prefix and everything under it.
+static void remove_watches(const char* prefix) {
+    size_t len = strlen(prefix);
+    pthread_mutex_lock(&watch_lock);
+    for (int wd=0;wd<watch_cap;wd++) {
+        const char* dir = watch_dirs[wd];
+        if (dir != NULL && strncmp(dir, prefix, len) == 0 && (dir[len] == 0 || dir[len] == '/')) {
+            //the IN_IGNORED this produces frees the slot.
+            inotify_rm_watch(inotify_fd, wd);
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+static void walk_push(walk_t* w, char* rel) {
+    pthread_mutex_lock(&w->lock);
+    if (w->ndirs == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 64;
+        w->dirs = realloc(w->dirs, w->cap * sizeof(char*));
+    }
+    w->dirs[w->ndirs++] = rel;
+    w->pending++;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void scan_dir(walk_t* w, const char* rel) {
+    char key[PATH_MAX+1];
+    //watch before listing, so nothing that changes while we read the directory goes unnoticed.
+    add_watch(rel);
+    int fd = openat(root_fd, rel[0] ? rel : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    DIR* dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return;
+    }
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(key, sizeof(key), "%s%s%s", rel, rel[0] ? "/" : "", de->d_name) >= (int)sizeof(key)) {
+            continue;
+        }
+        struct stat st;
+        bool is_dir = de->d_type == DT_DIR
+            || (de->d_type == DT_UNKNOWN && fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+        if (is_dir) {
+            walk_push(w, strdup(key));
+        } else {
+            index_file(fd, de->d_name, key);
+        }
+    }
+    closedir(dir);
+}
+
+static void* walk_thread(void* arg) {
+    walk_t* w = arg;
+    while (true) {
+        pthread_mutex_lock(&w->lock);
+        while (w->ndirs == 0 && w->pending > 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->ndirs == 0) {
+            pthread_mutex_unlock(&w->lock);
+            return NULL;
+        }
+        char* rel = w->dirs[--w->ndirs];
+        pthread_mutex_unlock(&w->lock);
+
+        scan_dir(w, rel);
+        free(rel);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->pending == 0) {
+            pthread_cond_broadcast(&w->cond);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+//indexes and watches everything under rel with nthreads walkers (the caller being one of them).
+static void walk_tree(const char* rel, int nthreads) {
+    walk_t w = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+    pthread_t threads[DOCROOT_WALK_THREADS_MAX];
+
+    walk_push(&w, strdup(rel));
+    for (int i=1;i<nthreads;i++) {
+        pthread_create(&threads[i], NULL, walk_thread, &w);
+    }
+    walk_thread(&w);
+    for (int i=1;i<nthreads;i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(w.dirs);
+}
+
+static int walk_threads() {
+    int n = shard_cpus();
+    return n < 1 ? 1 : n > DOCROOT_WALK_THREADS_MAX ? DOCROOT_WALK_THREADS_MAX : n;
+}
+
+static void handle_event(const struct inotify_event* ev) {
+    char key[PATH_MAX+1];
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        //events were lost, so we no longer know what changed. walk everything again and drop what's gone.
+        log_warn("docroot: inotify queue overflowed, rescanning");
+        generation++;
+        walk_tree("", walk_threads());
+        index_remove_stale(NULL);
+        atomic_fetch_add(&rescans, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&watch_lock);
+    char* dir = ev->wd >= 0 && ev->wd < watch_cap && watch_dirs[ev->wd] != NULL ? strdup(watch_dirs[ev->wd]) : NULL;
+    if ((ev->mask & IN_IGNORED) && dir != NULL) {
+        free(watch_dirs[ev->wd]);
+        watch_dirs[ev->wd] = NULL;
+        atomic_fetch_sub(&watches, 1);
+    }
+    pthread_mutex_unlock(&watch_lock);
+
+    //events about the watched directory itself are covered by the ones its parent gets about it.
+    if (dir == NULL || ev->len == 0
+        || snprintf(key, sizeof(key), "%s%s%s", dir, dir[0] ? "/" : "", ev->name) >= (int)sizeof(key)) {
+        free(dir);
+        return;
+    }
+
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            index_remove_stale(key);
+            remove_watches(key);
+        }
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+            walk_tree(key, 1);
+        }
+    } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        index_remove(key);
+    } else {
+        int fd = dir[0] ? openat(root_fd, dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : root_fd;
+        if (fd != -1) {
+            index_file(fd, ev->name, key);
+            if (fd != root_fd) {
+                close(fd);
+            }
+        }
+    }
+    free(dir);
+}
+
+static void* watch_thread(void* arg) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        ssize_t n = read(inotify_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            log_warn("docroot: inotify read failed, the index won't follow changes any more: %s", strerror(errno));
+            return NULL;
+        }
+        for (char* p = buf; p < buf + n;) {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            handle_event(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+void docroot_init(const char* dir) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (realpath(dir, root) == NULL) {
+        perror(dir);
+        exit(1);
+    }
+    check(root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC), "docroot is not a directory");
+    if (strcmp(root, "/") == 0) {
+        root[0] = 0;
+    }
+    root_len = strlen(root);
+    for (int i=0;i<DOCROOT_SHARDS;i++) {
+        pthread_rwlock_init(&shards[i].lock, NULL);
+        shards[i].nbuckets = 64;
+        shards[i].buckets = calloc(shards[i].nbuckets, sizeof(doc_entry_t*));
+    }
+    check(inotify_fd = inotify_init1(IN_CLOEXEC), "inotify_init failed");
+
+    generation = 1;
+    walk_tree("", walk_threads());
+    docroot_enabled = true;
+
+    pthread_t t;
+    pthread_create(&t, NULL, watch_thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    log_info("Indexed %ld files in %ld directories under %s/ in %.1fms", atomic_load(&files), atomic_load(&watches), root,
+             (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+//collapses "//", "." and ".." the way a client would, into a path relative to the root. false if ".." would climb out of it.
+static bool normalize(const char* in, char* out, size_t size) {
+    size_t len = 0;
+    const char* p = in;
+    while (*p) {
+        while (*p == '/') {
+            p++;
+        }
+        const char* seg = p;
+        while (*p && *p != '/') {
+            p++;
+        }
+        size_t n = p - seg;
+        if (n == 0 || (n == 1 && seg[0] == '.')) {
+            continue;
+        }
+        if (n == 2 && seg[0] == '.' && seg[1] == '.') {
+            if (len == 0) {
+                return false;
+            }
+            while (len > 0 && out[len-1] != '/') {
+                len--;
+            }
+            if (len > 0) {
+                len--;
+            }
+            continue;
+        }
+        if (len + n + 2 > size) {
+            return false;
+        }
+        if (len > 0) {
+            out[len++] = '/';
+        }
+        memcpy(out + len, seg, n);
+        len += n;
+    }
+    out[len] = 0;
+    return len > 0;
+}
+
+bool docroot_lookup(const char* request_path, docroot_file_t* file) {
+    char key[PATH_MAX+1];
+    if (!normalize(request_path, key, sizeof(key))) {
+        return false;
+    }
+    uint64_t hash = hash_path(key);
+    doc_shard_t* shard = shard_of(hash);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    doc_entry_t* e = shard_find(shard, hash, key);
+    if (e != NULL) {
+        strcpy(file->path, e->real);
+        file->size = e->size;
+        file->ino = e->ino;
+        file->mtime = e->mtime;
+        memcpy(file->etag, e->etag, DOCROOT_ETAG_MAX);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return e != NULL;
+}
+
+//openat() one component at a time, none of them followed if it's a symlink. for kernels without openat2().
+static int open_nofollow(const char* rel) {
+    char part[PATH_MAX+1];
+    int dirfd = root_fd;
+    while (true) {
+        const char* slash = strchr(rel, '/');
+        if (slash == NULL) {
+            int fd = openat(dirfd, rel, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (dirfd != root_fd) {
+                close(dirfd);
+            }
+            return fd;
+        }
+        memcpy(part, rel, slash - rel);
+        part[slash - rel] = '\0';
+        int next = openat(dirfd, part, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dirfd != root_fd) {
+            close(dirfd);
+        }
+        if (next == -1) {
+            return -1;
+        }
+        dirfd = next;
+        rel = slash + 1;
+    }
+}
+
+int docroot_open(const char* path) {
+    if (!inside_root(path)) {
+        errno = EACCES;
+        return -1;
+    }
+    const char* rel = path + root_len + 1;
+    struct open_how how = { .flags = O_RDONLY | O_CLOEXEC, .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS };
+    int fd = syscall(SYS_openat2, root_fd, rel, &how, sizeof(how));
+    if (fd == -1 && errno == ENOSYS) {
+        fd = open_nofollow(rel);
+    }
+    return fd;
+}
+
+void docroot_etag(ino_t ino, off_t size, struct timespec mtime, char* etag) {
+    snprintf(etag, DOCROOT_ETAG_MAX, "\"%lx-%llx-%llx\"", (unsigned long)ino, (unsigned long long)size,
+             (unsigned long long)mtime.tv_sec * 1000000000ULL + mtime.tv_nsec);
+}
+
+void docroot_get_stats(docroot_stats_t* stats) {
+    stats->files = atomic_load(&files);
+    stats->watches = atomic_load(&watches);
+    stats->rescans = atomic_load(&rescans);
+}
@@ -0,0 +1,53 @@
+#ifndef DOCROOT_H_
+#define DOCROOT_H_
+
+#include<stdbool.h>
+#include<limits.h>
+#include<time.h>
+#include<sys/types.h>
+
+//in-memory index of the document root (-d). every servable file under it is known by its path relative to the root, so resolving a
+//request is a hash probe instead of realpath()'s lstat() per component. the index is built at startup by a parallel walk and kept
+//current by an inotify thread.
+//only regular files inside the root are indexed: request paths are normalized before the lookup, so ".." can't climb out, and
+//symlinks (to files or directories) are neither indexed nor followed. files are opened with docroot_open(), so one that is swapped
+//for a symlink after it was indexed doesn't lead out of the root either.
+#define DOCROOT_SHARDS 16
+#define DOCROOT_WALK_THREADS_MAX 8
+#define DOCROOT_ETAG_MAX 48
+
+typedef struct docroot_file {
+    char path[PATH_MAX+1];      //absolute path under the root, what the file cache is keyed by. open it with docroot_open()
+    off_t size;
+    ino_t ino;
+    struct timespec mtime;
+    char etag[DOCROOT_ETAG_MAX];    //quoted, e.g. "2f1a-1f-17c0a1b2c3d4e5f6"
+} docroot_file_t;
+
+typedef struct docroot_stats {
+    long files;
+    long watches;       //directories inotify is watching
+    long rescans;       //full walks after the inotify queue overflowed
+} docroot_stats_t;
+
+//set once docroot_init() has built the index. until then (or without -d) requests name filesystem paths directly.
+extern bool docroot_enabled;
+
+// indexes dir and starts watching it. exits the program if dir isn't a readable directory.
+void docroot_init(const char* dir);
+
+// looks up a decoded request path ("/a/b.txt"). returns false if no such file is indexed or the path leaves the root.
+// no syscalls: everything comes out of the index.
+bool docroot_lookup(const char* request_path, docroot_file_t* file);
+
+// opens path (a docroot_file_t's) read-only, resolving it beneath the root without following any symlink (openat2() with
+// RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS, or O_NOFOLLOW per component where that's missing). -1 and errno if it can't.
+int docroot_open(const char* path);
+
+void docroot_get_stats(docroot_stats_t* stats);
+
+// the ETag for a file with this inode, size and mtime, into etag (DOCROOT_ETAG_MAX bytes). what the index keeps, and what
+// responses use without -d too. changes whenever the file is replaced, resized or written to.
+void docroot_etag(ino_t ino, off_t size, struct timespec mtime, char* etag);
+
+#endif
@@ -0,0 +1,339 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<strings.h>
+#include<unistd.h>
+#include<limits.h>
+#include<pthread.h>
+#include<time.h>
+#include<sys/stat.h>
+#include<sys/resource.h>
+#include<zlib.h>
+#include "encoding.h"
+#include "filecache.h"
+#include "docroot.h"
+
+//cache_entry_t.compress
+enum {
+    COMPRESS_NONE,      //nobody has asked for a copy yet (or the last ask didn't fit on the queue)
+    COMPRESS_QUEUED,
+    COMPRESS_DONE,      //there's a copy, or there's no point in one
+};
+
+static const char* const names[CODING_COUNT] = { "identity", "gzip", "zstd" };
+static const char* const suffixes[CODING_COUNT] = { NULL, ".gz", ".zst" };
+
+//types that are worth compressing on the fly. images, video, fonts and archives mostly are compressed already.
+static const char* const compressible[] = {
+    ".html", ".htm", ".css", ".js", ".mjs", ".json", ".txt", ".xml", ".svg", ".csv", ".md", ".map", ".wasm",
+};
+
+//the compressor threads' queue: entries waiting for a gzip copy, each holding a reference.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nonempty = PTHREAD_COND_INITIALIZER;
+static cache_entry_t* queue[ENC_QUEUE_MAX];
+static int head, queued;
+static int nthreads;
+
+static atomic_long compressed, incompressible, dropped, bytes_in, bytes_out;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+const char* encoding_name(content_coding_t coding) {
+    return names[coding];
+}
+
+//"0", "0.5", "1.000"... in thousandths. whatever doesn't parse counts as far as it got.
+static short parse_qvalue(const char* v, size_t len, size_t* i) {
+    if (*i < len && v[*i] == '1') {
+        (*i)++;
+        while (*i < len && (v[*i] == '.' || v[*i] == '0')) {
+            (*i)++;
+        }
+        return 1000;
+    }
+    short q = 0;
+    if (*i < len && v[*i] == '0') {
+        (*i)++;
+    }
+    if (*i < len && v[*i] == '.') {
+        (*i)++;
+        for (int scale=100; *i < len && v[*i] >= '0' && v[*i] <= '9'; (*i)++, scale /= 10) {
+            q += (v[*i] - '0') * scale;
+        }
+    }
+    return q;
+}
+
+//e.g. "gzip, deflate;q=0.5, br, *;q=0". codings we don't know are skipped, and "*" stands for every one that isn't named.
+//identity is always on the table: it's what we fall back to.
+void encoding_parse_accept(const http_request_t* req, encoding_accept_t* accept) {
+    size_t len, i = 0;
+    const char* v = http_find_header(req, "Accept-Encoding", &len);
+    bool named[CODING_COUNT] = { false };
+    short star = -1;
+
+    memset(accept, 0, sizeof(*accept));
+    accept->q[CODING_IDENTITY] = 1000;
+    if (v == NULL) {
+        return;
+    }
+    while (i < len) {
+        while (i < len && (v[i] == ' ' || v[i] == '\t' || v[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && v[i] != ',' && v[i] != ';' && v[i] != ' ' && v[i] != '\t') {
+            i++;
+        }
+        size_t token_len = i - start;
+        short q = 1000;
+        while (i < len && v[i] != ',') {
+            if (v[i] == ';') {
+                i++;
+                while (i < len && (v[i] == ' ' || v[i] == '\t')) {
+                    i++;
+                }
+                if (i + 1 < len && (v[i] == 'q' || v[i] == 'Q') && v[i+1] == '=') {
+                    i += 2;
+                    q = parse_qvalue(v, len, &i);
+                    continue;
+                }
+            }
+            i++;
+        }
+        if (token_len == 1 && v[start] == '*') {
+            star = q;
+            continue;
+        }
+        for (int c=CODING_GZIP;c<CODING_COUNT;c++) {
+            if (strlen(names[c]) == token_len && strncasecmp(v + start, names[c], token_len) == 0) {
+                accept->q[c] = q;
+                named[c] = true;
+            }
+        }
+        if (token_len == 6 && strncasecmp(v + start, "x-gzip", 6) == 0) {
+            accept->q[CODING_GZIP] = q;
+            named[CODING_GZIP] = true;
+        }
+    }
+    if (star >= 0) {
+        for (int c=CODING_GZIP;c<CODING_COUNT;c++) {
+            if (!named[c]) {
+                accept->q[c] = star;
+            }
+        }
+    }
+}
+
+static bool is_compressible(const char* path) {
+    const char* dot = strrchr(path, '.');
+    if (dot == NULL || strchr(dot, '/') != NULL) {
+        return false;
+    }
+    for (size_t i=0;i<sizeof(compressible)/sizeof(compressible[0]);i++) {
+        if (strcasecmp(dot, compressible[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//bit per coding whose sidecar sits next to plain. without the docroot index that takes a stat() per coding, so the answer is kept
+//on the entry and looked at again at most once per CACHE_REVALIDATE_MS, like the entry itself.
+static int sidecars_of(cache_entry_t* plain) {
+    long long now = now_ms();
+    long long checked = atomic_load(&plain->sidecars_ms);
+    if (now - checked < CACHE_REVALIDATE_MS || !atomic_compare_exchange_strong(&plain->sidecars_ms, &checked, now)) {
+        return atomic_load(&plain->sidecars);
+    }
+    int found = 0;
+    for (int c=CODING_GZIP;c<CODING_COUNT;c++) {
+        char path[PATH_MAX+1];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s%s", plain->path, suffixes[c]) < (int)sizeof(path) && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            found |= 1 << c;
+        }
+    }
+    atomic_store(&plain->sidecars, found);
+    return found;
+}
+
+//plain's sidecar in coding, referenced, or NULL. with -d it has to be in the index like any other file, so it can't lead out of the root.
+static cache_entry_t* get_sidecar(cache_entry_t* plain, const char* request_path, content_coding_t coding) {
+    char path[PATH_MAX+1];
+    docroot_file_t file;
+    cache_entry_t* sidecar;
+    bool hit;
+
+    if (docroot_enabled) {
+        if (snprintf(path, sizeof(path), "%s%s", request_path, suffixes[coding]) >= (int)sizeof(path) || !docroot_lookup(path, &file)) {
+            return NULL;
+        }
+        sidecar = cache_get(file.path, &file, &hit);
+    } else {
+        if (!(sidecars_of(plain) & (1 << coding)) || snprintf(path, sizeof(path), "%s%s", plain->path, suffixes[coding]) >= (int)sizeof(path)) {
+            return NULL;
+        }
+        sidecar = cache_get(path, NULL, &hit);
+    }
+    if (sidecar == NULL) {
+        return NULL;
+    }
+    //a sidecar older than the file was made from an older version of it.
+    if (sidecar->mtime.tv_sec < plain->mtime.tv_sec || (sidecar->mtime.tv_sec == plain->mtime.tv_sec && sidecar->mtime.tv_nsec < plain->mtime.tv_nsec)) {
+        cache_put(sidecar);
+        return NULL;
+    }
+    return sidecar;
+}
+
+//asks the compressor threads for a gzip copy of plain, unless someone already has. never waits: if the queue is full, a later
+//request asks again.
+static void queue_compression(cache_entry_t* plain) {
+    int expected = COMPRESS_NONE;
+    if (nthreads == 0 || !cache_enabled() || plain->size < ENC_MIN_SIZE || plain->size > ENC_MAX_SIZE
+        || !atomic_compare_exchange_strong(&plain->compress, &expected, COMPRESS_QUEUED)) {
+        return;
+    }
+    cache_hold(plain);
+    pthread_mutex_lock(&lock);
+    if (queued == ENC_QUEUE_MAX) {
+        pthread_mutex_unlock(&lock);
+        atomic_store(&plain->compress, COMPRESS_NONE);
+        atomic_fetch_add(&dropped, 1);
+        cache_put(plain);
+        return;
+    }
+    queue[(head + queued++) % ENC_QUEUE_MAX] = plain;
+    pthread_cond_signal(&nonempty);
+    pthread_mutex_unlock(&lock);
+}
+
+cache_entry_t* encoding_pick(cache_entry_t* plain, const char* request_path, const encoding_accept_t* accept,
+                             content_coding_t* coding, bool* vary) {
+    bool can_compress = is_compressible(plain->path);
+    //what the client likes best first. zstd wins a tie: it's smaller and quicker to decode.
+    content_coding_t order[2] = { CODING_ZSTD, CODING_GZIP };
+    if (accept->q[CODING_GZIP] > accept->q[CODING_ZSTD]) {
+        order[0] = CODING_GZIP;
+        order[1] = CODING_ZSTD;
+    }
+
+    *coding = CODING_IDENTITY;
+    *vary = can_compress;
+    for (int i=0;i<2;i++) {
+        content_coding_t c = order[i];
+        if (accept->q[c] == 0) {
+            continue;
+        }
+        cache_entry_t* encoded = get_sidecar(plain, request_path, c);
+        if (encoded == NULL && c == CODING_GZIP && can_compress) {
+            if ((encoded = cache_get_encoded(plain, c)) == NULL) {
+                queue_compression(plain);
+            }
+        }
+        if (encoded != NULL) {
+            *coding = c;
+            *vary = true;
+            return encoded;
+        }
+    }
+    return NULL;
+}
+
+//makes the gzip copy of plain and hangs it on the entry, if it saves enough to be worth keeping.
+static void compress_entry(cache_entry_t* plain) {
+    const char* in = plain->data;
+    char* owned = NULL;
+    off_t size = plain->size;
+
+    if (in == NULL) {
+        //a big file the cache sends with sendfile(). pread() leaves the fd's offset alone for the senders.
+        owned = malloc(size);
+        off_t got = 0;
+        ssize_t n;
+        while (got < size && (n = pread(plain->fd, owned + got, size - got, got)) > 0) {
+            got += n;
+        }
+        if (got < size) {
+            //the file changed under us. the cache will notice and load it again, and the new entry gets its own try.
+            free(owned);
+            atomic_store(&plain->compress, COMPRESS_DONE);
+            return;
+        }
+        in = owned;
+    }
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    //15 + 16: the largest window, with a gzip header and trailer rather than zlib's.
+    if (deflateInit2(&z, ENC_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(owned);
+        atomic_store(&plain->compress, COMPRESS_DONE);
+        return;
+    }
+    uLong bound = deflateBound(&z, size);
+    char* out = malloc(bound);
+    z.next_in = (Bytef*)in;
+    z.avail_in = size;
+    z.next_out = (Bytef*)out;
+    z.avail_out = bound;
+    int rc = deflate(&z, Z_FINISH);
+    off_t out_len = z.total_out;
+    deflateEnd(&z);
+    free(owned);
+
+    atomic_fetch_add(&bytes_in, size);
+    if (rc != Z_STREAM_END || out_len > size * (100 - ENC_MIN_SAVING) / 100) {
+        free(out);
+        atomic_fetch_add(&incompressible, 1);
+    } else {
+        atomic_fetch_add(&bytes_out, out_len);
+        if (cache_attach_encoded(plain, CODING_GZIP, cache_new_encoded(plain, realloc(out, out_len), out_len))) {
+            atomic_fetch_add(&compressed, 1);
+        }
+    }
+    atomic_store(&plain->compress, COMPRESS_DONE);
+}
+
+static void* compressor_thread(void* arg) {
+    //compressing is background work. the I/O threads get the CPU first.
+    setpriority(PRIO_PROCESS, gettid(), 10);
+    while (true) {
+        pthread_mutex_lock(&lock);
+        while (queued == 0) {
+            pthread_cond_wait(&nonempty, &lock);
+        }
+        cache_entry_t* plain = queue[head];
+        head = (head + 1) % ENC_QUEUE_MAX;
+        queued--;
+        pthread_mutex_unlock(&lock);
+
+        compress_entry(plain);
+        cache_put(plain);
+    }
+    return NULL;
+}
+
+void encoding_init(int threads) {
+    nthreads = threads;
+    for (int i=0;i<threads;i++) {
+        pthread_t t;
+        pthread_create(&t, NULL, compressor_thread, NULL);
+        pthread_detach(t);
+    }
+}
+
+void encoding_get_stats(encoding_stats_t* stats) {
+    stats->compressed = atomic_load(&compressed);
+    stats->incompressible = atomic_load(&incompressible);
+    stats->dropped = atomic_load(&dropped);
+    stats->bytes_in = atomic_load(&bytes_in);
+    stats->bytes_out = atomic_load(&bytes_out);
+}
@@ -0,0 +1,59 @@
+#ifndef ENCODING_H_
+#define ENCODING_H_
+
+#include<stdbool.h>
+#include "httpparser.h"
+
+//Content-Encoding. a client that says it takes gzip or zstd (Accept-Encoding) gets the file compressed, from one of two places:
+// - a sidecar: "file.zst" or "file.gz" next to "file", made ahead of time. it's an ordinary file to the cache, so a big one
+//   still goes out with sendfile()/splice(). only used if it's at least as new as the file itself.
+// - a gzip copy made on the fly and kept in memory with the cached file. the first request for a file queues it for the compressor
+//   threads and is answered uncompressed: the I/O threads never wait for a compression. later requests get the copy.
+//zstd is sidecar-only: zlib is the one compression library we link.
+#define ENC_MIN_SIZE 256                    //not worth compressing anything smaller than this on the fly
+#define ENC_MAX_SIZE (16 * 1024 * 1024)     //...or bigger than this. a copy has to fit in a cache shard's budget anyway
+#define ENC_MIN_SAVING 10                   //percent. copies that save less are thrown away and the file is served as it is
+#define ENC_GZIP_LEVEL 6
+#define ENC_QUEUE_MAX 256                   //compressions waiting for a thread. when it's full, files just wait for a later request
+#define ENC_DEFAULT_THREADS 2
+
+typedef enum {
+    CODING_IDENTITY,
+    CODING_GZIP,
+    CODING_ZSTD,
+    CODING_COUNT,
+} content_coding_t;
+
+//how much the client wants each coding, from its Accept-Encoding. qvalues in thousandths: 0 is "not acceptable".
+typedef struct encoding_accept {
+    short q[CODING_COUNT];
+} encoding_accept_t;
+
+typedef struct encoding_stats {
+    long compressed;        //copies made and kept
+    long incompressible;    //copies thrown away for saving too little
+    long dropped;           //compressions that didn't fit on the queue
+    long bytes_in;
+    long bytes_out;
+} encoding_stats_t;
+
+struct cache_entry;
+
+// starts threads compressor threads. 0 turns on-the-fly compression off (sidecars are still served).
+void encoding_init(int threads);
+
+// reads the request's Accept-Encoding. without one, only identity is acceptable.
+void encoding_parse_accept(const http_request_t* req, encoding_accept_t* accept);
+
+// picks what to send for plain, the file at request_path: returns a referenced cache entry holding a compressed representation and
+// sets *coding, or returns NULL (*coding = CODING_IDENTITY) to send plain as it is. *vary is set if the answer depends on
+// Accept-Encoding at all, i.e. the response needs "Vary: Accept-Encoding".
+struct cache_entry* encoding_pick(struct cache_entry* plain, const char* request_path, const encoding_accept_t* accept,
+                                  content_coding_t* coding, bool* vary);
+
+// "gzip", "zstd" or "identity".
+const char* encoding_name(content_coding_t coding);
+
+void encoding_get_stats(encoding_stats_t* stats);
+
+#endif
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<limits.h>
+#include<stdbool.h>
+#include<pthread.h>
+#include<sys/epoll.h>
+#include "server.h"
+#include "eventloop.h"
+#include "connection.h"
+#include "log.h"
+#include "slab.h"
+#include "metrics.h"
+#include "admission.h"
+#include "timerwheel.h"
+#include "reload.h"
+#include "ratelimit.h"
+
+//each reactor owns an epoll set and the connections it accepted. what to do with a connection when its socket is ready lives in connection.c.
+typedef struct loop {
+    int epfd;
+    int server_socket;
+    int index;
+    bool pin;
+    bool accepting;     //false once a reload has taken the listener out of the epoll set
+    pthread_t thread;
+    slab_t conns;       //connection objects, buffers included. only this loop's thread touches it
+    timer_wheel_t timers;   //every connection's deadline
+    io_completions_t cq;    //files the I/O threads loaded for our connections
+} loop_t;
+
+static void close_connection(loop_t* loop, connection_t* conn) {
+    wheel_cancel(&loop->timers, &conn->timer);
+    //closing the fd also removes it from the epoll set.
+    connection_close(conn);
+    slab_free(&loop->conns, conn);
+    admission_release();
+}
+
+static void expire(wheel_timer_t* t, void* arg) {
+    connection_t* conn = connection_of_timer(t);
+    connection_count_timeout(conn);
+    close_connection(arg, conn);
+}
+
+static void accept_connections(loop_t* loop) {
+    while (true) {
+        SA_IN addr;
+        socklen_t addr_size = sizeof(addr);
+        int client_socket = accept4(loop->server_socket, (SA*)&addr, &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket == SOCKETERROR) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_warn("accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        metrics_count(M_ACCEPTED, 1);
+        if (!admission_admit()) {
+            admission_reject(client_socket, SHED_INFLIGHT);
+            continue;
+        }
+        connection_t* conn = slab_alloc(&loop->conns);
+        connection_init(conn, client_socket, false);
+        conn->cq = &loop->cq;
+        conn->client = ratelimit_attach(addr.sin_addr.s_addr);
+        connection_arm_timer(conn, &loop->timers);
+
+        //edge-triggered, and registered for both directions up front so the connection never needs an epoll_ctl(MOD) when it switches state.
+        //connection_run() only returns once the socket has said EAGAIN, so no edge is ever missed.
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = conn };
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, client_socket, &ev) == SOCKETERROR) {
+            log_warn("epoll_ctl failed: %s", strerror(errno));
+            close_connection(loop, conn);
+        }
+    }
+}
+
+//carries on with the connections whose files the I/O threads are done with.
+static void resume_connections(loop_t* loop) {
+    uint64_t n;
+    //reset the eventfd before looking: a job completed after the read wakes us up again.
+    if (read(loop->cq.efd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        log_warn("eventfd read failed: %s", strerror(errno));
+    }
+    io_job_t* job = iocq_take(&loop->cq, false);
+    while (job != NULL) {
+        io_job_t* next = job->next;
+        connection_t* conn = connection_of_job(job);
+        connection_resume(conn);
+        if (connection_run(conn) == CONN_CLOSE) {
+            close_connection(loop, conn);
+        } else {
+            connection_arm_timer(conn, &loop->timers);
+        }
+        job = next;
+    }
+}
+
+static void* event_loop_thread(void* arg) {
+    loop_t* loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    if (loop->pin) {
+        pin_to_shard(loop->index, loop->server_socket);
+    }
+    //after pinning, so the first chunk of connections comes from our node.
+    slab_init(&loop->conns, sizeof(connection_t));
+    wheel_init(&loop->timers);
+    reload_register_acceptor();
+    loop->accepting = true;
+
+    while (true) {
+        //sleep no longer than until the next deadline. with no connections open, that's until something happens.
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, wheel_next_ms(&loop->timers));
+        if (n == SOCKETERROR) {
+            if (errno != EINTR) {
+                check(n, "epoll_wait failed");
+            }
+            n = 0;
+        }
+        //the process that took over accepts from here on. we just finish the connections we have.
+        if (loop->accepting && reload_draining()) {
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->server_socket, NULL);
+            loop->accepting = false;
+            reload_acceptor_stopped();
+        }
+        //deadlines set while handling the batch count from now.
+        loop->timers.now_ms = wheel_clock_ms();
+        bool resume = false;
+        for (int i=0;i<n;i++) {
+            connection_t* conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_connections(loop);
+                continue;
+            }
+            if (events[i].data.ptr == &loop->cq) {
+                resume = true;
+                continue;
+            }
+
+            //a connection waiting on the I/O threads stays put whatever its socket says. it finds out once it's back.
+            if (((events[i].events & EPOLLERR) && conn->state != CONN_OPENING) || connection_run(conn) == CONN_CLOSE) {
+                close_connection(loop, conn);
+            } else {
+                connection_arm_timer(conn, &loop->timers);
+            }
+        }
+        //after the batch: a connection closed on its way back may have had a socket event in it as well.
+        if (resume) {
+            resume_connections(loop);
+        }
+        //only once the batch is done: a connection closed here may still have had an event in it.
+        wheel_advance(&loop->timers, expire, loop);
+    }
+    return NULL;
+}
+
+void run_event_loop(const int* listeners, int nthreads, bool pin) {
+    loop_t* loops = calloc(nthreads, sizeof(loop_t));
+
+    for (int i=0;i<nthreads;i++) {
+        int server_socket = listeners[i];
+        check(fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK), "fcntl failed");
+        loops[i].server_socket = server_socket;
+        loops[i].index = i;
+        loops[i].pin = pin;
+        check(loops[i].epfd = epoll_create1(EPOLL_CLOEXEC), "epoll_create failed");
+
+        //every reactor watches its listening socket. when they all share one, EPOLLEXCLUSIVE wakes only one of them per incoming
+        //connection instead of the whole herd. a NULL data pointer marks the listener.
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+        check(epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, server_socket, &ev), "epoll_ctl failed");
+        iocq_init(&loops[i].cq, false);
+        struct epoll_event io = { .events = EPOLLIN, .data.ptr = &loops[i].cq };
+        check(epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].cq.efd, &io), "epoll_ctl failed");
+        pthread_create(&loops[i].thread, NULL, event_loop_thread, &loops[i]);
+    }
+    log_info("Serving with %d epoll threads...", nthreads);
+
+    for (int i=0;i<nthreads;i++) {
+        pthread_join(loops[i].thread, NULL);
+    }
+}
@@ -0,0 +1,13 @@
+#ifndef EVENTLOOP_H_
+#define EVENTLOOP_H_
+
+#include<stdbool.h>
+
+#define EVENT_LOOP_THREADS 4
+#define MAX_EVENTS 256
+
+// serves connections on nthreads epoll reactors. reactor i accepts from listeners[i]. with pin, reactor i is pinned
+// to shard i's CPU (see pin_to_shard()). never returns.
+void run_event_loop(const int* listeners, int nthreads, bool pin);
+
+#endif
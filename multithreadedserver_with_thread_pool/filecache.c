@@ -0,0 +1,405 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<pthread.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include "filecache.h"
+#include "metrics.h"
+
+typedef struct shard {
+    pthread_mutex_t lock;
+    cache_entry_t* buckets[CACHE_BUCKETS];
+    cache_entry_t* ring[CACHE_ENTRIES_PER_SHARD];  //CLOCK ring. NULL slots are free
+    int hand;
+    long bytes;     //file contents held by this shard
+} shard_t;
+
+static shard_t shards[CACHE_SHARDS];
+static long shard_budget;
+static bool enabled;
+
+bool cache_content_etags = false;
+
+static atomic_long hits, misses, evictions, invalidations, entries, bytes, mapped;
+
+void cache_init(long budget_mb) {
+    enabled = budget_mb > 0;
+    shard_budget = (budget_mb << 20) / CACHE_SHARDS;
+    for (int i=0;i<CACHE_SHARDS;i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+}
+
+//FNV-1a. paths are short and this runs once per request, so anything fancier isn't worth it.
+static uint64_t hash_path(const char* path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void entry_release(cache_entry_t* entry) {
+    if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+        for (int c=0;c<CODING_COUNT;c++) {
+            if (entry->encoded[c] != NULL) {
+                entry_release(entry->encoded[c]);
+            }
+        }
+        if (entry->fd != -1) {
+            close(entry->fd);
+        }
+        if (entry->mapped) {
+            munmap(entry->data, entry->size);
+        } else {
+            free(entry->data);
+        }
+        free(entry->path);
+        free(entry);
+    }
+}
+
+//FNV-1a again, 64 bits of it, as a content ETag: "c-" then the size and the hash. runs once per load, on bytes we just read.
+static void content_etag(const cache_entry_t* entry, char* etag) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (off_t i=0;i<entry->size;i++) {
+        hash = (hash ^ (unsigned char)entry->data[i]) * 1099511628211ULL;
+    }
+    snprintf(etag, DOCROOT_ETAG_MAX, "\"c-%llx-%llx\"", (unsigned long long)entry->size, (unsigned long long)hash);
+}
+
+//opens path and, if it is small enough (and we're caching at all), reads it into memory and lets go of the fd. indexed files
+//(see docroot.h) are opened without following symlinks, so they can't have been swapped for one that leads out of the root.
+static cache_entry_t* load_entry(const char* path, uint64_t hash, bool indexed) {
+    struct stat st;
+    uint64_t start = metrics_now();
+    int fd = indexed ? docroot_open(path) : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    cache_entry_t* entry = calloc(1, sizeof(cache_entry_t));
+    entry->path = strdup(path);
+    entry->hash = hash;
+    entry->fd = fd;
+    entry->size = st.st_size;
+    entry->ino = st.st_ino;
+    entry->mtime = st.st_mtim;
+    atomic_init(&entry->checked_ms, now_ms());
+    atomic_init(&entry->refs, 1);
+
+    if (enabled && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= CACHE_SMALL_FILE && st.st_size <= shard_budget) {
+        entry->data = malloc(st.st_size);
+        off_t got = 0;
+        while (got < st.st_size) {
+            ssize_t n = pread(fd, entry->data + got, st.st_size - got, got);
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+        if (got == st.st_size) {
+            close(entry->fd);
+            entry->fd = -1;
+        } else {
+            //the file changed while we read it. serve it from the fd instead.
+            free(entry->data);
+            entry->data = NULL;
+        }
+    } else if (enabled && send_method == SEND_MMAP && S_ISREG(st.st_mode) && st.st_size > 0) {
+        //the mapping only ever reaches send()/sendmsg(), where the kernel does the copying. if the file is truncated under us the
+        //send fails with EFAULT rather than the process taking a SIGBUS, and the next revalidation drops the entry.
+        if ((entry->data = filesend_map(fd, st.st_size)) != NULL) {
+            entry->mapped = true;
+            close(entry->fd);
+            entry->fd = -1;
+        }
+    }
+    if (cache_content_etags && entry->data != NULL) {
+        content_etag(entry, entry->etag);
+    } else {
+        //the same tag the docroot index has for the file.
+        docroot_etag(entry->ino, entry->size, entry->mtime, entry->etag);
+    }
+    metrics_observe(H_OPEN, start);
+    return entry;
+}
+
+static cache_entry_t* shard_find(shard_t* shard, uint64_t hash, const char* path) {
+    for (cache_entry_t* e = shard->buckets[hash % CACHE_BUCKETS]; e != NULL; e = e->next) {
+        if (e->hash == hash && strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+//bytes of the budget an entry uses, its compressed copies included. mappings are page cache the kernel can reclaim, so they don't count.
+static long held_bytes(cache_entry_t* entry) {
+    long held = entry->data != NULL && !entry->mapped ? entry->size : 0;
+    for (int c=0;c<CODING_COUNT;c++) {
+        if (entry->encoded[c] != NULL) {
+            held += entry->encoded[c]->size;
+        }
+    }
+    return held;
+}
+
+//takes entry out of the shard and drops the cache's reference. caller holds the shard lock.
+static void shard_unlink(shard_t* shard, cache_entry_t* entry) {
+    cache_entry_t** link = &shard->buckets[entry->hash % CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    for (int i=0;i<CACHE_ENTRIES_PER_SHARD;i++) {
+        if (shard->ring[i] == entry) {
+            shard->ring[i] = NULL;
+            break;
+        }
+    }
+    long size = held_bytes(entry);
+    shard->bytes -= size;
+    atomic_fetch_sub(&bytes, size);
+    if (entry->mapped) {
+        atomic_fetch_sub(&mapped, entry->size);
+    }
+    atomic_fetch_sub(&entries, 1);
+    entry->cached = false;
+    entry_release(entry);
+}
+
+//CLOCK: sweep the ring giving every recently used entry a second chance, and evict the first one that hasn't been touched since the last pass.
+static void shard_evict_one(shard_t* shard) {
+    while (true) {
+        cache_entry_t* entry = shard->ring[shard->hand];
+        shard->hand = (shard->hand + 1) % CACHE_ENTRIES_PER_SHARD;
+        if (entry == NULL) {
+            continue;
+        }
+        if (atomic_exchange(&entry->referenced, false)) {
+            continue;
+        }
+        shard_unlink(shard, entry);
+        atomic_fetch_add(&evictions, 1);
+        return;
+    }
+}
+
+static int shard_free_slot(shard_t* shard) {
+    for (int i=0;i<CACHE_ENTRIES_PER_SHARD;i++) {
+        if (shard->ring[i] == NULL) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void shard_insert(shard_t* shard, cache_entry_t* entry) {
+    long size = held_bytes(entry);
+    int slot;
+    while ((slot = shard_free_slot(shard)) == -1 || shard->bytes + size > shard_budget) {
+        shard_evict_one(shard);
+    }
+    shard->ring[slot] = entry;
+    entry->next = shard->buckets[entry->hash % CACHE_BUCKETS];
+    shard->buckets[entry->hash % CACHE_BUCKETS] = entry;
+    entry->cached = true;
+    atomic_store(&entry->referenced, true);
+    atomic_fetch_add(&entry->refs, 1);
+    shard->bytes += size;
+    atomic_fetch_add(&bytes, size);
+    if (entry->mapped) {
+        atomic_fetch_add(&mapped, entry->size);
+    }
+    atomic_fetch_add(&entries, 1);
+}
+
+//true if the file on disk is still the one we cached. when the docroot index vouches for the file, its metadata is compared
+//instead (no syscall, and a change shows up as soon as inotify reports it). otherwise only one caller per CACHE_REVALIDATE_MS
+//window actually pays for a stat().
+static bool still_fresh(cache_entry_t* entry, const docroot_file_t* known) {
+    if (known != NULL) {
+        return known->ino == entry->ino && known->size == entry->size
+            && known->mtime.tv_sec == entry->mtime.tv_sec && known->mtime.tv_nsec == entry->mtime.tv_nsec;
+    }
+    long long now = now_ms();
+    long long checked = atomic_load(&entry->checked_ms);
+    if (now - checked < CACHE_REVALIDATE_MS || !atomic_compare_exchange_strong(&entry->checked_ms, &checked, now)) {
+        return true;
+    }
+    struct stat st;
+    return stat(entry->path, &st) == 0 && st.st_ino == entry->ino && st.st_size == entry->size
+        && st.st_mtim.tv_sec == entry->mtime.tv_sec && st.st_mtim.tv_nsec == entry->mtime.tv_nsec;
+}
+
+//the hit half of cache_get(): a referenced entry if the shard has a fresh one, NULL otherwise. a stale one is dropped on the way.
+static cache_entry_t* shard_lookup(shard_t* shard, uint64_t hash, const char* path, const docroot_file_t* known) {
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t* entry = shard_find(shard, hash, path);
+    if (entry != NULL) {
+        atomic_fetch_add(&entry->refs, 1);
+        atomic_store(&entry->referenced, true);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (still_fresh(entry, known)) {
+        atomic_fetch_add(&hits, 1);
+        return entry;
+    }
+    pthread_mutex_lock(&shard->lock);
+    if (entry->cached) {
+        shard_unlink(shard, entry);
+        atomic_fetch_add(&invalidations, 1);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    entry_release(entry);
+    return NULL;
+}
+
+cache_entry_t* cache_lookup(const char* path, const docroot_file_t* known) {
+    if (!enabled) {
+        return NULL;
+    }
+    uint64_t hash = hash_path(path);
+    return shard_lookup(&shards[(hash >> 32) % CACHE_SHARDS], hash, path, known);
+}
+
+cache_entry_t* cache_get(const char* path, const docroot_file_t* known, bool* hit) {
+    *hit = false;
+    if (!enabled) {
+        atomic_fetch_add(&misses, 1);
+        return load_entry(path, 0, known != NULL);
+    }
+
+    uint64_t hash = hash_path(path);
+    shard_t* shard = &shards[(hash >> 32) % CACHE_SHARDS];
+    cache_entry_t* entry = shard_lookup(shard, hash, path, known);
+    if (entry != NULL) {
+        *hit = true;
+        return entry;
+    }
+
+    //miss: do the disk work without holding the shard lock.
+    atomic_fetch_add(&misses, 1);
+    if ((entry = load_entry(path, hash, known != NULL)) == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t* existing = shard_find(shard, hash, path);
+    if (existing != NULL) {
+        //another worker loaded it while we were reading. use theirs.
+        atomic_fetch_add(&existing->refs, 1);
+        pthread_mutex_unlock(&shard->lock);
+        entry_release(entry);
+        return existing;
+    }
+    shard_insert(shard, entry);
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+void cache_put(cache_entry_t* entry) {
+    entry_release(entry);
+}
+
+void cache_hold(cache_entry_t* entry) {
+    atomic_fetch_add(&entry->refs, 1);
+}
+
+bool cache_enabled() {
+    return enabled;
+}
+
+cache_entry_t* cache_new_encoded(const cache_entry_t* entry, char* data, off_t size) {
+    cache_entry_t* copy = calloc(1, sizeof(cache_entry_t));
+    copy->fd = -1;
+    copy->data = data;
+    copy->size = size;
+    copy->ino = entry->ino;
+    copy->mtime = entry->mtime;
+    memcpy(copy->etag, entry->etag, DOCROOT_ETAG_MAX);
+    atomic_init(&copy->refs, 1);
+    return copy;
+}
+
+bool cache_attach_encoded(cache_entry_t* entry, content_coding_t coding, cache_entry_t* copy) {
+    shard_t* shard = &shards[(entry->hash >> 32) % CACHE_SHARDS];
+    bool attached = false;
+
+    pthread_mutex_lock(&shard->lock);
+    if (entry->cached && entry->encoded[coding] == NULL && held_bytes(entry) + copy->size <= shard_budget) {
+        __atomic_store_n(&entry->encoded[coding], copy, __ATOMIC_RELEASE);
+        shard->bytes += copy->size;
+        atomic_fetch_add(&bytes, copy->size);
+        //making room may evict entry itself, copy and all. that's CLOCK's call to make.
+        while (shard->bytes > shard_budget) {
+            shard_evict_one(shard);
+        }
+        attached = true;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (!attached) {
+        entry_release(copy);
+    }
+    return attached;
+}
+
+cache_entry_t* cache_get_encoded(cache_entry_t* entry, content_coding_t coding) {
+    //the caller's reference on entry keeps entry's reference on the copy alive, so the copy can't go away under us.
+    cache_entry_t* copy = __atomic_load_n(&entry->encoded[coding], __ATOMIC_ACQUIRE);
+    if (copy != NULL) {
+        atomic_fetch_add(&copy->refs, 1);
+    }
+    return copy;
+}
+
+bool cache_sender_init(file_sender_t* sender, cache_entry_t* entry, char* buffer) {
+    if (entry->data != NULL) {
+        filesend_init_memory(sender, entry->data, entry->size);
+        return true;
+    }
+    return filesend_init(sender, entry->fd, buffer);
+}
+
+int cache_paths(char** paths, int max) {
+    int n = 0;
+    for (int s=0;s<CACHE_SHARDS && n<max;s++) {
+        pthread_mutex_lock(&shards[s].lock);
+        for (int i=0;i<CACHE_ENTRIES_PER_SHARD && n<max;i++) {
+            if (shards[s].ring[i] != NULL) {
+                paths[n++] = strdup(shards[s].ring[i]->path);
+            }
+        }
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+    return n;
+}
+
+void cache_get_stats(cache_stats_t* stats) {
+    stats->hits = atomic_load(&hits);
+    stats->misses = atomic_load(&misses);
+    stats->evictions = atomic_load(&evictions);
+    stats->invalidations = atomic_load(&invalidations);
+    stats->entries = atomic_load(&entries);
+    stats->bytes = atomic_load(&bytes);
+    stats->mapped = atomic_load(&mapped);
+}
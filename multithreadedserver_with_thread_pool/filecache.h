@@ -0,0 +1,101 @@
+#ifndef FILECACHE_H_
+#define FILECACHE_H_
+
+#include<stdbool.h>
+#include<stdatomic.h>
+#include<stdint.h>
+#include<time.h>
+#include<sys/types.h>
+#include "filesend.h"
+#include "docroot.h"
+#include "encoding.h"
+
+//open-file and content cache keyed by the canonical (realpath'd) path.
+//small files are held in memory and sent straight from there. bigger ones keep their fd open so they can go out with sendfile(),
+//or with -s mmap are mapped and sent from the mapping like the small ones.
+//the cache is split into shards, each with its own lock, hash table and CLOCK eviction ring, so workers asking for different files rarely meet.
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 64            //hash chains per shard
+#define CACHE_ENTRIES_PER_SHARD 64  //bounds the number of fds the cache keeps open
+#define CACHE_SMALL_FILE (64 * 1024)
+#define CACHE_DEFAULT_MB 64
+#define CACHE_REVALIDATE_MS 1000    //an entry's mtime is re-checked at most this often
+
+typedef struct cache_entry {
+    char* path;
+    uint64_t hash;
+    int fd;
+    char* data;             //whole file contents for small (or mapped) files, NULL otherwise
+    bool mapped;            //data is a shared mapping of the file rather than a copy on the heap
+    off_t size;
+    ino_t ino;
+    struct timespec mtime;
+    char etag[DOCROOT_ETAG_MAX];    //quoted. from the docroot index or inode/size/mtime, or the contents with -e
+    atomic_llong checked_ms;    //when the file was last stat()ed
+    atomic_int refs;            //one for the cache while it's in a shard, plus one per response using it
+    atomic_bool referenced;     //CLOCK bit
+    bool cached;                //false once it has been evicted or invalidated
+    struct cache_entry* next;
+
+    //other codings of the file, made on the fly (see encoding.c). each is an entry of its own that only this one points at,
+    //and it goes (and counts against the budget) with this one. set once, under the shard lock.
+    struct cache_entry* encoded[CODING_COUNT];
+    atomic_int compress;            //where encoding.c is with making a copy
+    atomic_int sidecars;            //encoding.c: bit per coding whose sidecar file exists, as of sidecars_ms
+    atomic_llong sidecars_ms;
+} cache_entry_t;
+
+typedef struct cache_stats {
+    long hits;
+    long misses;
+    long evictions;
+    long invalidations;
+    long entries;
+    long bytes;
+    long mapped;            //bytes of files mapped with -s mmap. page cache, so not part of the budget
+} cache_stats_t;
+
+//-e: files held in memory get an ETag made from their contents, so a file that is rewritten with the same bytes (a deploy, a
+//touch) keeps its tag. others still get one from inode, size and mtime.
+extern bool cache_content_etags;
+
+// sets the memory budget for file contents. 0 turns caching off: every request opens the file afresh.
+void cache_init(long budget_mb);
+
+// returns a referenced entry for path, opening and loading the file on a miss. *hit says which it was.
+// known, if not NULL, is what the docroot index says about the file: a cached copy that doesn't match it is reloaded.
+// returns NULL (errno set) if the file can't be opened. every entry returned must be given back with cache_put().
+cache_entry_t* cache_get(const char* path, const docroot_file_t* known, bool* hit);
+
+// cache_get() without the miss: a referenced entry if path is cached and still fresh, NULL (and nothing loaded) otherwise.
+// never opens or reads the file (at most a stat() to revalidate), so a network thread can ask before it hands a miss to the I/O
+// threads (see iopool.h).
+cache_entry_t* cache_lookup(const char* path, const docroot_file_t* known);
+
+void cache_put(cache_entry_t* entry);
+
+// takes another reference on an entry the caller already holds one on.
+void cache_hold(cache_entry_t* entry);
+
+// false with -c 0: every entry is private to one response, so there is nowhere to keep a compressed copy.
+bool cache_enabled();
+
+// an entry holding size bytes of data (taken over, from malloc) in the given coding of entry's file.
+cache_entry_t* cache_new_encoded(const cache_entry_t* entry, char* data, off_t size);
+
+// keeps copy (from cache_new_encoded()) with entry, as its coding. returns false and frees copy if entry has left the cache,
+// already has one, or the copy doesn't fit in the budget.
+bool cache_attach_encoded(cache_entry_t* entry, content_coding_t coding, cache_entry_t* copy);
+
+// entry's copy in coding, referenced (give it back with cache_put()), or NULL if there isn't one.
+cache_entry_t* cache_get_encoded(cache_entry_t* entry, content_coding_t coding);
+
+// points sender at the entry: its bytes in memory if we have them, its fd otherwise. buffer is for the copy path.
+bool cache_sender_init(file_sender_t* sender, cache_entry_t* entry, char* buffer);
+
+// copies (strdup) the paths of up to max cached files into paths and returns how many. the caller frees them.
+int cache_paths(char** paths, int max);
+
+void cache_get_stats(cache_stats_t* stats);
+
+#endif
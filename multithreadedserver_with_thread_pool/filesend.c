@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<sys/stat.h>
+#include<sys/socket.h>
+#include<sys/sendfile.h>
+#include<sys/mman.h>
+#include "server.h"
+#include "filesend.h"
+
+send_method_t send_method = SEND_SENDFILE;
+
+bool parse_send_method(const char* name, send_method_t* method) {
+    if (strcmp(name, "sendfile") == 0) {
+        *method = SEND_SENDFILE;
+    } else if (strcmp(name, "splice") == 0) {
+        *method = SEND_SPLICE;
+    } else if (strcmp(name, "copy") == 0) {
+        *method = SEND_COPY;
+    } else if (strcmp(name, "mmap") == 0) {
+        *method = SEND_MMAP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void filesend_setup(file_sender_t* sender) {
+    sender->pipefd[0] = sender->pipefd[1] = -1;
+    sender->piped = 0;
+}
+
+//a transfer only ends with the pipe empty (SEND_DONE) or by closing the connection (SEND_ERROR), so this shouldn't trigger. but
+//whatever is left in a pipe would go out ahead of the next response's body, so don't take the chance.
+static void drop_stale_pipe(file_sender_t* sender) {
+    if (sender->piped != 0) {
+        filesend_release(sender);
+        sender->piped = 0;
+    }
+}
+
+bool filesend_init(file_sender_t* sender, int file_fd, char* buffer) {
+    struct stat st;
+    drop_stale_pipe(sender);
+    if (fstat(file_fd, &st) == -1) {
+        return false;
+    }
+    sender->file_fd = file_fd;
+    sender->start = sender->offset = 0;
+    sender->size = st.st_size;
+    //procfs and sysfs files are regular but report a size of 0 whatever they hold.
+    sender->sized = S_ISREG(st.st_mode) && st.st_size > 0;
+    sender->chunked = sender->ended = false;
+    sender->method = send_method;
+    sender->data = NULL;
+    sender->buffer = buffer;
+    sender->buf_off = sender->buf_len = 0;
+    sender->write = NULL;
+    sender->write_ctx = NULL;
+
+    //a file that reaches us here with -s mmap wasn't mapped (the cache is off, or it couldn't be). the next best thing is sendfile.
+    if (sender->method == SEND_MMAP) {
+        sender->method = SEND_SENDFILE;
+    }
+    //the zero-copy paths send exactly st_size bytes. files that don't know their size up front (/proc, pipes) are read until EOF instead.
+    if (!sender->sized) {
+        sender->method = SEND_COPY;
+    }
+    return sender->method != SEND_COPY || buffer != NULL;
+}
+
+void filesend_init_memory(file_sender_t* sender, const char* data, off_t size) {
+    sender->file_fd = -1;
+    sender->start = sender->offset = 0;
+    sender->size = size;
+    sender->sized = true;
+    sender->chunked = sender->ended = false;
+    sender->method = SEND_MEMORY;
+    drop_stale_pipe(sender);
+    sender->data = data;
+    sender->buffer = NULL;
+    sender->buf_off = sender->buf_len = 0;
+    sender->write = NULL;
+    sender->write_ctx = NULL;
+}
+
+void filesend_set_writer(file_sender_t* sender, ssize_t (*write)(void* ctx, const void* buf, size_t len), void* ctx) {
+    sender->write = write;
+    sender->write_ctx = ctx;
+    if (sender->method != SEND_MEMORY) {
+        sender->method = SEND_COPY;
+    }
+}
+
+void filesend_set_range(file_sender_t* sender, off_t first, off_t len) {
+    sender->start = sender->offset = first;
+    sender->size = first + len;
+    sender->buf_off = sender->buf_len = 0;
+}
+
+char* filesend_frame_chunk(char* data, size_t len, size_t* framed) {
+    char line[CHUNK_HEAD + 1];
+    int n = snprintf(line, sizeof(line), "%zx\r\n", len);
+    memcpy(data - n, line, n);
+    memcpy(data + len, "\r\n", CHUNK_TAIL);
+    *framed = n + len + CHUNK_TAIL;
+    return data - n;
+}
+
+char* filesend_map(int fd, off_t size) {
+    int flags = MAP_SHARED;
+    if (size >= MMAP_POPULATE_MIN && size <= MMAP_POPULATE_MAX) {
+        flags |= MAP_POPULATE;
+    }
+    char* data = mmap(NULL, size, PROT_READ, flags, fd, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    //responses read the mapping front to back, so ask for aggressive readahead. the advice is only a hint: failures don't matter.
+    madvise(data, size, MADV_SEQUENTIAL);
+    if (flags & MAP_POPULATE) {
+        //file-backed THP needs CONFIG_READ_ONLY_THP_FOR_FS (or a filesystem with large folios). elsewhere this is a no-op.
+        madvise(data, size, MADV_HUGEPAGE);
+    } else {
+        madvise(data, size, MADV_WILLNEED);
+    }
+    return data;
+}
+
+static bool would_block() {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+//send() for the paths that copy, or the writer that stands in for it.
+static ssize_t put(file_sender_t* sender, int client_socket, const char* buf, size_t len) {
+    if (sender->write != NULL) {
+        return sender->write(sender->write_ctx, buf, len);
+    }
+    return send(client_socket, buf, len, MSG_NOSIGNAL);
+}
+
+//pread() rather than read() because the file offset lives in the sender, not in the (possibly shared) file descriptor.
+static send_result_t send_copy(file_sender_t* sender, int client_socket) {
+    while (true) {
+        if (sender->buf_off == sender->buf_len) {
+            if (sender->ended) {
+                return SEND_DONE;
+            }
+            char* to = sender->chunked ? sender->buffer + CHUNK_HEAD : sender->buffer;
+            size_t want = sender->chunked ? BUFSIZE - CHUNK_HEAD - CHUNK_TAIL : BUFSIZE;
+            if (sender->sized && (off_t)want > sender->size - sender->offset) {
+                want = sender->size - sender->offset;
+            }
+            ssize_t n = want > 0 ? pread(sender->file_fd, to, want, sender->offset) : 0;
+            if (n == SOCKETERROR) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return SEND_ERROR;
+            }
+            sender->offset += n;
+            if (sender->chunked) {
+                //nothing left to read: that makes the last chunk, and the body is over once it's out.
+                size_t framed;
+                sender->buf_off = filesend_frame_chunk(to, n, &framed) - sender->buffer;
+                sender->buf_len = sender->buf_off + framed;
+                sender->ended = n == 0;
+            } else if (n == 0) {
+                //EOF only ends a body nobody gave a length for. a sized one that comes up short has promised bytes it can't send.
+                return sender->sized && sender->offset < sender->size ? SEND_ERROR : SEND_DONE;
+            } else {
+                sender->buf_off = 0;
+                sender->buf_len = n;
+            }
+        }
+        ssize_t sent = put(sender, client_socket, sender->buffer + sender->buf_off, sender->buf_len - sender->buf_off);
+        if (sent > 0) {
+            sender->buf_off += sent;
+        } else if (sent == SOCKETERROR && would_block()) {
+            return SEND_AGAIN;
+        } else if (sent == SOCKETERROR && errno == EINTR) {
+            continue;
+        } else {
+            return SEND_ERROR;
+        }
+    }
+}
+
+static send_result_t send_memory(file_sender_t* sender, int client_socket) {
+    while (sender->offset < sender->size) {
+        ssize_t sent = put(sender, client_socket, sender->data + sender->offset, sender->size - sender->offset);
+        if (sent > 0) {
+            sender->offset += sent;
+        } else if (sent == SOCKETERROR && would_block()) {
+            return SEND_AGAIN;
+        } else if (sent == SOCKETERROR && errno == EINTR) {
+            continue;
+        } else {
+            return SEND_ERROR;
+        }
+    }
+    return SEND_DONE;
+}
+
+//falls back to the next method down if the first call shows the kernel can't do this one for this file/socket pair.
+static send_result_t fall_back(file_sender_t* sender, int client_socket, send_method_t method) {
+    if (method == SEND_COPY && sender->buffer == NULL) {
+        return SEND_ERROR;
+    }
+    sender->method = method;
+    return filesend(sender, client_socket);
+}
+
+static send_result_t send_splice(file_sender_t* sender, int client_socket) {
+    if (sender->pipefd[0] == -1 && pipe2(sender->pipefd, O_NONBLOCK | O_CLOEXEC) == -1) {
+        return fall_back(sender, client_socket, SEND_COPY);
+    }
+
+    while (true) {
+        //the pipe is drained into the socket before anything else is spliced into it, so a transfer can stop on EAGAIN
+        //with bytes still in the pipe and pick them up on the next call.
+        if (sender->piped == 0) {
+            if (sender->offset >= sender->size) {
+                return SEND_DONE;
+            }
+            ssize_t n = splice(sender->file_fd, &sender->offset, sender->pipefd[1], NULL, sender->size - sender->offset, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == 0) {
+                return SEND_ERROR;  //the file shrank under us. the body can't be finished, so the connection has to go
+            }
+            if (n == SOCKETERROR) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EINVAL && sender->offset == sender->start) {
+                    return fall_back(sender, client_socket, SEND_COPY);
+                }
+                return SEND_ERROR;
+            }
+            sender->piped = n;
+        }
+        ssize_t sent = splice(sender->pipefd[0], NULL, client_socket, NULL, sender->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (sent > 0) {
+            sender->piped -= sent;
+        } else if (sent == SOCKETERROR && would_block()) {
+            return SEND_AGAIN;
+        } else if (sent == SOCKETERROR && errno == EINTR) {
+            continue;
+        } else {
+            return SEND_ERROR;
+        }
+    }
+}
+
+static send_result_t send_sendfile(file_sender_t* sender, int client_socket) {
+    while (sender->offset < sender->size) {
+        //sendfile() advances offset by however much it managed to queue, which may be less than asked for on a non-blocking socket.
+        ssize_t sent = sendfile(client_socket, sender->file_fd, &sender->offset, sender->size - sender->offset);
+        if (sent == 0) {
+            return SEND_ERROR;  //the file shrank under us. the body can't be finished, so the connection has to go
+        }
+        if (sent == SOCKETERROR) {
+            if (would_block()) {
+                return SEND_AGAIN;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EINVAL || errno == ENOSYS) && sender->offset == sender->start) {
+                return fall_back(sender, client_socket, SEND_SPLICE);
+            }
+            return SEND_ERROR;
+        }
+    }
+    return SEND_DONE;
+}
+
+send_result_t filesend(file_sender_t* sender, int client_socket) {
+    switch (sender->method) {
+        case SEND_SENDFILE:
+            return send_sendfile(sender, client_socket);
+        case SEND_SPLICE:
+            return send_splice(sender, client_socket);
+        case SEND_MEMORY:
+            return send_memory(sender, client_socket);
+        default:
+            return send_copy(sender, client_socket);
+    }
+}
+
+void filesend_release(file_sender_t* sender) {
+    if (sender->pipefd[0] != -1) {
+        close(sender->pipefd[0]);
+        close(sender->pipefd[1]);
+        sender->pipefd[0] = sender->pipefd[1] = -1;
+    }
+}
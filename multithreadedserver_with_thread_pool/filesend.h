@@ -0,0 +1,89 @@
+#ifndef FILESEND_H_
+#define FILESEND_H_
+
+#include<stdbool.h>
+#include<sys/types.h>
+
+//how file bytes get from the page cache to the socket.
+typedef enum {
+    SEND_SENDFILE,  //sendfile(2): the kernel moves pages straight to the socket, no copy through user space
+    SEND_SPLICE,    //splice(2) file -> pipe -> socket. zero-copy too, used where sendfile isn't supported
+    SEND_COPY,      //read() into a buffer and write() it out. two copies per chunk, kept for benchmarking
+    SEND_MMAP,      //the cache keeps big files mapped and they go out like SEND_MEMORY. one copy, but no syscall for the body alone
+    SEND_MEMORY,    //the bytes are already in memory (see filecache.c). not selectable with -s
+} send_method_t;
+
+//-s mmap: files from this size up are mapped with MAP_POPULATE so the first requests don't fault their way through them,
+//and may be backed by huge pages where the kernel and filesystem support it. smaller ones get MADV_WILLNEED instead.
+#define MMAP_POPULATE_MIN (2 * 1024 * 1024)
+#define MMAP_POPULATE_MAX (256 * 1024 * 1024)   //above this, populating would stall the worker that missed for too long
+
+//chunked transfer coding wraps each chunk in its size line ("1ff0\r\n") and a CRLF. the copy path reads a chunk in CHUNK_HEAD bytes
+//into its buffer and frames it in place, so a chunk still goes out in one piece.
+#define CHUNK_HEAD 8    //up to 6 hex digits and the CRLF
+#define CHUNK_TAIL 2
+
+typedef enum {
+    SEND_DONE,      //the whole file has been sent
+    SEND_AGAIN,     //the (non-blocking) socket is full, call again once it is writable
+    SEND_ERROR,     //including a file that ended before the size its headers promised: the connection can't be reused
+} send_result_t;
+
+//progress of one file transfer. lives in the connection so a transfer can be resumed after EAGAIN.
+typedef struct file_sender {
+    int file_fd;
+    off_t start;        //where the transfer began: 0, or the first byte of a range
+    off_t offset;       //next byte of the file to hand to the kernel
+    off_t size;         //where to stop: the file's size, or the end of a range
+    bool sized;         //size is known up front. false for files that have to be read until EOF
+    bool chunked;       //unsized only: frame the body in chunked transfer coding, so EOF doesn't have to end the connection
+    bool ended;         //chunked: the last (empty) chunk has been framed
+    send_method_t method;
+    int pipefd[2];      //splice only. outlives the transfer: see filesend_setup()
+    size_t piped;       //bytes sitting in the pipe that haven't reached the socket yet
+    const char* data;   //memory only
+    char* buffer;       //copy only, BUFSIZE bytes owned by the caller
+    size_t buf_off;
+    size_t buf_len;
+    ssize_t (*write)(void* ctx, const void* buf, size_t len);  //replaces send() when set, e.g. TLS in user space. NULL normally
+    void* write_ctx;
+} file_sender_t;
+
+//picked at startup with -s. defaults to sendfile.
+extern send_method_t send_method;
+
+// parses "sendfile", "splice", "copy" or "mmap". returns false for anything else.
+bool parse_send_method(const char* name, send_method_t* method);
+
+// readies a sender that hasn't been used yet. the pipe splice opens on its first transfer is kept for the ones after it, which
+// saves a pipe2() and two close()s per response, until filesend_release().
+void filesend_setup(file_sender_t* sender);
+
+// prepares sender to transmit file_fd from the start. buffer is only used by SEND_COPY. returns false on error.
+bool filesend_init(file_sender_t* sender, int file_fd, char* buffer);
+
+// prepares sender to transmit size bytes straight from data.
+void filesend_init_memory(file_sender_t* sender, const char* data, off_t size);
+
+// narrows a prepared (sized) transfer down to len bytes from first. may be called again once a range is done, for the next one.
+void filesend_set_range(file_sender_t* sender, off_t first, off_t len);
+
+// makes a prepared transfer go through write(ctx, ...) instead of send() on the socket. the zero-copy methods can't, so anything but
+// memory falls back to SEND_COPY: the buffer passed to filesend_init() must not have been NULL.
+void filesend_set_writer(file_sender_t* sender, ssize_t (*write)(void* ctx, const void* buf, size_t len), void* ctx);
+
+// frames the len bytes at data as a chunk: writes the size line into the CHUNK_HEAD bytes before data and a CRLF after it.
+// len 0 makes the last chunk, which ends the body. returns where the chunk starts now, and its length in *framed.
+char* filesend_frame_chunk(char* data, size_t len, size_t* framed);
+
+// maps size bytes of fd read-only and shared, with readahead hints for streaming them out front to back.
+// returns NULL if the file can't be mapped. undo with munmap().
+char* filesend_map(int fd, off_t size);
+
+// pushes as much of the file as the socket accepts.
+send_result_t filesend(file_sender_t* sender, int client_socket);
+
+// releases the pipe (if any). does not close file_fd. the sender needs filesend_setup() again before it is reused.
+void filesend_release(file_sender_t* sender);
+
+#endif
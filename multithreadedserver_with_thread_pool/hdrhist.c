@@ -0,0 +1,105 @@
+#include<stdlib.h>
+#include<string.h>
+#include<stdbool.h>
+#include "hdrhist.h"
+
+#define HDR_HALF (HDR_SUB_BUCKETS / 2)
+
+hdr_hist_t* hdr_create() {
+    hdr_hist_t* h = malloc(sizeof(hdr_hist_t));
+    hdr_reset(h);
+    return h;
+}
+
+void hdr_reset(hdr_hist_t* h) {
+    memset(h, 0, sizeof(hdr_hist_t));
+    h->min = UINT64_MAX;
+}
+
+//values under HDR_SUB_BUCKETS map to themselves. above that, shift the value down until it fits in [HDR_HALF, HDR_SUB_BUCKETS)
+//and use the shift to pick the row and the remaining bits to pick the step within it.
+static int bucket_index(uint64_t value) {
+    if (value < HDR_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int shift = (63 - __builtin_clzll(value)) - (HDR_SUB_BITS - 1);
+    return HDR_SUB_BUCKETS + (shift - 1) * HDR_HALF + (int)((value >> shift) - HDR_HALF);
+}
+
+//the largest value that lands in bucket i.
+static uint64_t bucket_value(int i) {
+    if (i < HDR_SUB_BUCKETS) {
+        return i;
+    }
+    int shift = (i - HDR_SUB_BUCKETS) / HDR_HALF + 1;
+    uint64_t sub = (i - HDR_SUB_BUCKETS) % HDR_HALF + HDR_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+void hdr_record(hdr_hist_t* h, uint64_t value) {
+    if (value >= (1ULL << HDR_MAX_BITS)) {
+        value = (1ULL << HDR_MAX_BITS) - 1;
+    }
+    h->counts[bucket_index(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+void hdr_record_atomic(hdr_hist_t* h, uint64_t value) {
+    if (value >= (1ULL << HDR_MAX_BITS)) {
+        value = (1ULL << HDR_MAX_BITS) - 1;
+    }
+    __atomic_fetch_add(&h->counts[bucket_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    uint64_t seen = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while (value < seen && !__atomic_compare_exchange_n(&h->min, &seen, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    seen = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > seen && !__atomic_compare_exchange_n(&h->max, &seen, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void hdr_merge(hdr_hist_t* dst, const hdr_hist_t* src) {
+    for (int i=0;i<HDR_COUNTS;i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+uint64_t hdr_percentile(const hdr_hist_t* h, double percentile) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t wanted = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    if (wanted < 1) {
+        wanted = 1;
+    }
+    uint64_t seen = 0;
+    for (int i=0;i<HDR_COUNTS;i++) {
+        seen += h->counts[i];
+        if (seen >= wanted) {
+            //the bucket's upper edge, but never more than what was actually recorded.
+            uint64_t v = bucket_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+double hdr_mean(const hdr_hist_t* h) {
+    return h->total ? (double)h->sum / h->total : 0;
+}
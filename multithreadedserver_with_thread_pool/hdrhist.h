@@ -0,0 +1,34 @@
+#ifndef HDRHIST_H_
+#define HDRHIST_H_
+
+#include<stdint.h>
+
+//high dynamic range histogram of latencies in nanoseconds, after Gil Tene's HdrHistogram.
+//values below HDR_SUB_BUCKETS are counted exactly. above that every power of two is split into HDR_SUB_BUCKETS/2 linear steps,
+//so any recorded value is known to within 1/1024 (3 significant digits) from 1ns up to ~18 minutes, in a fixed 256KB array.
+#define HDR_SUB_BITS 11
+#define HDR_SUB_BUCKETS (1 << HDR_SUB_BITS)
+#define HDR_MAX_BITS 40                     //values are clamped to 2^40ns
+#define HDR_COUNTS (HDR_SUB_BUCKETS + (HDR_MAX_BITS - HDR_SUB_BITS) * (HDR_SUB_BUCKETS / 2))
+
+typedef struct hdr_hist {
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint64_t counts[HDR_COUNTS];
+} hdr_hist_t;
+
+hdr_hist_t* hdr_create();
+void hdr_reset(hdr_hist_t* h);
+void hdr_record(hdr_hist_t* h, uint64_t value);
+// hdr_record() for a histogram shared between threads. every field is updated with an atomic, so readers may see a
+// recording half-applied (e.g. total already bumped, max not yet), which is fine for stats.
+void hdr_record_atomic(hdr_hist_t* h, uint64_t value);
+// adds every count in src to dst.
+void hdr_merge(hdr_hist_t* dst, const hdr_hist_t* src);
+// the smallest recorded value v such that percentile% of all values are <= v. 0 if the histogram is empty.
+uint64_t hdr_percentile(const hdr_hist_t* h, double percentile);
+double hdr_mean(const hdr_hist_t* h);
+
+#endif
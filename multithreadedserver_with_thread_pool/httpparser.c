@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include<string.h>
+#include<strings.h>
+#include "httpparser.h"
+#include "httpscan.h"
+
+#define MAX_CONTENT_LENGTH 1000000000000000LL
+
+void http_parser_reset(http_parser_t* parser) {
+    parser->scanned = 0;
+    parser->line_len = 0;
+}
+
+static bool equals_nocase(const char* s, size_t len, const char* literal) {
+    return strlen(literal) == len && strncasecmp(s, literal, len) == 0;
+}
+
+//returns the end of the line that finishes at nl, minus the \r if it's a CRLF.
+static const char* line_end(const char* start, const char* nl) {
+    return (nl > start && nl[-1] == '\r') ? nl - 1 : nl;
+}
+
+static bool parse_content_length(const char* value, size_t len, long long* out) {
+    long long n = 0;
+    if (len == 0) {
+        return false;
+    }
+    for (size_t i=0;i<len;i++) {
+        if (value[i] < '0' || value[i] > '9') {
+            return false;
+        }
+        n = n * 10 + (value[i] - '0');
+        if (n > MAX_CONTENT_LENGTH) {
+            return false;
+        }
+    }
+    *out = n;
+    return true;
+}
+
+//Connection is a comma separated list of tokens. we only care about close and keep-alive.
+static void parse_connection(const char* value, size_t len, bool* close, bool* keep_alive) {
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && value[i] != ',' && value[i] != ' ' && value[i] != '\t') {
+            i++;
+        }
+        if (equals_nocase(value + start, i - start, "close")) {
+            *close = true;
+        } else if (equals_nocase(value + start, i - start, "keep-alive")) {
+            *keep_alive = true;
+        }
+    }
+}
+
+static http_parse_result_t parse_legacy(const char* buf, size_t line_len, http_request_t* req) {
+    req->method = "GET";
+    req->method_len = 3;
+    req->target = buf;
+    req->target_len = line_end(buf, buf + line_len - 1) - buf;
+    req->version_minor = -1;
+    req->num_headers = 0;
+    req->content_length = 0;
+    req->chunked = false;
+    req->keep_alive = false;
+    req->header_len = line_len;
+    return req->target_len > 0 ? HTTP_PARSE_OK : HTTP_PARSE_ERROR;
+}
+
+//method and target are each a run of their characters ended by exactly one space.
+static http_parse_result_t parse_request_line(const char* buf, const char* eol, http_request_t* req) {
+    size_t method_len = http_scan(buf, eol - buf, SCAN_TOKEN);
+    if (method_len == 0 || buf + method_len == eol || buf[method_len] != ' ') {
+        return HTTP_PARSE_ERROR;
+    }
+    req->method = buf;
+    req->method_len = method_len;
+
+    const char* target = buf + method_len + 1;
+    size_t target_len = http_scan(target, eol - target, SCAN_TARGET);
+    if (target_len == 0 || target + target_len == eol || target[target_len] != ' ') {
+        return HTTP_PARSE_ERROR;
+    }
+    req->target = target;
+    req->target_len = target_len;
+
+    const char* version = target + target_len + 1;
+    if (eol - version != 8 || memcmp(version, "HTTP/1.", 7) != 0 || version[7] < '0' || version[7] > '9') {
+        return HTTP_PARSE_ERROR;
+    }
+    req->version_minor = version[7] == '0' ? 0 : 1;
+    return HTTP_PARSE_OK;
+}
+
+static http_parse_result_t parse_headers(const char* p, const char* end, http_request_t* req) {
+    bool close = false, keep_alive = false, have_length = false;
+
+    req->num_headers = 0;
+    req->content_length = 0;
+    req->chunked = false;
+
+    //the block ends in a '\n' that neither scan goes past, so neither of them can run off the end.
+    while (p < end) {
+        if (*p == '\n' || (*p == '\r' && p[1] == '\n')) {
+            break;  //the blank line
+        }
+        //a name has to be followed by its colon straight away. that also turns away obsolete line folding, which RFC 9112 lets us reject.
+        size_t name_len = http_scan(p, end - p, SCAN_TOKEN);
+        if (name_len == 0 || p[name_len] != ':' || req->num_headers == HTTP_MAX_HEADERS) {
+            return HTTP_PARSE_ERROR;
+        }
+        const char* value = p + name_len + 1;
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+        //the value has to run all the way to the line end. stopping anywhere else means a control character or a bare CR,
+        //which have no business in a header and are how requests get smuggled past proxies that read them differently.
+        const char* eol = value + http_scan(value, end - value, SCAN_VALUE);
+        const char* nl = eol;
+        if (*eol == '\r' && eol[1] == '\n') {
+            nl = eol + 1;
+        } else if (*eol != '\n') {
+            return HTTP_PARSE_ERROR;
+        }
+        const char* value_end = eol;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            value_end--;
+        }
+
+        http_header_t* h = &req->headers[req->num_headers++];
+        h->name = p;
+        h->name_len = name_len;
+        h->value = value;
+        h->value_len = value_end - value;
+
+        if (equals_nocase(h->name, h->name_len, "Content-Length")) {
+            long long length;
+            //a second Content-Length that disagrees with the first is a request smuggling attempt, not a typo.
+            if (!parse_content_length(h->value, h->value_len, &length) || (have_length && length != req->content_length)) {
+                return HTTP_PARSE_ERROR;
+            }
+            req->content_length = length;
+            have_length = true;
+        } else if (equals_nocase(h->name, h->name_len, "Connection")) {
+            parse_connection(h->value, h->value_len, &close, &keep_alive);
+        } else if (equals_nocase(h->name, h->name_len, "Transfer-Encoding")) {
+            req->chunked = true;
+        }
+        p = nl + 1;
+    }
+
+    //HTTP/1.1 connections persist unless the client says otherwise. HTTP/1.0 ones only if it asks.
+    req->keep_alive = !close && (req->version_minor >= 1 || keep_alive);
+    return HTTP_PARSE_OK;
+}
+
+http_parse_result_t http_parse_request(http_parser_t* parser, const char* buf, size_t len, http_request_t* req) {
+    size_t from = parser->scanned;
+
+    //the first line decides between HTTP and the legacy protocol, so find it before anything else.
+    if (parser->line_len == 0) {
+        const char* nl = memchr(buf + from, '\n', len - from);
+        if (nl == NULL) {
+            parser->scanned = len;
+            return HTTP_PARSE_INCOMPLETE;
+        }
+        parser->line_len = nl - buf + 1;
+        if (memchr(buf, ' ', nl - buf) == NULL) {
+            return parse_legacy(buf, parser->line_len, req);
+        }
+        from = nl - buf;
+    }
+    //the headers end at the first line end that follows another one directly. every byte is looked at once across calls.
+    size_t end = http_scan_headers_end(buf, from, len);
+    if (end == 0) {
+        parser->scanned = len;
+        return HTTP_PARSE_INCOMPLETE;
+    }
+
+    const char* first_nl = buf + parser->line_len - 1;
+    if (parse_request_line(buf, line_end(buf, first_nl), req) != HTTP_PARSE_OK) {
+        return HTTP_PARSE_ERROR;
+    }
+    if (parse_headers(first_nl + 1, buf + end, req) != HTTP_PARSE_OK) {
+        return HTTP_PARSE_ERROR;
+    }
+    req->header_len = end;
+    return HTTP_PARSE_OK;
+}
+
+const char* http_find_header(const http_request_t* req, const char* name, size_t* value_len) {
+    for (int i=0;i<req->num_headers;i++) {
+        if (equals_nocase(req->headers[i].name, req->headers[i].name_len, name)) {
+            *value_len = req->headers[i].value_len;
+            return req->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+bool http_method_is(const http_request_t* req, const char* method) {
+    return strlen(method) == req->method_len && memcmp(req->method, method, req->method_len) == 0;
+}
+
+const char* http_status_text(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 206: return "Partial Content";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Content Too Large";
+        case 416: return "Range Not Satisfiable";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        default: return "Unknown";
+    }
+}
+
+//a run of digits at value[*i]. false if there isn't one, or it doesn't fit.
+static bool parse_number(const char* value, size_t len, size_t* i, long long* out) {
+    long long n = 0;
+    size_t start = *i;
+    while (*i < len && value[*i] >= '0' && value[*i] <= '9') {
+        if (n > (MAX_CONTENT_LENGTH - 9) / 10) {
+            return false;
+        }
+        n = n * 10 + (value[*i] - '0');
+        (*i)++;
+    }
+    *out = n;
+    return *i > start;
+}
+
+int http_parse_ranges(const char* value, size_t len, long long size, http_range_t* ranges, int max) {
+    size_t i = 6;
+    int n = 0;
+    if (len < 6 || strncasecmp(value, "bytes=", 6) != 0) {
+        return -1;
+    }
+    while (true) {
+        long long first, last;
+        while (i < len && (value[i] == ' ' || value[i] == '\t')) {
+            i++;
+        }
+        if (i < len && value[i] == '-') {
+            //suffix range: the last N bytes.
+            i++;
+            if (!parse_number(value, len, &i, &last)) {
+                return -1;
+            }
+            first = last < size ? size - last : 0;
+            last = last > 0 ? size - 1 : -1;
+        } else {
+            if (!parse_number(value, len, &i, &first) || i == len || value[i++] != '-') {
+                return -1;
+            }
+            if (!parse_number(value, len, &i, &last)) {
+                last = size - 1;
+            } else if (last < first) {
+                return -1;
+            } else if (last >= size) {
+                last = size - 1;
+            }
+        }
+        //ranges that start past the end (or a zero-length suffix) are left out. if that's all of them, it's a 416.
+        if (first <= last && first < size) {
+            if (n == max) {
+                return -1;
+            }
+            ranges[n].first = first;
+            ranges[n].last = last;
+            n++;
+        }
+        while (i < len && (value[i] == ' ' || value[i] == '\t')) {
+            i++;
+        }
+        if (i == len) {
+            return n;
+        }
+        if (value[i++] != ',') {
+            return -1;
+        }
+    }
+}
+
+bool http_parse_date(const char* value, size_t len, time_t* t) {
+    char date[HTTP_DATE_MAX];
+    struct tm tm;
+    if (len >= sizeof(date)) {
+        return false;
+    }
+    memcpy(date, value, len);
+    date[len] = 0;
+    memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != 0) {
+        return false;
+    }
+    *t = timegm(&tm);
+    return true;
+}
+
+void http_format_date(time_t t, char* out) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(out, HTTP_DATE_MAX, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
@@ -0,0 +1,78 @@
+#ifndef HTTPPARSER_H_
+#define HTTPPARSER_H_
+
+#include<stdbool.h>
+#include<stddef.h>
+#include<time.h>
+
+//incremental, zero-allocation HTTP/1.x request parser. the request it fills in points into the caller's buffer, so the buffer
+//must not change until the caller is done with the request.
+//a line with no spaces in it (e.g. "/path/to/file\n", what client.rb sends) is accepted as a legacy request for that path.
+#define HTTP_MAX_HEADERS 32
+#define HTTP_MAX_RANGES 8       //a Range asking for more pieces than this is ignored and the whole file is sent
+#define HTTP_DATE_MAX 32        //"Sun, 06 Nov 1994 08:49:37 GMT" and its NUL, with room to spare
+
+typedef struct http_header {
+    const char* name;
+    size_t name_len;
+    const char* value;
+    size_t value_len;
+} http_header_t;
+
+typedef struct http_request {
+    const char* method;
+    size_t method_len;
+    const char* target;
+    size_t target_len;
+    int version_minor;          //0 or 1. -1 for a legacy request
+    http_header_t headers[HTTP_MAX_HEADERS];
+    int num_headers;
+    long long content_length;   //0 if there is no Content-Length
+    bool chunked;               //Transfer-Encoding was sent. we don't accept request bodies in that form
+    bool keep_alive;
+    size_t header_len;          //bytes taken up by the request line and headers, body not included
+} http_request_t;
+
+typedef enum {
+    HTTP_PARSE_OK,
+    HTTP_PARSE_INCOMPLETE,      //need more bytes
+    HTTP_PARSE_ERROR,           //malformed. answer 400 and close
+} http_parse_result_t;
+
+//one satisfiable byte range of a representation, both ends included.
+typedef struct http_range {
+    long long first;
+    long long last;
+} http_range_t;
+
+//remembers how far the buffer has been searched for the end of the headers, so feeding it one more read() doesn't rescan everything.
+typedef struct http_parser {
+    size_t scanned;
+    size_t line_len;    //length of the request line including its '\n', once it has been seen
+} http_parser_t;
+
+void http_parser_reset(http_parser_t* parser);
+
+// parses the request at the start of buf[0..len). call again with the same (grown) buffer after HTTP_PARSE_INCOMPLETE.
+http_parse_result_t http_parse_request(http_parser_t* parser, const char* buf, size_t len, http_request_t* req);
+
+// returns the header's value (and its length) or NULL if the request doesn't have it. names compare case-insensitively.
+const char* http_find_header(const http_request_t* req, const char* name, size_t* value_len);
+
+// true if the method is exactly the given string.
+bool http_method_is(const http_request_t* req, const char* method);
+
+const char* http_status_text(int status);
+
+// parses a Range value ("bytes=0-499, -500, 9000-") against a representation of size bytes into at most max ranges, clipped to
+// the size. returns how many there are, 0 if none of them can be satisfied (416), or -1 if the header should be ignored:
+// malformed, not in bytes, or asking for more than max pieces.
+int http_parse_ranges(const char* value, size_t len, long long size, http_range_t* ranges, int max);
+
+// parses an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"). false if it isn't one.
+bool http_parse_date(const char* value, size_t len, time_t* t);
+
+// formats t as an IMF-fixdate into out, which needs HTTP_DATE_MAX bytes.
+void http_format_date(time_t t, char* out);
+
+#endif
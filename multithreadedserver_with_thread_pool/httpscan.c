@@ -0,0 +1,290 @@
+#include<stdint.h>
+#include<string.h>
+#include<pthread.h>
+#include "httpscan.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include<immintrin.h>
+#define SCAN_X86
+#endif
+
+#define PAGE_SIZE 4096
+
+typedef struct scan_impl {
+    const char* name;
+    size_t (*scan)(const char* p, size_t len, scan_class_t cls);
+    size_t (*headers_end)(const char* buf, size_t from, size_t len);
+} scan_impl_t;
+
+static uint8_t class_table[256];    //bit cls is set for every character of class cls
+static uint8_t token_lo[16];        //tchars by low nibble: bit h is set if (h << 4 | low nibble) is a tchar
+static uint8_t token_hi[16];        //bit h for high nibble h. nothing from 0x80 up is a tchar
+static pthread_once_t pick_once = PTHREAD_ONCE_INIT;
+static const scan_impl_t* impl;
+
+static bool is_tchar(int c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        return true;
+    }
+    return c != 0 && c < 128 && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+static size_t scan_scalar(const char* p, size_t len, scan_class_t cls) {
+    uint8_t bit = 1 << cls;
+    size_t i = 0;
+    while (i < len && (class_table[(unsigned char)p[i]] & bit)) {
+        i++;
+    }
+    return i;
+}
+
+static bool ends_headers(const char* buf, size_t i) {
+    return (i >= 1 && buf[i-1] == '\n') || (i >= 2 && buf[i-1] == '\r' && buf[i-2] == '\n');
+}
+
+static size_t headers_end_scalar(const char* buf, size_t from, size_t len) {
+    for (size_t i=from;i<len;i++) {
+        const char* nl = memchr(buf + i, '\n', len - i);
+        if (nl == NULL) {
+            break;
+        }
+        i = nl - buf;
+        if (ends_headers(buf, i)) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+//the blank line, given bit masks of where the LFs and CRs are in a block starting at buf[at]: an LF whose previous byte is an LF,
+//or a CR with an LF before it. the bytes before the block come straight from the buffer.
+static int blank_line_in(const char* buf, size_t at, uint64_t lf, uint64_t cr) {
+    uint64_t lf1 = lf << 1, lf2 = lf << 2, cr1 = cr << 1;
+    if (at >= 1) {
+        lf1 |= buf[at-1] == '\n';
+        lf2 |= (uint64_t)(buf[at-1] == '\n') << 1;
+        cr1 |= buf[at-1] == '\r';
+    }
+    if (at >= 2) {
+        lf2 |= buf[at-2] == '\n';
+    }
+    uint64_t end = lf & (lf1 | (cr1 & lf2));
+    return end != 0 ? __builtin_ctzll(end) : -1;
+}
+
+#ifdef SCAN_X86
+//a vector load that starts inside the buffer can run past its end, but not off its page, and only a page can fault.
+//the bytes past the end are ignored, so short runs don't have to fall back to a byte at a time.
+static bool load_is_safe(const char* p, size_t width) {
+    return ((uintptr_t)p & (PAGE_SIZE - 1)) <= PAGE_SIZE - width;
+}
+
+//the characters each class stops at, as pcmpestri ranges (inclusive pairs). the tchar complement needs more than the 8 pairs
+//pcmpestri takes, so the last token range also covers '|' and '~' and every hit there is checked against the table.
+static const struct {
+    char bytes[16];
+    int len;
+} stop_ranges[SCAN_CLASSES] = {
+    [SCAN_TOKEN] = { { 0x00, ' ', '"', '"', '(', ')', ',', ',', '/', '/', ':', '@', '[', ']', '{', (char)0xff }, 16 },
+    [SCAN_TARGET] = { { 0x00, ' ', 0x7f, 0x7f }, 4 },
+    [SCAN_VALUE] = { { 0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f }, 6 },
+};
+
+__attribute__((target("sse4.2")))
+static size_t scan_sse42(const char* p, size_t len, scan_class_t cls) {
+    const __m128i ranges = _mm_loadu_si128((const __m128i*)stop_ranges[cls].bytes);
+    const int nranges = stop_ranges[cls].len;
+    uint8_t bit = 1 << cls;
+    size_t i = 0;
+
+    while (i < len) {
+        size_t left = len - i;
+        if (left < 16 && !load_is_safe(p + i, 16)) {
+            return i + scan_scalar(p + i, left, cls);
+        }
+        int n = left < 16 ? (int)left : 16;
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + i));
+        int hit = _mm_cmpestri(ranges, nranges, b, n, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (hit >= n) {
+            i += n;
+            continue;
+        }
+        i += hit;
+        if (!(class_table[(unsigned char)p[i]] & bit)) {
+            return i;
+        }
+        i++;
+    }
+    return len;
+}
+
+__attribute__((target("sse4.2")))
+static size_t headers_end_sse42(const char* buf, size_t from, size_t len) {
+    const __m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+    for (size_t i=from;i<len;i+=16) {
+        size_t left = len - i;
+        if (left < 16 && !load_is_safe(buf + i, 16)) {
+            return headers_end_scalar(buf, i, len);
+        }
+        __m128i b = _mm_loadu_si128((const __m128i*)(buf + i));
+        uint64_t valid = left < 16 ? (1ULL << left) - 1 : 0xffff;
+        int at = blank_line_in(buf, i, _mm_movemask_epi8(_mm_cmpeq_epi8(b, lf)) & valid, _mm_movemask_epi8(_mm_cmpeq_epi8(b, cr)) & valid);
+        if (at >= 0) {
+            return i + at + 1;
+        }
+    }
+    return 0;
+}
+
+//one vector of stop flags for 32 characters. tchars are looked up by nibble (pshufb on both halves, AND, zero means not a tchar).
+//the other two classes are plain ranges, and unsigned b <= x is min(b, x) == b.
+__attribute__((target("avx2"), always_inline))
+static inline __m256i stops_avx2(__m256i b, scan_class_t cls, __m256i lo_lut, __m256i hi_lut) {
+    if (cls == SCAN_TOKEN) {
+        const __m256i nibble = _mm256_set1_epi8(0x0f);
+        __m256i lo = _mm256_shuffle_epi8(lo_lut, _mm256_and_si256(b, nibble));
+        __m256i hi = _mm256_shuffle_epi8(hi_lut, _mm256_and_si256(_mm256_srli_epi16(b, 4), nibble));
+        return _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+    }
+    __m256i del = _mm256_cmpeq_epi8(b, _mm256_set1_epi8(0x7f));
+    if (cls == SCAN_TARGET) {
+        return _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(b, _mm256_set1_epi8(' ')), b), del);
+    }
+    __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(b, _mm256_set1_epi8(0x1f)), b);
+    return _mm256_or_si256(_mm256_andnot_si256(_mm256_cmpeq_epi8(b, _mm256_set1_epi8('\t')), ctl), del);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline size_t run_avx2(const char* p, size_t len, scan_class_t cls) {
+    const __m256i lo_lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)token_lo));
+    const __m256i hi_lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)token_hi));
+    size_t i = 0;
+
+    while (i < len) {
+        size_t left = len - i;
+        if (left < 32 && !load_is_safe(p + i, 32)) {
+            return i + scan_scalar(p + i, left, cls);
+        }
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p + i));
+        uint32_t mask = _mm256_movemask_epi8(stops_avx2(b, cls, lo_lut, hi_lut));
+        if (left < 32) {
+            mask |= ~0u << left;
+        }
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+    return len;
+}
+
+__attribute__((target("avx2")))
+static size_t headers_end_avx2(const char* buf, size_t from, size_t len) {
+    const __m256i lf = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+    for (size_t i=from;i<len;i+=32) {
+        size_t left = len - i;
+        if (left < 32 && !load_is_safe(buf + i, 32)) {
+            return headers_end_scalar(buf, i, len);
+        }
+        __m256i b = _mm256_loadu_si256((const __m256i*)(buf + i));
+        uint64_t valid = left < 32 ? (1ULL << left) - 1 : 0xffffffff;
+        uint64_t lfs = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, lf)) & valid;
+        uint64_t crs = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, cr)) & valid;
+        int at = blank_line_in(buf, i, lfs, crs);
+        if (at >= 0) {
+            return i + at + 1;
+        }
+    }
+    return 0;
+}
+
+//one copy of the loop per class, so the class tests are decided at compile time rather than per vector.
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char* p, size_t len, scan_class_t cls) {
+    switch (cls) {
+        case SCAN_TOKEN:
+            return run_avx2(p, len, SCAN_TOKEN);
+        case SCAN_TARGET:
+            return run_avx2(p, len, SCAN_TARGET);
+        default:
+            return run_avx2(p, len, SCAN_VALUE);
+    }
+}
+#endif
+
+static const scan_impl_t impls[] = {
+#ifdef SCAN_X86
+    { "avx2", scan_avx2, headers_end_avx2 },
+    { "sse4.2", scan_sse42, headers_end_sse42 },
+#endif
+    { "scalar", scan_scalar, headers_end_scalar },
+};
+
+//__builtin_cpu_supports() only takes string literals.
+static bool cpu_supports(const char* name) {
+#ifdef SCAN_X86
+    if (strcmp(name, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    }
+    if (strcmp(name, "sse4.2") == 0) {
+        return __builtin_cpu_supports("sse4.2");
+    }
+#endif
+    return true;
+}
+
+//builds the tables and settles on the widest implementation the CPU runs. impls[] is ordered best first.
+static void pick() {
+    for (int c=0;c<256;c++) {
+        if (is_tchar(c)) {
+            class_table[c] |= 1 << SCAN_TOKEN;
+            token_lo[c & 15] |= 1 << (c >> 4);
+        }
+        if (c > ' ' && c != 0x7f) {
+            class_table[c] |= 1 << SCAN_TARGET;
+        }
+        if (c == '\t' || (c >= ' ' && c != 0x7f)) {
+            class_table[c] |= 1 << SCAN_VALUE;
+        }
+    }
+    for (int h=0;h<8;h++) {
+        token_hi[h] = 1 << h;
+    }
+    for (size_t i=0;i<sizeof(impls)/sizeof(impls[0]);i++) {
+        if (cpu_supports(impls[i].name)) {
+            __atomic_store_n(&impl, &impls[i], __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+static const scan_impl_t* get_impl() {
+    const scan_impl_t* i = __atomic_load_n(&impl, __ATOMIC_ACQUIRE);
+    if (i == NULL) {
+        pthread_once(&pick_once, pick);
+        i = impl;
+    }
+    return i;
+}
+
+size_t http_scan(const char* p, size_t len, scan_class_t cls) {
+    return get_impl()->scan(p, len, cls);
+}
+
+size_t http_scan_headers_end(const char* buf, size_t from, size_t len) {
+    return get_impl()->headers_end(buf, from, len);
+}
+
+const char* http_scan_impl() {
+    return get_impl()->name;
+}
+
+bool http_scan_set_impl(const char* name) {
+    pthread_once(&pick_once, pick);
+    for (size_t i=0;i<sizeof(impls)/sizeof(impls[0]);i++) {
+        if (strcmp(impls[i].name, name) == 0 && cpu_supports(name)) {
+            __atomic_store_n(&impl, &impls[i], __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+    return false;
+}
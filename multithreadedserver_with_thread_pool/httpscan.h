@@ -0,0 +1,32 @@
+#ifndef HTTPSCAN_H_
+#define HTTPSCAN_H_
+
+#include<stdbool.h>
+#include<stddef.h>
+
+//the byte scanning under httpparser.c: where does the header block end, and how far does a run of allowed characters go. the parser
+//asks the latter of every method, target, header name and header value, so the line ends, the stop characters (SP, ':', CR, LF) and
+//anything not allowed are found 16 or 32 bytes at a time where the CPU can (SSE4.2, AVX2), and a byte at a time where it can't.
+//the choice is made once, at the first call.
+typedef enum {
+    SCAN_TOKEN,     //RFC 9110 tchar: methods and header names
+    SCAN_TARGET,    //request target: any visible character, obs-text included. stops at SP, CTLs and DEL
+    SCAN_VALUE,     //field value: visible characters, obs-text, SP and HTAB. stops at CR, LF, the other CTLs and DEL
+    SCAN_CLASSES,
+} scan_class_t;
+
+// length of the run of cls characters at the start of p[0..len).
+size_t http_scan(const char* p, size_t len, scan_class_t cls);
+
+// finds the blank line that ends a header block: the first '\n' at or after from that directly follows another line end
+// ("\n\n" or "\n\r\n"). looks back up to 2 bytes before from, so a block that arrives in pieces is searched only once.
+// returns the index just past that '\n', or 0 if buf[0..len) doesn't have it yet.
+size_t http_scan_headers_end(const char* buf, size_t from, size_t len);
+
+// the implementation in use: "avx2", "sse4.2" or "scalar".
+const char* http_scan_impl();
+
+// switches to the named implementation (for benchmarks). false if there's no such thing, or the CPU can't run it.
+bool http_scan_set_impl(const char* name);
+
+#endif
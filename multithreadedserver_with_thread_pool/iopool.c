@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdatomic.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<sys/eventfd.h>
+#include "iopool.h"
+#include "filecache.h"
+#include "metrics.h"
+#include "server.h"
+
+int iopool_latency_ms = 0;
+
+//the I/O threads' queue: jobs waiting for a thread, oldest at head.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nonempty = PTHREAD_COND_INITIALIZER;
+static io_job_t** queue;
+static int head, queued, depth;
+static int nthreads;
+
+static atomic_long busy, offloaded, inlined;
+
+//cache_get(), and on a miss the simulated disk on top.
+static void load(io_job_t* job) {
+    job->entry = cache_get(job->file.path, job->indexed ? &job->file : NULL, &job->hit);
+    if (!job->hit && iopool_latency_ms > 0) {
+        usleep(1000 * iopool_latency_ms);
+    }
+}
+
+void iopool_run(io_job_t* job) {
+    atomic_fetch_add(&inlined, 1);
+    metrics_count(M_IO_INLINE, 1);
+    load(job);
+}
+
+bool iopool_submit(io_job_t* job, io_completions_t* cq) {
+    if (nthreads == 0) {
+        return false;
+    }
+    job->cq = cq;
+    job->queued = metrics_now();
+    pthread_mutex_lock(&lock);
+    if (queued == depth) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    queue[(head + queued++) % depth] = job;
+    pthread_cond_signal(&nonempty);
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+//hands a finished job back to its network thread.
+static void complete(io_job_t* job) {
+    io_completions_t* cq = job->cq;
+    pthread_mutex_lock(&cq->lock);
+    job->next = cq->done;
+    cq->done = job;
+    if (cq->efd < 0) {
+        pthread_cond_signal(&cq->ready);
+    }
+    pthread_mutex_unlock(&cq->lock);
+    if (cq->efd >= 0) {
+        uint64_t one = 1;
+        //the counter only saturates after 2^64-2 writes nobody read. a short write can't happen.
+        if (write(cq->efd, &one, sizeof(one)) < 0) {
+            perror("eventfd write");
+        }
+    }
+}
+
+static void* io_thread(void* arg) {
+    while (true) {
+        pthread_mutex_lock(&lock);
+        while (queued == 0) {
+            pthread_cond_wait(&nonempty, &lock);
+        }
+        io_job_t* job = queue[head];
+        head = (head + 1) % depth;
+        queued--;
+        pthread_mutex_unlock(&lock);
+
+        atomic_fetch_add(&busy, 1);
+        load(job);
+        atomic_fetch_sub(&busy, 1);
+        atomic_fetch_add(&offloaded, 1);
+        metrics_count(M_IO_OFFLOADED, 1);
+        complete(job);
+    }
+    return NULL;
+}
+
+void iopool_init(int threads, int max_queued) {
+    nthreads = threads;
+    depth = max_queued > 0 ? max_queued : IOPOOL_DEFAULT_DEPTH;
+    if (threads == 0) {
+        return;
+    }
+    queue = calloc(depth, sizeof(*queue));
+    for (int i=0;i<threads;i++) {
+        pthread_t t;
+        pthread_create(&t, NULL, io_thread, NULL);
+        pthread_detach(t);
+    }
+}
+
+void iocq_init(io_completions_t* cq, bool blocking) {
+    pthread_mutex_init(&cq->lock, NULL);
+    pthread_cond_init(&cq->ready, NULL);
+    cq->done = NULL;
+    cq->efd = -1;
+    if (!blocking) {
+        check(cq->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), "eventfd failed");
+    }
+}
+
+io_job_t* iocq_take(io_completions_t* cq, bool wait) {
+    pthread_mutex_lock(&cq->lock);
+    while (wait && cq->done == NULL) {
+        pthread_cond_wait(&cq->ready, &cq->lock);
+    }
+    io_job_t* done = cq->done;
+    cq->done = NULL;
+    pthread_mutex_unlock(&cq->lock);
+
+    //they were pushed newest first.
+    io_job_t* oldest = NULL;
+    while (done != NULL) {
+        io_job_t* next = done->next;
+        done->next = oldest;
+        oldest = done;
+        done = next;
+    }
+    return oldest;
+}
+
+void iopool_get_stats(iopool_stats_t* stats) {
+    pthread_mutex_lock(&lock);
+    stats->queued = queued;
+    pthread_mutex_unlock(&lock);
+    stats->threads = nthreads;
+    stats->busy = atomic_load(&busy);
+    stats->offloaded = atomic_load(&offloaded);
+    stats->inline_ = atomic_load(&inlined);
+}
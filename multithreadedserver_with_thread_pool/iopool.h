@@ -0,0 +1,70 @@
+#ifndef IOPOOL_H_
+#define IOPOOL_H_
+
+#include<stdbool.h>
+#include<stdint.h>
+#include<pthread.h>
+#include "docroot.h"
+
+//blocking file I/O off the network threads. a cache miss costs an open(), an fstat() and, for small files, a read(), and on a cold
+//page cache any of them can stall for as long as the disk takes. instead of an event loop (and every connection on it) sitting that
+//out, the connection hands the miss to the I/O threads (-o threads:depth) and parks while the loop serves everyone else. the result
+//comes back on the loop's completion queue, whose eventfd wakes it up. a pool worker hands its miss off the same way and waits for
+//it. the pool grows around waiting workers as usual, and the disk never sees more than the I/O threads' worth of requests at once.
+//-D ms holds every miss up by that long, in whichever thread does the I/O: a slow disk to test against.
+#define IOPOOL_DEFAULT_THREADS 4
+#define IOPOOL_DEFAULT_DEPTH 256    //misses waiting for an I/O thread. when it's full, the network thread does the I/O itself
+
+struct cache_entry;
+
+//completed jobs for one network thread to pick up. an event loop's has an eventfd, readable while there are any. a pool worker's
+//has none: the worker waits on ready.
+typedef struct io_completions {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct io_job* done;        //newest first
+    int efd;                    //-1 for a blocking queue
+} io_completions_t;
+
+//a file to load into the cache (cache_get()), and the answer.
+typedef struct io_job {
+    docroot_file_t file;        //file.path is what to load. the rest is the docroot index's say on it, if indexed
+    bool indexed;
+    io_completions_t* cq;       //where the job goes once it's done
+    uint64_t queued;            //metrics_now() at submission, 0 if metrics are off
+    struct cache_entry* entry;  //referenced, or NULL if the file couldn't be opened
+    bool hit;                   //someone else loaded it in the meantime
+    struct io_job* next;
+} io_job_t;
+
+typedef struct iopool_stats {
+    long threads;
+    long queued;            //jobs waiting for a thread
+    long busy;              //threads doing I/O right now
+    long offloaded;         //jobs the threads did
+    long inline_;           //misses the network threads did themselves: no I/O threads, or the queue was full
+} iopool_stats_t;
+
+//-D: milliseconds added to every miss.
+extern int iopool_latency_ms;
+
+// starts the I/O threads. threads 0 leaves every miss to the thread that hits it.
+void iopool_init(int threads, int depth);
+
+// queues job for an I/O thread, which reports back on cq. returns false (and doesn't queue it) if there are no I/O threads or the
+// queue is full: the caller runs it with iopool_run() instead.
+bool iopool_submit(io_job_t* job, io_completions_t* cq);
+
+// does the job in the calling thread, -D included.
+void iopool_run(io_job_t* job);
+
+// a completion queue. blocking: iocq_take() may wait on it (pool workers). otherwise it gets an eventfd for an event loop to watch.
+void iocq_init(io_completions_t* cq, bool blocking);
+
+// the jobs completed since the last call, oldest first, linked through next. with wait (blocking queues only) it waits for one,
+// otherwise it returns NULL if there are none. non-blocking queues: read the eventfd empty first, then take.
+io_job_t* iocq_take(io_completions_t* cq, bool wait);
+
+void iopool_get_stats(iopool_stats_t* stats);
+
+#endif
@@ -0,0 +1,530 @@
+//load generator: the connect/write/read of ../sockets/tcpclient.c, run for many non-blocking connections at once from an epoll loop
+//per thread, with every request's latency recorded in an HDR histogram (hdrhist.c).
+//closed loop (default): -c connections each send a request, wait for the whole response and send the next one.
+//open loop (-r rps): requests fall due on a fixed schedule whether or not the server keeps up. latency is measured from when a request
+//was due, not from when a connection got around to sending it, so a server that stalls can't hide behind the queue it caused
+//(coordinated omission).
+//usage: ./loadgen [-h host] [-p port] [-c connections] [-t threads] [-d seconds] [-r rps] [-n] [-l] [-j name] path...
+//  -n  new connection for every request (Connection: close) instead of keep-alive
+//  -l  the legacy "path\n" protocol, like client.rb
+//  -j  JSON lines (see bench.h) instead of the report, with the results named after name
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<stdbool.h>
+#include<stdint.h>
+#include<pthread.h>
+#include<getopt.h>
+#include<time.h>
+#include<netdb.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<sys/epoll.h>
+#include<sys/resource.h>
+#include "server.h"
+#include "hdrhist.h"
+#include "bench.h"
+
+#define DEFAULT_CONNECTIONS 50
+#define DEFAULT_SECONDS 10
+#define MAX_PATHS 64
+#define LOADGEN_EVENTS 256
+#define BACKLOG_MAX (1 << 16)   //open loop: requests due but not sent yet. anything past this is counted as missed
+#define RETRY_NS 1000000        //a connection that failed waits at least this long before trying again
+
+typedef enum {
+    C_IDLE,         //no request in flight
+    C_CONNECTING,
+    C_SENDING,
+    C_READING,
+} client_state_t;
+
+typedef struct client {
+    int fd;                 //-1 when not connected
+    client_state_t state;
+    uint64_t start_ns;      //when the request in flight was issued (or, in open loop, fell due)
+    const char* req;
+    size_t req_len;
+    size_t req_off;
+    char head[BUFSIZE];     //response headers collected so far
+    size_t head_len;
+    bool in_body;
+    long long body_left;
+    bool until_close;       //no Content-Length: the body ends when the server closes the connection
+    bool close_after;
+    int status;
+    struct client* next;    //idle or retry list
+} client_t;
+
+typedef struct worker {
+    pthread_t thread;
+    int epfd;
+    int nclients;
+    client_t* clients;
+    client_t* idle;
+    client_t* retry;
+    int next_path;
+    //open loop schedule
+    uint64_t interval_ns;
+    uint64_t next_due;
+    uint64_t* backlog;
+    size_t backlog_head;
+    size_t backlog_tail;
+    char scratch[1 << 16];
+
+    hdr_hist_t* hist;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t non2xx;
+    uint64_t missed;
+    uint64_t bytes;
+} worker_t;
+
+static struct sockaddr_in server_addr;
+static char* requests[MAX_PATHS];
+static size_t request_lens[MAX_PATHS];
+static int npaths;
+static bool legacy;
+static bool new_connections;
+static bool open_loop;
+static uint64_t start_ns;
+static uint64_t deadline_ns;
+
+int check(int exp, const char* msg) {
+    if (exp == SOCKETERROR) {
+        perror(msg);
+        exit(1);
+    }
+    return exp;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void close_client(client_t* c) {
+    if (c->fd != -1) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static void push(client_t** list, client_t* c) {
+    c->next = *list;
+    *list = c;
+}
+
+static client_t* pop(client_t** list) {
+    client_t* c = *list;
+    if (c != NULL) {
+        *list = c->next;
+    }
+    return c;
+}
+
+//a request that didn't get a proper response. the connection is dropped and the client sits out a moment before its next request.
+static void fail(worker_t* w, client_t* c) {
+    if (now_ns() < deadline_ns) {
+        w->errors++;
+    }
+    close_client(c);
+    c->state = C_IDLE;
+    push(&w->retry, c);
+}
+
+static void complete(worker_t* w, client_t* c) {
+    uint64_t now = now_ns();
+    if (now < deadline_ns) {
+        hdr_record(w->hist, now - c->start_ns);
+        w->requests++;
+        if (c->status < 200 || c->status > 299) {
+            w->non2xx++;
+        }
+    }
+    if (c->close_after) {
+        close_client(c);
+    }
+    c->state = C_IDLE;
+    push(&w->idle, c);
+}
+
+static void issue(worker_t* w, client_t* c, uint64_t start) {
+    int path = w->next_path++ % npaths;
+    c->start_ns = start;
+    c->req = requests[path];
+    c->req_len = request_lens[path];
+    c->req_off = 0;
+    c->head_len = 0;
+    c->in_body = legacy;
+    c->body_left = 0;
+    c->until_close = legacy;
+    c->close_after = legacy || new_connections;
+    c->status = legacy ? 200 : 0;
+
+    if (c->fd != -1) {
+        c->state = C_SENDING;
+        return;
+    }
+    check(c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), "socket failed");
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    //edge-triggered for both directions, same as the server's reactors.
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+    check(epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev), "epoll_ctl failed");
+    if (connect(c->fd, (SA*)&server_addr, sizeof(server_addr)) == 0) {
+        c->state = C_SENDING;
+    } else if (errno == EINPROGRESS) {
+        c->state = C_CONNECTING;
+    } else {
+        fail(w, c);
+    }
+}
+
+//finds the end of the response headers and works out how long the body is.
+static void parse_head(client_t* c, size_t head_end) {
+    c->in_body = true;
+    c->status = 0;
+    c->body_left = -1;
+    sscanf(c->head, "HTTP/1.%*d %d", &c->status);
+    for (char* line = strstr(c->head, "\r\n"); line != NULL && line < c->head + head_end; line = strstr(line + 2, "\r\n")) {
+        char* h = line + 2;
+        if (strncasecmp(h, "Content-Length:", 15) == 0) {
+            c->body_left = atoll(h + 15);
+        } else if (strncasecmp(h, "Connection:", 11) == 0 && strncasecmp(h + 11 + strspn(h + 11, " "), "close", 5) == 0) {
+            c->close_after = true;
+        }
+    }
+    if (c->body_left == -1) {
+        c->until_close = true;
+        c->close_after = true;
+    } else {
+        c->body_left -= c->head_len - head_end;
+    }
+}
+
+//drives c as far as its socket allows. events are the epoll events that woke it, 0 if it wasn't woken by epoll.
+static void advance(worker_t* w, client_t* c, uint32_t events) {
+    while (true) {
+        switch (c->state) {
+            case C_IDLE:
+                return;
+            case C_CONNECTING: {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                    return;
+                }
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    fail(w, c);
+                    return;
+                }
+                c->state = C_SENDING;
+                break;
+            }
+            case C_SENDING: {
+                ssize_t n = send(c->fd, c->req + c->req_off, c->req_len - c->req_off, MSG_NOSIGNAL);
+                if (n > 0) {
+                    c->req_off += n;
+                    if (c->req_off == c->req_len) {
+                        c->state = C_READING;
+                    }
+                } else if (n == SOCKETERROR && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return;
+                } else if (!(n == SOCKETERROR && errno == EINTR)) {
+                    fail(w, c);
+                    return;
+                }
+                break;
+            }
+            case C_READING: {
+                ssize_t n;
+                if (c->in_body) {
+                    n = read(c->fd, w->scratch, sizeof(w->scratch));
+                } else {
+                    n = read(c->fd, c->head + c->head_len, sizeof(c->head) - 1 - c->head_len);
+                }
+                if (n == 0) {
+                    //the end of a close-delimited body is the one EOF that isn't an error.
+                    if (c->in_body && c->until_close) {
+                        complete(w, c);
+                    } else {
+                        fail(w, c);
+                    }
+                    return;
+                }
+                if (n == SOCKETERROR) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return;
+                    }
+                    if (errno != EINTR) {
+                        fail(w, c);
+                        return;
+                    }
+                    break;
+                }
+                w->bytes += n;
+                if (c->in_body) {
+                    c->body_left -= n;
+                } else {
+                    c->head_len += n;
+                    c->head[c->head_len] = 0;
+                    char* end = strstr(c->head, "\r\n\r\n");
+                    if (end != NULL) {
+                        parse_head(c, end + 4 - c->head);
+                    } else if (c->head_len == sizeof(c->head) - 1) {
+                        fail(w, c);
+                        return;
+                    }
+                }
+                if (c->in_body && !c->until_close && c->body_left <= 0) {
+                    complete(w, c);
+                    return;
+                }
+                break;
+            }
+        }
+    }
+}
+
+//open loop: every request that has fallen due since last time joins the backlog.
+static void schedule(worker_t* w, uint64_t now) {
+    while (w->next_due <= now && w->next_due < deadline_ns) {
+        if (w->backlog_tail - w->backlog_head < BACKLOG_MAX) {
+            w->backlog[w->backlog_tail++ % BACKLOG_MAX] = w->next_due;
+        } else {
+            w->missed++;
+        }
+        w->next_due += w->interval_ns;
+    }
+}
+
+//hands requests to idle clients: all of them in closed loop, as many as have fallen due in open loop.
+static void dispatch(worker_t* w, uint64_t now) {
+    client_t* ready = w->idle;
+    w->idle = NULL;
+    client_t* c;
+    while ((c = pop(&ready)) != NULL) {
+        if (open_loop && w->backlog_head == w->backlog_tail) {
+            push(&w->idle, c);
+            continue;
+        }
+        issue(w, c, open_loop ? w->backlog[w->backlog_head++ % BACKLOG_MAX] : now);
+        advance(w, c, 0);
+    }
+}
+
+static void* worker_main(void* arg) {
+    worker_t* w = arg;
+    struct epoll_event events[LOADGEN_EVENTS];
+
+    check(w->epfd = epoll_create1(EPOLL_CLOEXEC), "epoll_create failed");
+    for (int i=0;i<w->nclients;i++) {
+        w->clients[i].fd = -1;
+        w->clients[i].state = C_IDLE;
+        push(&w->idle, &w->clients[i]);
+    }
+    w->next_due = start_ns;
+
+    while (true) {
+        uint64_t now = now_ns();
+        if (now >= deadline_ns) {
+            break;
+        }
+        if (open_loop) {
+            schedule(w, now);
+        }
+        if (now < deadline_ns) {
+            dispatch(w, now);
+        }
+
+        //sleep until the next request falls due, a failed client may retry, or the run is over.
+        uint64_t wake = deadline_ns;
+        if (open_loop && w->next_due < wake) {
+            wake = w->next_due;
+        }
+        if (!open_loop && w->idle != NULL) {
+            wake = now;
+        }
+        if (w->retry != NULL && now + RETRY_NS < wake) {
+            wake = now + RETRY_NS;
+        }
+        uint64_t wait = wake > now ? wake - now : 0;
+        struct timespec timeout = { .tv_sec = wait / 1000000000ULL, .tv_nsec = wait % 1000000000ULL };
+        int n = epoll_pwait2(w->epfd, events, LOADGEN_EVENTS, &timeout, NULL);
+        if (n == SOCKETERROR) {
+            if (errno == EINTR) {
+                continue;
+            }
+            check(n, "epoll_wait failed");
+        }
+        //clients that failed before this wait get to try again after it.
+        client_t* c;
+        while ((c = pop(&w->retry)) != NULL) {
+            push(&w->idle, c);
+        }
+        for (int i=0;i<n;i++) {
+            c = events[i].data.ptr;
+            advance(w, c, events[i].events);
+        }
+    }
+
+    for (int i=0;i<w->nclients;i++) {
+        close_client(&w->clients[i]);
+    }
+    close(w->epfd);
+    return NULL;
+}
+
+static void format_ns(uint64_t ns, char* buf, size_t size) {
+    if (ns < 10000) {
+        snprintf(buf, size, "%lluns", (unsigned long long)ns);
+    } else if (ns < 10000000) {
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    } else if (ns < 10000000000ULL) {
+        snprintf(buf, size, "%.2fms", ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+    }
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-t threads] [-d seconds] [-r rps] [-n] [-l] [-j name] path...\n", prog);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    const char* host = "127.0.0.1";
+    int port = SERVERPORT;
+    int connections = DEFAULT_CONNECTIONS;
+    int threads = 1;
+    double seconds = DEFAULT_SECONDS;
+    double rps = 0;
+    const char* json = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:t:d:r:nlj:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': connections = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 'd': seconds = atof(optarg); break;
+            case 'r': rps = atof(optarg); break;
+            case 'n': new_connections = true; break;
+            case 'l': legacy = true; break;
+            case 'j': json = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    npaths = argc - optind;
+    if (npaths <= 0 || npaths > MAX_PATHS || port <= 0 || connections <= 0 || threads <= 0 || seconds <= 0 || rps < 0) {
+        usage(argv[0]);
+    }
+    if (threads > connections) {
+        threads = connections;
+    }
+    open_loop = rps > 0;
+
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* res;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+        fprintf(stderr, "can't resolve %s\n", host);
+        exit(1);
+    }
+    server_addr = *(struct sockaddr_in*)res->ai_addr;
+    server_addr.sin_port = htons(port);
+    freeaddrinfo(res);
+
+    //the requests are built once up front. each connection cycles through the paths.
+    for (int i=0;i<npaths;i++) {
+        const char* path = argv[optind + i];
+        size_t size = strlen(path) + strlen(host) + 64;
+        requests[i] = malloc(size);
+        if (legacy) {
+            request_lens[i] = snprintf(requests[i], size, "%s\n", path);
+        } else {
+            request_lens[i] = snprintf(requests[i], size, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                                       path, host, new_connections ? "Connection: close\r\n" : "");
+        }
+    }
+
+    //every connection is a file descriptor, and a few hundred of them is the usual soft limit.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    worker_t* workers = calloc(threads, sizeof(worker_t));
+    start_ns = now_ns();
+    deadline_ns = start_ns + (uint64_t)(seconds * 1e9);
+    for (int i=0;i<threads;i++) {
+        worker_t* w = &workers[i];
+        w->nclients = connections / threads + (i < connections % threads);
+        w->clients = calloc(w->nclients, sizeof(client_t));
+        w->hist = hdr_create();
+        w->next_path = i;
+        if (open_loop) {
+            //each thread takes an even share of the rate, offset so they don't all fire at the same instant.
+            w->interval_ns = (uint64_t)(1e9 * threads / rps);
+            w->next_due = start_ns + w->interval_ns * i / threads;
+            w->backlog = malloc(BACKLOG_MAX * sizeof(uint64_t));
+        }
+        pthread_create(&w->thread, NULL, worker_main, w);
+    }
+
+    hdr_hist_t* hist = hdr_create();
+    uint64_t total = 0, errors = 0, non2xx = 0, missed = 0, bytes = 0;
+    for (int i=0;i<threads;i++) {
+        worker_t* w = &workers[i];
+        pthread_join(w->thread, NULL);
+        hdr_merge(hist, w->hist);
+        total += w->requests;
+        errors += w->errors;
+        non2xx += w->non2xx;
+        missed += w->missed;
+        bytes += w->bytes;
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+
+    if (json != NULL) {
+        //only good responses count: a server that fails fast mustn't look like an improvement.
+        char name[128];
+        snprintf(name, sizeof(name), "%s throughput", json);
+        bench_json("e2e", name, (total - non2xx) / elapsed, "req/s", false);
+        snprintf(name, sizeof(name), "%s p50", json);
+        bench_json("e2e", name, hdr_percentile(hist, 50) / 1e6, "ms", true);
+        snprintf(name, sizeof(name), "%s p99", json);
+        bench_json("e2e", name, hdr_percentile(hist, 99) / 1e6, "ms", true);
+        //and none at all is a failure, not a number to compare.
+        return total == non2xx;
+    }
+
+    printf("%s loop, %d connections, %d threads, %.1fs, %s", open_loop ? "open" : "closed", connections, threads, elapsed,
+           legacy ? "legacy protocol" : new_connections ? "new connection per request" : "keep-alive");
+    if (open_loop) {
+        printf(", target %.0f req/s", rps);
+    }
+    printf("\n  requests  %llu (%.1f/s)  errors %llu  non-2xx %llu  missed %llu\n",
+           (unsigned long long)total, total / elapsed, (unsigned long long)errors, (unsigned long long)non2xx, (unsigned long long)missed);
+    printf("  transfer  %.1f MB (%.1f MB/s)\n", bytes / 1e6, bytes / 1e6 / elapsed);
+
+    const double percentiles[] = { 50, 90, 99, 99.9 };
+    const char* names[] = { "p50", "p90", "p99", "p999" };
+    char buf[32];
+    format_ns((uint64_t)hdr_mean(hist), buf, sizeof(buf));
+    printf("  latency   mean %s", buf);
+    for (int i=0;i<4;i++) {
+        format_ns(hdr_percentile(hist, percentiles[i]), buf, sizeof(buf));
+        printf("  %s %s", names[i], buf);
+    }
+    format_ns(hist->max, buf, sizeof(buf));
+    printf("  max %s\n", buf);
+    return 0;
+}
@@ -0,0 +1,189 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdarg.h>
+#include<stdatomic.h>
+#include<stdbool.h>
+#include<unistd.h>
+#include<errno.h>
+#include<limits.h>
+#include<pthread.h>
+#include<sys/uio.h>
+#include "log.h"
+
+#define CACHE_LINE 64
+
+typedef struct log_line {
+    unsigned short len;
+    char text[LOG_LINE_MAX];
+} log_line_t;
+
+//single producer (the owning thread), single consumer (whoever holds flush_lock). rings are never freed: when a thread exits its
+//ring goes back up for grabs and the next new thread writes on after whatever the flusher hasn't got to yet, the same way
+//metrics.c hands on counter blocks. so workers retiring and respawning don't grow the list.
+typedef struct log_ring {
+    _Alignas(CACHE_LINE) atomic_size_t head;    //next line to write out
+    _Alignas(CACHE_LINE) atomic_size_t tail;    //next free slot
+    atomic_bool owned;                          //a live thread is writing into it
+    struct log_ring* next;
+    log_line_t lines[LOG_RING_SIZE];
+} log_ring_t;
+
+static _Atomic(log_ring_t*) rings;
+static __thread log_ring_t* my_ring;
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static atomic_ullong dropped;
+static unsigned long long dropped_reported;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_fd = STDOUT_FILENO;
+
+static const char* level_prefix[] = { "DEBUG: ", "", "WARN: ", "ERROR: " };
+
+//runs as the thread exits. the release pairs with the acquire in get_ring(), so the next owner sees our last tail.
+static void release_ring(void* arg) {
+    log_ring_t* ring = arg;
+    my_ring = NULL;
+    atomic_store_explicit(&ring->owned, false, memory_order_release);
+}
+
+static void make_key() {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+static log_ring_t* get_ring() {
+    if (my_ring == NULL) {
+        pthread_once(&key_once, make_key);
+        for (log_ring_t* r = atomic_load(&rings); r != NULL; r = r->next) {
+            bool owned = false;
+            if (!atomic_load_explicit(&r->owned, memory_order_relaxed)
+                && atomic_compare_exchange_strong_explicit(&r->owned, &owned, true, memory_order_acquire, memory_order_relaxed)) {
+                my_ring = r;
+                break;
+            }
+        }
+        if (my_ring == NULL) {
+            my_ring = aligned_alloc(CACHE_LINE, sizeof(log_ring_t));
+            atomic_init(&my_ring->head, 0);
+            atomic_init(&my_ring->tail, 0);
+            atomic_init(&my_ring->owned, true);
+            //push onto the list of rings. only ever grows, so a plain CAS loop is enough.
+            my_ring->next = atomic_load(&rings);
+            while (!atomic_compare_exchange_weak(&rings, &my_ring->next, my_ring)) {
+            }
+        }
+        pthread_setspecific(ring_key, my_ring);
+    }
+    return my_ring;
+}
+
+void log_write(int level, const char* fmt, ...) {
+    log_ring_t* ring = get_ring();
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    log_line_t* line = &ring->lines[tail & (LOG_RING_SIZE - 1)];
+    va_list ap;
+    int len = snprintf(line->text, LOG_LINE_MAX, "%s", level_prefix[level]);
+    va_start(ap, fmt);
+    len += vsnprintf(line->text + len, LOG_LINE_MAX - len, fmt, ap);
+    va_end(ap);
+    if (len >= LOG_LINE_MAX) {
+        len = LOG_LINE_MAX - 1;
+    }
+    //every line ends in exactly one newline, whether or not the caller put one there.
+    if (len == 0 || line->text[len-1] != '\n') {
+        if (len == LOG_LINE_MAX - 1) {
+            len--;
+        }
+        line->text[len++] = '\n';
+    }
+    line->len = len;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+//writev() may write less than asked for (pipes, signals). go again with whatever is left.
+static void write_all(struct iovec* iov, int n) {
+    while (n > 0) {
+        ssize_t done = writev(log_fd, iov, n);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        while (n > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+}
+
+//drains every ring once. returns how many lines went out.
+static size_t flush_rings() {
+    struct iovec iov[IOV_MAX];
+    size_t total = 0;
+
+    pthread_mutex_lock(&flush_lock);
+    for (log_ring_t* ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        while (head != tail) {
+            int n = 0;
+            size_t end = head;
+            while (end != tail && n < IOV_MAX) {
+                log_line_t* line = &ring->lines[end & (LOG_RING_SIZE - 1)];
+                iov[n++] = (struct iovec){ line->text, line->len };
+                end++;
+            }
+            write_all(iov, n);
+            total += n;
+            //only now can the producer reuse those slots.
+            head = end;
+            atomic_store_explicit(&ring->head, head, memory_order_release);
+        }
+    }
+    unsigned long long d = atomic_load_explicit(&dropped, memory_order_relaxed);
+    if (d != dropped_reported) {
+        char msg[64];
+        int len = snprintf(msg, sizeof(msg), "WARN: log buffers full, %llu lines dropped\n", d - dropped_reported);
+        dropped_reported = d;
+        struct iovec one = { msg, len };
+        write_all(&one, 1);
+    }
+    pthread_mutex_unlock(&flush_lock);
+    return total;
+}
+
+static void* flusher_thread(void* arg) {
+    while (true) {
+        if (flush_rings() == 0) {
+            usleep(LOG_FLUSH_MS * 1000);
+        }
+    }
+    return NULL;
+}
+
+void log_init(int fd) {
+    pthread_t t;
+    log_fd = fd;
+    pthread_create(&t, NULL, flusher_thread, NULL);
+    atexit(log_flush);
+}
+
+void log_flush() {
+    flush_rings();
+}
+
+uint64_t log_dropped() {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
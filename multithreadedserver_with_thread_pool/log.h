@@ -0,0 +1,50 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+#include<stdint.h>
+
+//asynchronous logging. every thread formats its lines into its own ring buffer (no lock, no syscall), and a background thread
+//collects them from all rings and writes them out in batches with writev(). when a ring is full the line is dropped and counted
+//rather than making the caller wait. lines from one thread stay in order; lines from different threads may interleave differently
+//than they happened.
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+
+//levels below this are compiled out entirely, arguments and all. e.g. make CFLAGS="-g -pthread -DLOG_MIN_LEVEL=LOG_WARN"
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_INFO
+#endif
+
+#define LOG_LINE_MAX 256        //longer lines are truncated
+#define LOG_RING_SIZE 1024      //lines per thread, must be a power of two
+#define LOG_FLUSH_MS 10         //how long the flusher sleeps when every ring is empty
+
+// starts the flusher thread writing to fd. lines logged before this are buffered until it runs.
+void log_init(int fd);
+// writes out everything buffered so far. called at exit, too.
+void log_flush();
+// how many lines were thrown away because a ring was full.
+uint64_t log_dropped();
+
+void log_write(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#if LOG_MIN_LEVEL <= LOG_DEBUG
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) ((void)0)
+#endif
+#if LOG_MIN_LEVEL <= LOG_INFO
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+#else
+#define log_info(...) ((void)0)
+#endif
+#if LOG_MIN_LEVEL <= LOG_WARN
+#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
+#else
+#define log_warn(...) ((void)0)
+#endif
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+
+#endif
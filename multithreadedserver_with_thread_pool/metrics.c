@@ -0,0 +1,236 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<time.h>
+#include<pthread.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include "server.h"
+#include "metrics.h"
+#include "log.h"
+#include "reload.h"
+
+bool metrics_enabled;
+__thread metrics_block_t* metrics_self;
+
+static metrics_block_t* _Atomic blocks;
+static pthread_key_t block_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static void (*write_gauges)(FILE* out);
+static int metrics_socket = -1;
+
+static const struct {
+    const char* name;
+    const char* labels;
+    const char* help;
+} counter_info[M_COUNTERS] = {
+    [M_ACCEPTED] = { "webserver_connections_accepted_total", "", "Connections accepted." },
+    [M_CLOSED] = { "webserver_connections_closed_total", "", "Connections closed." },
+    [M_REQUESTS] = { "webserver_requests_total", "", "Requests parsed." },
+    [M_RESPONSES_2XX] = { "webserver_responses_total", "{class=\"2xx\"}", "Responses started, by status class." },
+    [M_RESPONSES_3XX] = { "webserver_responses_total", "{class=\"3xx\"}", NULL },
+    [M_RESPONSES_4XX] = { "webserver_responses_total", "{class=\"4xx\"}", NULL },
+    [M_RESPONSES_5XX] = { "webserver_responses_total", "{class=\"5xx\"}", NULL },
+    [M_SENT_BYTES] = { "webserver_sent_bytes_total", "", "Response bytes (headers and bodies) handed to the kernel." },
+    [M_TIMEOUTS_REQUEST] = { "webserver_connection_timeouts_total", "{wait=\"request\"}", "Connections closed because the client took too long, by what it was doing." },
+    [M_TIMEOUTS_IDLE] = { "webserver_connection_timeouts_total", "{wait=\"idle\"}", NULL },
+    [M_TIMEOUTS_SEND] = { "webserver_connection_timeouts_total", "{wait=\"send\"}", NULL },
+    [M_ENCODED_GZIP] = { "webserver_encoded_responses_total", "{coding=\"gzip\"}", "Responses sent compressed, by Content-Encoding." },
+    [M_ENCODED_ZSTD] = { "webserver_encoded_responses_total", "{coding=\"zstd\"}", NULL },
+    [M_TLS_FULL] = { "webserver_tls_handshakes_total", "{kind=\"full\"}", "TLS handshakes completed, full or resumed." },
+    [M_TLS_RESUMED] = { "webserver_tls_handshakes_total", "{kind=\"resumed\"}", NULL },
+    [M_TLS_KTLS] = { "webserver_tls_ktls_connections_total", "", "TLS connections whose sends the kernel encrypts." },
+    [M_IO_OFFLOADED] = { "webserver_file_loads_total", "{where=\"io_thread\"}", "Cache misses loaded by the I/O threads, or by the network thread itself (-o 0, or a full queue)." },
+    [M_IO_INLINE] = { "webserver_file_loads_total", "{where=\"inline\"}", NULL },
+    [M_RATE_LIMITED] = { "webserver_rate_limited_requests_total", "", "Requests answered with 429 because the client was over its request rate (-R)." },
+};
+
+static const struct {
+    const char* name;
+    const char* help;
+} hist_info[H_COUNT] = {
+    [H_QUEUE_WAIT] = { "webserver_queue_wait_seconds", "Pool mode: time from accept until a worker picks the connection up." },
+    [H_REALPATH] = { "webserver_realpath_seconds", "Time spent resolving request paths (realpath, or the docroot index with -d)." },
+    [H_OPEN] = { "webserver_open_seconds", "Time spent opening (and for small files, reading) files on a cache miss." },
+    [H_OFFLOAD] = { "webserver_offload_seconds", "Time from a cache miss being handed to the I/O threads until its network thread picks the file up." },
+    [H_SEND] = { "webserver_send_seconds", "Time from a response being ready until its last byte was handed to the kernel." },
+    [H_REQUEST] = { "webserver_request_seconds", "Time from a request being parsed until its last byte was handed to the kernel." },
+};
+
+//the block outlives its thread: its counts stay in the totals, and the next new thread carries on counting in it.
+static void release_block(void* arg) {
+    metrics_block_t* block = arg;
+    __atomic_store_n(&block->owned, false, __ATOMIC_RELEASE);
+}
+
+static void make_key() {
+    pthread_key_create(&block_key, release_block);
+}
+
+metrics_block_t* metrics_register() {
+    pthread_once(&key_once, make_key);
+    for (metrics_block_t* b = blocks; b != NULL; b = b->next) {
+        bool owned = false;
+        if (!__atomic_load_n(&b->owned, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&b->owned, &owned, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            metrics_self = b;
+            break;
+        }
+    }
+    if (metrics_self == NULL) {
+        metrics_self = aligned_alloc(64, (sizeof(metrics_block_t) + 63) & ~(size_t)63);
+        memset(metrics_self, 0, sizeof(metrics_block_t));
+        metrics_self->owned = true;
+        //push onto the list of blocks. only ever grows, so a plain CAS loop is enough.
+        metrics_self->next = blocks;
+        while (!__atomic_compare_exchange_n(&blocks, &metrics_self->next, metrics_self, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(block_key, metrics_self);
+    return metrics_self;
+}
+
+uint64_t metrics_now() {
+    if (!metrics_enabled) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_observe_ns(metric_hist_t h, uint64_t ns) {
+    metrics_hist_t* hist = &metrics_block()->hists[h];
+    //bucket i holds durations up to 2^i microseconds.
+    uint64_t us = (ns + 999) / 1000;
+    int i = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (i > METRICS_BUCKETS) {
+        i = METRICS_BUCKETS;
+    }
+    __atomic_store_n(&hist->buckets[i], __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->sum_ns, __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED) + ns, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(metric_hist_t h, uint64_t start) {
+    if (start != 0) {
+        metrics_observe_ns(h, metrics_now() - start);
+    }
+}
+
+void metrics_write(FILE* out) {
+    uint64_t counters[M_COUNTERS] = { 0 };
+    static metrics_hist_t hists[H_COUNT];   //only the metrics thread scrapes
+
+    memset(hists, 0, sizeof(hists));
+    for (metrics_block_t* b = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+        for (int c=0;c<M_COUNTERS;c++) {
+            counters[c] += __atomic_load_n(&b->counters[c], __ATOMIC_RELAXED);
+        }
+        for (int h=0;h<H_COUNT;h++) {
+            for (int i=0;i<=METRICS_BUCKETS;i++) {
+                hists[h].buckets[i] += __atomic_load_n(&b->hists[h].buckets[i], __ATOMIC_RELAXED);
+            }
+            hists[h].sum_ns += __atomic_load_n(&b->hists[h].sum_ns, __ATOMIC_RELAXED);
+        }
+    }
+
+    for (int c=0;c<M_COUNTERS;c++) {
+        if (counter_info[c].help != NULL) {
+            fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", counter_info[c].name, counter_info[c].help, counter_info[c].name);
+        }
+        fprintf(out, "%s%s %llu\n", counter_info[c].name, counter_info[c].labels, (unsigned long long)counters[c]);
+    }
+    for (int h=0;h<H_COUNT;h++) {
+        const char* name = hist_info[h].name;
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, hist_info[h].help, name);
+        //the buckets were read one by one while other threads kept counting, so derive the count from them rather than reading it:
+        //that keeps +Inf and _count equal, as Prometheus expects.
+        uint64_t seen = 0;
+        for (int i=0;i<METRICS_BUCKETS;i++) {
+            seen += hists[h].buckets[i];
+            fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name, (double)(1ULL << i) / 1e6, (unsigned long long)seen);
+        }
+        seen += hists[h].buckets[METRICS_BUCKETS];
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)seen);
+        fprintf(out, "%s_sum %.9f\n%s_count %llu\n", name, hists[h].sum_ns / 1e9, name, (unsigned long long)seen);
+    }
+    if (write_gauges != NULL) {
+        write_gauges(out);
+    }
+}
+
+//one scrape per connection, answered whatever was asked. scrapes are rare, so one blocking thread is plenty.
+static void* metrics_thread(void* arg) {
+    char request[BUFSIZE];
+    while (true) {
+        int client_socket = accept(metrics_socket, NULL, NULL);
+        if (client_socket == SOCKETERROR) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                log_warn("metrics accept failed: %s", strerror(errno));
+                usleep(100000);
+            }
+            continue;
+        }
+        //don't let a client that never sends anything hold up the next scrape.
+        struct timeval tv = { .tv_sec = 1 };
+        setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        recv(client_socket, request, sizeof(request), 0);
+
+        char* body;
+        size_t body_len;
+        FILE* out = open_memstream(&body, &body_len);
+        metrics_write(out);
+        fclose(out);
+
+        char head[256];
+        int head_len = snprintf(head, sizeof(head),
+            "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+        send(client_socket, head, head_len, MSG_NOSIGNAL | MSG_MORE);
+        for (size_t off = 0; off < body_len;) {
+            ssize_t sent = send(client_socket, body + off, body_len - off, MSG_NOSIGNAL);
+            if (sent <= 0) {
+                break;
+            }
+            off += sent;
+        }
+        free(body);
+        close(client_socket);
+    }
+    return NULL;
+}
+
+int metrics_listener() {
+    return metrics_socket;
+}
+
+void metrics_serve(const char* where, void (*gauges)(FILE* out)) {
+    if ((metrics_socket = reload_metrics_socket()) != -1) {
+        //already bound and listening: the process we took over from set it up.
+    } else if (where[0] == '/') {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(where) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "metrics socket path too long: %s\n", where);
+            exit(1);
+        }
+        strcpy(addr.sun_path, where);
+        unlink(where);
+        check(metrics_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), "Failed to create metrics socket");
+        check(bind(metrics_socket, (SA*)&addr, sizeof(addr)), "Metrics bind failed!");
+    } else {
+        //loopback only: the numbers are for whoever runs the box, not for the world.
+        SA_IN addr = { .sin_family = AF_INET, .sin_port = htons(atoi(where)), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        int reuse = 1;
+        check(metrics_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0), "Failed to create metrics socket");
+        check(setsockopt(metrics_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)), "setsockopt failed");
+        check(bind(metrics_socket, (SA*)&addr, sizeof(addr)), "Metrics bind failed!");
+    }
+    check(listen(metrics_socket, SERVER_BACKLOG), "Metrics listen failed!");
+
+    write_gauges = gauges;
+    metrics_enabled = true;
+    pthread_t t;
+    pthread_create(&t, NULL, metrics_thread, NULL);
+    log_info("Metrics on %s", where);
+}
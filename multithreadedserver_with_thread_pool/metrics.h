@@ -0,0 +1,93 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include<stdio.h>
+#include<stdint.h>
+#include<stdbool.h>
+
+//counters and latency histograms for the hot path, served in Prometheus text format on a port of their own (-M).
+//every thread counts into its own block with plain (relaxed) stores: no lock, no shared cache line, no atomic read-modify-write.
+//a scrape walks all the blocks and adds them up. the timings only cost a vDSO clock read each, and only when -M is given.
+#define METRICS_BUCKETS 24      //histogram buckets, powers of two from 1us to ~8.4s, plus +Inf
+
+typedef enum {
+    M_ACCEPTED,
+    M_CLOSED,
+    M_REQUESTS,
+    M_RESPONSES_2XX,
+    M_RESPONSES_3XX,
+    M_RESPONSES_4XX,
+    M_RESPONSES_5XX,
+    M_SENT_BYTES,
+    M_TIMEOUTS_REQUEST,
+    M_TIMEOUTS_IDLE,
+    M_TIMEOUTS_SEND,
+    M_ENCODED_GZIP,
+    M_ENCODED_ZSTD,
+    M_TLS_FULL,
+    M_TLS_RESUMED,
+    M_TLS_KTLS,
+    M_IO_OFFLOADED,
+    M_IO_INLINE,
+    M_RATE_LIMITED,
+    M_COUNTERS,
+} metric_counter_t;
+
+typedef enum {
+    H_QUEUE_WAIT,   //pool mode: accepted -> a worker picks the connection up
+    H_REALPATH,
+    H_OPEN,         //cache misses only: open + fstat (+ read, for files that get cached)
+    H_OFFLOAD,      //a miss handed to the I/O threads -> its network thread picks the result up
+    H_SEND,         //response ready -> last byte handed to the kernel
+    H_REQUEST,      //request parsed -> last byte handed to the kernel
+    H_COUNT,
+} metric_hist_t;
+
+typedef struct metrics_hist {
+    uint64_t buckets[METRICS_BUCKETS+1];
+    uint64_t sum_ns;
+} metrics_hist_t;
+
+typedef struct metrics_block {
+    uint64_t counters[M_COUNTERS];
+    metrics_hist_t hists[H_COUNT];
+    bool owned;                     //a live thread writes here. blocks of exited threads are handed to the next new thread
+    struct metrics_block* next;
+} metrics_block_t;
+
+extern bool metrics_enabled;
+extern __thread metrics_block_t* metrics_self;
+
+// the calling thread's block, created (or inherited from an exited thread) on first use.
+metrics_block_t* metrics_register();
+
+// starts serving the metrics on 127.0.0.1:port, or on a unix socket if where starts with '/'.
+// gauges (if not NULL) is called on every scrape to append whatever is read rather than counted, e.g. queue depths.
+// after a reload the socket is the one the old process listened on, wherever that was.
+void metrics_serve(const char* where, void (*gauges)(FILE* out));
+
+// the socket metrics_serve() listens on, or -1 without -M.
+int metrics_listener();
+
+// writes every metric to out in Prometheus text format.
+void metrics_write(FILE* out);
+
+static inline metrics_block_t* metrics_block() {
+    return metrics_self != NULL ? metrics_self : metrics_register();
+}
+
+static inline void metrics_count(metric_counter_t c, uint64_t n) {
+    uint64_t* v = &metrics_block()->counters[c];
+    __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// a timestamp to hand to metrics_observe() later, or 0 when nobody is collecting.
+uint64_t metrics_now();
+
+// records now - start in histogram h. does nothing if start is 0.
+void metrics_observe(metric_hist_t h, uint64_t start);
+
+// records a duration measured elsewhere.
+void metrics_observe_ns(metric_hist_t h, uint64_t ns);
+
+#endif
@@ -1,33 +1,139 @@
 #include "myqueue.h"
-#include <stdlib.h>
-#include<stdio.h>
-
-node_t* head = NULL;
-node_t* tail = NULL;
-
-void enqueue(int* client_socket) {
-    node_t* newnode = malloc(sizeof(node_t));
-    newnode->client_socket = client_socket;
-    newnode->next = NULL;
-    if (tail == NULL) {
-        head = newnode;
-    } else {
-        tail->next = newnode;
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<time.h>
+#include<linux/futex.h>
+#include<sys/syscall.h>
+
+static queue_t queue;
+
+queue_t* queue_create() {
+    queue_t* q = aligned_alloc(CACHE_LINE, sizeof(queue_t));
+    memset(q, 0, sizeof(queue_t));
+    return q;
+}
+
+//a cell's sequence has to start out equal to its index. storing it relative to the index means a zeroed (static) queue is already
+//initialized and nobody has to remember to call an init function before the first accept.
+static size_t load_sequence(queue_t* q, cell_t* cell) {
+    return atomic_load_explicit(&cell->sequence, memory_order_acquire) + (size_t)(cell - q->cells);
+}
+
+static void store_sequence(queue_t* q, cell_t* cell, size_t seq) {
+    atomic_store_explicit(&cell->sequence, seq - (size_t)(cell - q->cells), memory_order_release);
+}
+
+static void futex_wait(atomic_uint* addr, unsigned int expected, const struct timespec* timeout) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static void futex_wake(atomic_uint* addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+bool queue_push(queue_t* q, int client_socket) {
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    cell_t* cell;
+
+    while (true) {
+        cell = &q->cells[pos & (QUEUE_CAPACITY - 1)];
+        size_t seq = load_sequence(q, cell);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            //the cell is free for this lap. claim it.
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            //the consumer of the previous lap hasn't emptied it yet: we're full.
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->client_socket = client_socket;
+    store_sequence(q, cell, pos + 1);
+
+    //the fence in queue_wake() pairs with the one in queue_pop_wait_timeout(): either we see the sleeper, or the sleeper sees our item.
+    queue_wake(q);
+    return true;
+}
+
+int queue_pop(queue_t* q) {
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    cell_t* cell;
+
+    while (true) {
+        cell = &q->cells[pos & (QUEUE_CAPACITY - 1)];
+        size_t seq = load_sequence(q, cell);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            //nothing has been published in this cell yet: we're empty.
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
     }
-    tail = newnode;
-}
-
-int* dequeue() {
-    if (head == NULL) {
-        return NULL;
-    } else {
-        int* result = head->client_socket;
-        node_t* temp = head;    
-        head = head->next;
-        if (head == NULL) {
-            tail = NULL;
+    int result = cell->client_socket;
+    //hand the cell back to producers for the next lap.
+    store_sequence(q, cell, pos + QUEUE_CAPACITY);
+    return result;
+}
+
+int queue_pop_wait_timeout(queue_t* q, int timeout_ms) {
+    int client_socket;
+    struct timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L };
+
+    if ((client_socket = queue_pop(q)) == -1) {
+        unsigned int seq = atomic_load_explicit(&q->wake_seq, memory_order_acquire);
+        atomic_fetch_add_explicit(&q->sleepers, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        //check again now that producers can see us. if something slipped in, don't sleep.
+        if ((client_socket = queue_pop(q)) == -1) {
+            //returns straight away if a producer bumped wake_seq since we read it.
+            futex_wait(&q->wake_seq, seq, timeout_ms < 0 ? NULL : &ts);
+            client_socket = queue_pop(q);
         }
-        free(temp);
-        return result;
+        atomic_fetch_sub_explicit(&q->sleepers, 1, memory_order_relaxed);
+    }
+    return client_socket;
+}
+
+int queue_pop_wait(queue_t* q) {
+    int client_socket;
+    while ((client_socket = queue_pop_wait_timeout(q, -1)) == -1) {
+    }
+    return client_socket;
+}
+
+void queue_wake(queue_t* q) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->sleepers, memory_order_relaxed) > 0) {
+        atomic_fetch_add_explicit(&q->wake_seq, 1, memory_order_release);
+        futex_wake(&q->wake_seq, 1);
     }
-}
\ No newline at end of file
+}
+
+size_t queue_length(queue_t* q) {
+    size_t tail = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+bool enqueue(int client_socket) {
+    return queue_push(&queue, client_socket);
+}
+
+int dequeue() {
+    return queue_pop(&queue);
+}
+
+int dequeue_wait() {
+    return queue_pop_wait(&queue);
+}
@@ -1,14 +1,49 @@
 #ifndef MYQUEUE_H_
 #define MYQUEUE_H_
 
-struct node {
-    struct node* next;
-    int* client_socket;
-};
+#include<stdbool.h>
+#include<stdatomic.h>
+#include<stddef.h>
 
-typedef struct node node_t;
+//bounded, lock-free multi-producer/multi-consumer ring buffer (Dmitry Vyukov's design).
+//every cell carries a sequence number that says whose turn it is: producers and consumers claim a slot with one CAS on their own
+//position counter and never touch each other's counter, so there is no lock to contend on and no allocation per connection.
+#define QUEUE_CAPACITY 4096     //must be a power of two
+#define CACHE_LINE 64
 
-void enqueue(int* client_socket);
-int* dequeue();
+typedef struct cell {
+    atomic_size_t sequence;
+    int client_socket;
+} cell_t;
 
-#endif
\ No newline at end of file
+typedef struct queue {
+    //each hot counter gets its own cache line so producers and consumers don't false-share.
+    _Alignas(CACHE_LINE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE) atomic_size_t dequeue_pos;
+    //futex word bumped on every wake-up, plus the number of workers sleeping on it. producers only make a syscall when someone is asleep.
+    _Alignas(CACHE_LINE) atomic_uint wake_seq;
+    atomic_int sleepers;
+    _Alignas(CACHE_LINE) cell_t cells[QUEUE_CAPACITY];
+} queue_t;
+
+// a new, empty queue. (an all-zero queue_t is a valid empty queue too.)
+queue_t* queue_create();
+// returns false if the queue is full.
+bool queue_push(queue_t* q, int client_socket);
+// returns -1 if the queue is empty.
+int queue_pop(queue_t* q);
+// like queue_pop(), but puts the calling thread to sleep until there is something to take.
+int queue_pop_wait(queue_t* q);
+// sleeps at most timeout_ms (forever if negative) and returns -1 if there was still nothing, or if queue_wake() woke us.
+int queue_pop_wait_timeout(queue_t* q, int timeout_ms);
+// wakes one thread sleeping on q without giving it anything, e.g. so it can go and look elsewhere.
+void queue_wake(queue_t* q);
+// roughly how many items are waiting. exact only when nobody is pushing or popping.
+size_t queue_length(queue_t* q);
+
+//the same operations on one process-wide queue.
+bool enqueue(int client_socket);
+int dequeue();
+int dequeue_wait();
+
+#endif
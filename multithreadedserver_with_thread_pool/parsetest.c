@@ -0,0 +1,295 @@
+//behaviour checks for the request parser and the header helpers around it: pipelined requests split at every byte boundary,
+//Content-Length, oversized headers, Range, If-None-Match and Accept-Encoding. table-driven: a case is a line in a table.
+//usage: ./parsetest (make test). prints the cases that fail and exits 1 if there are any.
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<sys/socket.h>
+#include "server.h"
+#include "httpparser.h"
+#include "connection.h"
+#include "encoding.h"
+
+static int checks, failures;
+
+#define expect(cond, ...) do { \
+    checks++; \
+    if (!(cond)) { \
+        failures++; \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+    } \
+} while (0)
+
+//connection.c calls into server.c, which brings a main() of its own.
+int check(int exp, const char* msg) {
+    if (exp == SOCKETERROR) {
+        perror(msg);
+        exit(1);
+    }
+    return exp;
+}
+
+int shard_cpus() {
+    return 1;
+}
+
+void pin_to_shard(int shard, int listener) {
+}
+
+//three requests back to back, one with a body, the way a pipelining client sends them.
+static const char pipelined[] =
+    "GET /a HTTP/1.1\r\nHost: x\r\n\r\n"
+    "POST /b HTTP/1.1\r\nHost: x\r\nContent-Length: 5\r\n\r\nhello"
+    "GET /c HTTP/1.0\r\nHost: x\r\n\r\n";
+static const char* const pipelined_targets[] = { "/a", "/b", "/c" };
+static const long long pipelined_lengths[] = { 0, 5, 0 };
+static const bool pipelined_keep_alive[] = { true, true, false };
+
+//feeds pipelined to the parser piece by piece, every piece but the last chunk bytes long, consuming requests (and their bodies)
+//from the front of the buffer as connection.c does.
+static void parse_pipelined(size_t chunk) {
+    char buf[sizeof(pipelined)];
+    size_t fed = 0, len = 0, total = strlen(pipelined);
+    long long body_left = 0;
+    int n = 0;
+    http_parser_t parser;
+
+    http_parser_reset(&parser);
+    while (fed < total || len > 0) {
+        if (fed < total) {
+            size_t more = total - fed < chunk ? total - fed : chunk;
+            memcpy(buf + len, pipelined + fed, more);
+            fed += more;
+            len += more;
+        }
+        if (body_left > 0) {
+            size_t skip = body_left < (long long)len ? (size_t)body_left : len;
+            memmove(buf, buf + skip, len - skip);
+            len -= skip;
+            body_left -= skip;
+            continue;
+        }
+        http_request_t req;
+        http_parse_result_t result = http_parse_request(&parser, buf, len, &req);
+        if (result == HTTP_PARSE_INCOMPLETE) {
+            expect(fed < total, "chunk %zu: request %d incomplete at the end of the stream", chunk, n);
+            if (fed == total) {
+                return;
+            }
+            continue;
+        }
+        expect(result == HTTP_PARSE_OK, "chunk %zu: request %d didn't parse", chunk, n);
+        if (result != HTTP_PARSE_OK || n == 3) {
+            return;
+        }
+        expect(req.target_len == strlen(pipelined_targets[n]) && memcmp(req.target, pipelined_targets[n], req.target_len) == 0,
+               "chunk %zu: request %d is for %.*s", chunk, n, (int)req.target_len, req.target);
+        expect(req.content_length == pipelined_lengths[n], "chunk %zu: request %d has Content-Length %lld", chunk, n, req.content_length);
+        expect(req.keep_alive == pipelined_keep_alive[n], "chunk %zu: request %d keep_alive %d", chunk, n, req.keep_alive);
+        memmove(buf, buf + req.header_len, len - req.header_len);
+        len -= req.header_len;
+        body_left = req.content_length;
+        http_parser_reset(&parser);
+        n++;
+    }
+    expect(n == 3, "chunk %zu: %d requests parsed", chunk, n);
+}
+
+static void test_pipelining() {
+    for (size_t chunk=1;chunk<=strlen(pipelined);chunk++) {
+        parse_pipelined(chunk);
+    }
+}
+
+static const struct {
+    const char* request;
+    http_parse_result_t result;
+    long long content_length;
+} content_length_cases[] = {
+    { "GET / HTTP/1.1\r\nContent-Length: 12\r\n\r\n", HTTP_PARSE_OK, 12 },
+    { "GET / HTTP/1.1\r\nContent-Length: 0\r\n\r\n", HTTP_PARSE_OK, 0 },
+    { "GET / HTTP/1.1\r\nContent-Length: 7\r\nContent-Length: 7\r\n\r\n", HTTP_PARSE_OK, 7 },
+    { "GET / HTTP/1.1\r\nContent-Length: 7\r\nContent-Length: 8\r\n\r\n", HTTP_PARSE_ERROR, 0 },
+    { "GET / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n", HTTP_PARSE_ERROR, 0 },
+    { "GET / HTTP/1.1\r\nContent-Length: -1\r\n\r\n", HTTP_PARSE_ERROR, 0 },
+    { "GET / HTTP/1.1\r\nContent-Length: +1\r\n\r\n", HTTP_PARSE_ERROR, 0 },
+    { "GET / HTTP/1.1\r\nContent-Length: 1 2\r\n\r\n", HTTP_PARSE_ERROR, 0 },
+    { "GET / HTTP/1.1\r\nContent-Length:\r\n\r\n", HTTP_PARSE_ERROR, 0 },
+    { "GET / HTTP/1.1\r\nContent-Length: 99999999999999999999\r\n\r\n", HTTP_PARSE_ERROR, 0 },
+};
+
+static void test_content_length() {
+    for (size_t i=0;i<sizeof(content_length_cases)/sizeof(content_length_cases[0]);i++) {
+        const char* text = content_length_cases[i].request;
+        http_parser_t parser;
+        http_request_t req;
+        http_parser_reset(&parser);
+        http_parse_result_t result = http_parse_request(&parser, text, strlen(text), &req);
+        expect(result == content_length_cases[i].result, "%s: result %d", text, result);
+        if (result == HTTP_PARSE_OK) {
+            expect(req.content_length == content_length_cases[i].content_length, "%s: Content-Length %lld", text, req.content_length);
+        }
+    }
+}
+
+//what a connection answers to in[] holding just this (up to BUFSIZE bytes of it). the status code, 0 if it's still waiting.
+static int answer(const char* in, size_t len) {
+    static connection_t conn;
+    int sv[2];
+    check(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), "socketpair failed");
+    connection_init(&conn, sv[0], false);
+    memcpy(conn.in, in, len);
+    conn.in_len = len;
+    int status = 0;
+    if (connection_next_request(&conn)) {
+        sscanf(conn.head, "HTTP/1.%*d %d", &status);
+    }
+    connection_close(&conn);
+    close(sv[1]);
+    return status;
+}
+
+//a header block that doesn't end before the input buffer is full is a 431. one that does but is malformed is a 400.
+static void test_oversized() {
+    char in[BUFSIZE];
+    int len = snprintf(in, sizeof(in), "GET / HTTP/1.1\r\nHost: x\r\nCookie: ");
+    memset(in + len, 'a', sizeof(in) - len);
+    expect(answer(in, sizeof(in)) == 431, "header block of %d bytes: %d", BUFSIZE, answer(in, sizeof(in)));
+    expect(answer(in, sizeof(in) - 1) == 0, "header block one byte short of the buffer: %d", answer(in, sizeof(in) - 1));
+
+    const char* bad = "GET / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n";
+    expect(answer(bad, strlen(bad)) == 400, "bad Content-Length: %d", answer(bad, strlen(bad)));
+}
+
+//against a representation of 1000 bytes unless size says otherwise. n is http_parse_ranges()' answer: -1 ignore, 0 is a 416.
+static const struct {
+    const char* range;
+    long long size;
+    int n;
+    http_range_t ranges[3];
+} range_cases[] = {
+    { "bytes=0-499", 1000, 1, { { 0, 499 } } },
+    { "bytes=500-", 1000, 1, { { 500, 999 } } },
+    { "bytes=0-1999", 1000, 1, { { 0, 999 } } },
+    { "bytes=-500", 1000, 1, { { 500, 999 } } },
+    { "bytes=-1500", 1000, 1, { { 0, 999 } } },
+    { "bytes=-1", 1000, 1, { { 999, 999 } } },
+    { "bytes=-0", 1000, 0 },
+    { "bytes=0-0,-1", 1000, 2, { { 0, 0 }, { 999, 999 } } },
+    { "bytes=0-499, 400-599", 1000, 2, { { 0, 499 }, { 400, 599 } } },     //overlapping ones are sent as asked
+    { "bytes=0-99,0-99", 1000, 2, { { 0, 99 }, { 0, 99 } } },
+    { "bytes=1000-", 1000, 0 },
+    { "bytes=1000-2000, 5000-", 1000, 0 },
+    { "bytes=1000-2000, 999-", 1000, 1, { { 999, 999 } } },
+    { "bytes=0-", 0, 0 },
+    { "bytes=-5", 0, 0 },
+    { "bytes=5-1", 1000, -1 },
+    { "bytes=", 1000, -1 },
+    { "bytes=a-b", 1000, -1 },
+    { "bytes=0-1;", 1000, -1 },
+    { "items=0-1", 1000, -1 },
+    { "bytes=0-0,1-1,2-2,3-3,4-4,5-5,6-6,7-7,8-8", 1000, -1 },     //more than HTTP_MAX_RANGES
+};
+
+static void test_ranges() {
+    for (size_t i=0;i<sizeof(range_cases)/sizeof(range_cases[0]);i++) {
+        const char* range = range_cases[i].range;
+        http_range_t ranges[HTTP_MAX_RANGES];
+        int n = http_parse_ranges(range, strlen(range), range_cases[i].size, ranges, HTTP_MAX_RANGES);
+        expect(n == range_cases[i].n, "%s of %lld bytes: %d ranges", range, range_cases[i].size, n);
+        for (int r=0;r<n && n == range_cases[i].n;r++) {
+            expect(ranges[r].first == range_cases[i].ranges[r].first && ranges[r].last == range_cases[i].ranges[r].last,
+                   "%s: range %d is %lld-%lld", range, r, ranges[r].first, ranges[r].last);
+        }
+    }
+}
+
+//the file's tag is "2f-1a". matched is what the 304 carries, NULL for no match.
+static const struct {
+    const char* if_none_match;
+    const char* matched;
+} etag_cases[] = {
+    { "\"2f-1a\"", "\"2f-1a\"" },
+    { "W/\"2f-1a\"", "\"2f-1a\"" },
+    { "\"old\", W/\"2f-1a\"", "\"2f-1a\"" },
+    { " ,\t\"2f-1a\" ", "\"2f-1a\"" },
+    { "\"2f-1a-gzip\"", "\"2f-1a-gzip\"" },
+    { "W/\"2f-1a-zstd\"", "\"2f-1a-zstd\"" },
+    { "*", "\"2f-1a\"" },
+    { "\"old\", \"older\"", NULL },
+    { "\"2f-1b\"", NULL },
+    { "\"2f-1a-br\"", NULL },
+    { "\"2f-1a", NULL },
+    { "2f-1a", NULL },
+    { "w/\"2f-1a\"", NULL },
+    { "", NULL },
+};
+
+static void test_etags() {
+    for (size_t i=0;i<sizeof(etag_cases)/sizeof(etag_cases[0]);i++) {
+        const char* list = etag_cases[i].if_none_match;
+        const char* want = etag_cases[i].matched;
+        char matched[RESPONSE_ETAG_MAX] = "";
+        bool listed = connection_etag_listed(list, strlen(list), "\"2f-1a\"", matched);
+        expect(listed == (want != NULL), "If-None-Match: %s %s", list, listed ? "matched" : "didn't match");
+        if (listed && want != NULL) {
+            expect(strcmp(matched, want) == 0, "If-None-Match: %s matched %s", list, matched);
+        }
+    }
+}
+
+//NULL: no Accept-Encoding at all. q in thousandths for identity, gzip and zstd.
+static const struct {
+    const char* accept_encoding;
+    short q[CODING_COUNT];
+} accept_cases[] = {
+    { NULL, { 1000, 0, 0 } },
+    { "", { 1000, 0, 0 } },
+    { "gzip", { 1000, 1000, 0 } },
+    { "gzip;q=0.5, zstd", { 1000, 500, 1000 } },
+    { "GZIP; q=0.8", { 1000, 800, 0 } },
+    { "x-gzip", { 1000, 1000, 0 } },
+    { "zstd;q=1.0, gzip;q=0.001", { 1000, 1, 1000 } },
+    { "*", { 1000, 1000, 1000 } },
+    { "*;q=0.2, gzip", { 1000, 1000, 200 } },
+    { "gzip;q=0, *", { 1000, 0, 1000 } },
+    { "*;q=0", { 1000, 0, 0 } },
+    { "br, deflate", { 1000, 0, 0 } },
+    { "gzip;level=1;q=0.3", { 1000, 300, 0 } },
+};
+
+static void test_accept_encoding() {
+    for (size_t i=0;i<sizeof(accept_cases)/sizeof(accept_cases[0]);i++) {
+        const char* value = accept_cases[i].accept_encoding;
+        char text[256];
+        if (value != NULL) {
+            snprintf(text, sizeof(text), "GET / HTTP/1.1\r\nAccept-Encoding: %s\r\n\r\n", value);
+        } else {
+            snprintf(text, sizeof(text), "GET / HTTP/1.1\r\n\r\n");
+        }
+        http_parser_t parser;
+        http_request_t req;
+        encoding_accept_t accept;
+        http_parser_reset(&parser);
+        expect(http_parse_request(&parser, text, strlen(text), &req) == HTTP_PARSE_OK, "Accept-Encoding: %s didn't parse", value);
+        encoding_parse_accept(&req, &accept);
+        for (int c=0;c<CODING_COUNT;c++) {
+            expect(accept.q[c] == accept_cases[i].q[c], "Accept-Encoding: %s gives %s q=%d", value ? value : "(none)",
+                   encoding_name(c), accept.q[c]);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    test_pipelining();
+    test_content_length();
+    test_oversized();
+    test_ranges();
+    test_etags();
+    test_accept_encoding();
+    printf("parsetest: %d checks, %d failed\n", checks, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,186 @@
+//microbenchmark: enqueue/dequeue throughput of the lock-free ring in myqueue.c against the mutex-guarded linked list it replaced.
+//usage: ./queuebench [-j] [ops]
+//  -j  JSON lines (see bench.h) instead of the table
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdbool.h>
+#include<stdatomic.h>
+#include<pthread.h>
+#include<sched.h>
+#include<time.h>
+#include "myqueue.h"
+#include "bench.h"
+
+#define DEFAULT_OPS (1 << 20)
+#define MAX_THREADS 64
+
+//the old myqueue.c, kept here verbatim (plus its lock) as the baseline.
+struct node {
+    struct node* next;
+    int* client_socket;
+};
+typedef struct node node_t;
+
+static node_t* head = NULL;
+static node_t* tail = NULL;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void list_enqueue(int* client_socket) {
+    node_t* newnode = malloc(sizeof(node_t));
+    newnode->client_socket = client_socket;
+    newnode->next = NULL;
+    if (tail == NULL) {
+        head = newnode;
+    } else {
+        tail->next = newnode;
+    }
+    tail = newnode;
+}
+
+static int* list_dequeue() {
+    if (head == NULL) {
+        return NULL;
+    }
+    int* result = head->client_socket;
+    node_t* temp = head;
+    head = head->next;
+    if (head == NULL) {
+        tail = NULL;
+    }
+    free(temp);
+    return result;
+}
+
+//one push/pop pair per queue under test, mirroring what main() and thread_function() did per connection.
+static bool list_push(int fd) {
+    int* pclient = malloc(sizeof(int));
+    *pclient = fd;
+    pthread_mutex_lock(&mutex);
+    list_enqueue(pclient);
+    pthread_mutex_unlock(&mutex);
+    return true;
+}
+
+static int list_pop() {
+    pthread_mutex_lock(&mutex);
+    int* pclient = list_dequeue();
+    pthread_mutex_unlock(&mutex);
+    if (pclient == NULL) {
+        return -1;
+    }
+    int fd = *pclient;
+    free(pclient);
+    return fd;
+}
+
+typedef struct impl {
+    const char* name;
+    bool (*push)(int);
+    int (*pop)();
+} impl_t;
+
+static const impl_t impls[] = {
+    { "list+mutex", list_push, list_pop },
+    { "ring", enqueue, dequeue },
+};
+
+typedef struct run {
+    const impl_t* impl;
+    long per_producer;
+    long total;
+    atomic_long consumed;
+} run_t;
+
+static void* producer(void* arg) {
+    run_t* run = arg;
+    for (long i=0;i<run->per_producer;i++) {
+        while (!run->impl->push((int)i)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    run_t* run = arg;
+    while (atomic_load_explicit(&run->consumed, memory_order_relaxed) < run->total) {
+        if (run->impl->pop() == -1) {
+            sched_yield();
+        } else {
+            atomic_fetch_add_explicit(&run->consumed, 1, memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//returns millions of items moved through the queue per second.
+static double bench(const impl_t* impl, int nthreads, long ops) {
+    pthread_t threads[MAX_THREADS];
+    run_t run = { .impl = impl };
+    double start = now();
+
+    if (nthreads == 1) {
+        //a single thread just alternates push and pop.
+        for (long i=0;i<ops;i++) {
+            impl->push((int)i);
+            impl->pop();
+        }
+        return ops / (now() - start) / 1e6;
+    }
+
+    int producers = nthreads / 2;
+    int consumers = nthreads - producers;
+    run.per_producer = ops / producers;
+    run.total = run.per_producer * producers;
+    atomic_init(&run.consumed, 0);
+
+    for (int i=0;i<producers;i++) {
+        pthread_create(&threads[i], NULL, producer, &run);
+    }
+    for (int i=0;i<consumers;i++) {
+        pthread_create(&threads[producers+i], NULL, consumer, &run);
+    }
+    for (int i=0;i<nthreads;i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return run.total / (now() - start) / 1e6;
+}
+
+int main(int argc, char** argv) {
+    bool json = argc > 1 && strcmp(argv[1], "-j") == 0;
+    long ops = argc > 1 + json ? atol(argv[1 + json]) : DEFAULT_OPS;
+
+    if (json) {
+        char name[64];
+        for (int nthreads=1;nthreads<=MAX_THREADS;nthreads*=4) {
+            for (size_t i=0;i<sizeof(impls)/sizeof(impls[0]);i++) {
+                snprintf(name, sizeof(name), "%s %d threads", impls[i].name, nthreads);
+                bench_json("queue", name, bench(&impls[i], nthreads, ops), "Mops/s", false);
+            }
+        }
+        return 0;
+    }
+
+    printf("%-8s", "threads");
+    for (size_t i=0;i<sizeof(impls)/sizeof(impls[0]);i++) {
+        printf("%16s", impls[i].name);
+    }
+    printf("   (Mops/s, %ld ops)\n", ops);
+
+    for (int nthreads=1;nthreads<=MAX_THREADS;nthreads*=2) {
+        printf("%-8d", nthreads);
+        for (size_t i=0;i<sizeof(impls)/sizeof(impls[0]);i++) {
+            printf("%16.2f", bench(&impls[i], nthreads, ops));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,389 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdatomic.h>
+#include<pthread.h>
+#include<time.h>
+#include<arpa/inet.h>
+#include "ratelimit.h"
+
+typedef struct deferred {
+    int socket;
+    void* owner;
+} deferred_t;
+
+typedef struct client {
+    in_addr_t addr;
+    int weight;
+    int refs;           //open connections, plus one per connection in (or waiting for) the pool
+    int open;           //open connections, to split the client's egress over
+    double tokens;      //-R bucket
+    long long refilled_ms;
+    long long seen_ms;  //when refs last dropped to 0
+    int serving;        //connections the pool is serving
+    deferred_t* line;   //RL_MAX_DEFERRED slots, allocated the first time the client goes over its share
+    int line_head, line_len;
+    bool waiting;       //on the waiting list below, which holds a reference for it
+    struct client* waiting_next;
+    struct client* next;
+} client_t;
+
+typedef struct rl_shard {
+    pthread_mutex_t lock;
+    client_t* buckets[RL_BUCKETS];
+} rl_shard_t;
+
+typedef struct weight_rule {
+    in_addr_t net;      //network byte order, like the masked address it's compared with
+    in_addr_t mask;
+    int weight;
+} weight_rule_t;
+
+double ratelimit_rate = 0;
+double ratelimit_burst = 0;
+uint64_t ratelimit_conn_bps = 0;
+uint64_t ratelimit_client_bps = 0;
+
+static rl_shard_t shards[RL_SHARDS];
+static weight_rule_t rules[RL_MAX_WEIGHTS];
+static int nrules;
+static int pool_workers;
+static bool enabled;
+
+//clients with connections in their line, in the order they get a spare worker. lock order: waiting_lock, then a shard's.
+static pthread_mutex_t waiting_lock = PTHREAD_MUTEX_INITIALIZER;
+static client_t* waiting_head;
+static client_t* waiting_tail;
+
+static atomic_int clients;
+static atomic_int active_weight;    //sum of the weights of clients with connections in (or waiting for) the pool
+static atomic_long untracked, limited, deferred_now, deferrals;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+bool ratelimit_parse_rate(const char* arg) {
+    char* end;
+    ratelimit_rate = strtod(arg, &end);
+    ratelimit_burst = ratelimit_rate;
+    if (*end == ':') {
+        ratelimit_burst = strtod(end + 1, &end);
+    }
+    //a bucket that can't hold one whole token would never let anything through.
+    if (ratelimit_burst < 1) {
+        ratelimit_burst = 1;
+    }
+    return *end == '\0' && ratelimit_rate >= 0;
+}
+
+bool ratelimit_parse_egress(const char* arg) {
+    long long conn_kb = 0, client_kb = 0;
+    int n = sscanf(arg, "%lld:%lld", &conn_kb, &client_kb);
+    ratelimit_conn_bps = conn_kb * 1024;
+    ratelimit_client_bps = client_kb * 1024;
+    return n >= 1 && conn_kb >= 0 && client_kb >= 0;
+}
+
+bool ratelimit_add_weight(const char* arg) {
+    char net[INET_ADDRSTRLEN];
+    int bits = 32, weight;
+    struct in_addr a;
+    if (nrules == RL_MAX_WEIGHTS || (sscanf(arg, "%15[0-9.]/%d=%d", net, &bits, &weight) != 3
+                                     && sscanf(arg, "%15[0-9.]=%d", net, &weight) != 2)) {
+        return false;
+    }
+    if (inet_pton(AF_INET, net, &a) != 1 || bits < 0 || bits > 32 || weight < 1) {
+        return false;
+    }
+    rules[nrules].mask = bits == 0 ? 0 : htonl(~0U << (32 - bits));
+    rules[nrules].net = a.s_addr & rules[nrules].mask;
+    rules[nrules].weight = weight;
+    nrules++;
+    return true;
+}
+
+static int weight_of(in_addr_t addr) {
+    for (int i=0;i<nrules;i++) {
+        if ((addr & rules[i].mask) == rules[i].net) {
+            return rules[i].weight;
+        }
+    }
+    return 1;
+}
+
+void ratelimit_init(int fair_workers) {
+    pool_workers = fair_workers;
+    //-B per connection alone doesn't need to know who the client is, unless weights scale it.
+    enabled = ratelimit_rate > 0 || ratelimit_client_bps > 0 || pool_workers > 0 || (ratelimit_conn_bps > 0 && nrules > 0);
+    for (int i=0;i<RL_SHARDS;i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+}
+
+bool ratelimit_enabled() {
+    return enabled;
+}
+
+bool ratelimit_fair() {
+    return pool_workers > 0;
+}
+
+static rl_shard_t* shard_of(in_addr_t addr, client_t*** chain) {
+    uint32_t h = (uint32_t)addr * 0x9e3779b1U;
+    rl_shard_t* shard = &shards[(h >> 24) % RL_SHARDS];
+    *chain = &shard->buckets[(h >> 8) % RL_BUCKETS];
+    return shard;
+}
+
+static void free_client(client_t* c) {
+    free(c->line);
+    free(c);
+    atomic_fetch_sub(&clients, 1);
+}
+
+client_t* ratelimit_attach(in_addr_t addr) {
+    if (!enabled) {
+        return NULL;
+    }
+    client_t** chain;
+    rl_shard_t* shard = shard_of(addr, &chain);
+    long long now = now_ms();
+    client_t* found = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    //entries nobody has used for a while go on the way past.
+    for (client_t** p = chain; *p != NULL;) {
+        client_t* c = *p;
+        if (c->addr == addr) {
+            found = c;
+        } else if (c->refs == 0 && now - c->seen_ms > RL_IDLE_MS) {
+            *p = c->next;
+            free_client(c);
+            continue;
+        }
+        p = &c->next;
+    }
+    if (found == NULL && atomic_fetch_add(&clients, 1) < RL_MAX_CLIENTS) {
+        found = calloc(1, sizeof(client_t));
+        found->addr = addr;
+        found->weight = weight_of(addr);
+        found->tokens = ratelimit_burst * found->weight;
+        found->refilled_ms = now;
+        found->next = *chain;
+        *chain = found;
+    } else if (found == NULL) {
+        atomic_fetch_sub(&clients, 1);
+        atomic_fetch_add(&untracked, 1);
+    }
+    if (found != NULL) {
+        found->refs++;
+        found->open++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+//drops a reference. the entry stays for RL_IDLE_MS after the last one, so its bucket isn't refilled by reconnecting.
+static void put(client_t* c) {
+    if (--c->refs == 0) {
+        c->seen_ms = now_ms();
+    }
+}
+
+void ratelimit_detach(client_t* c) {
+    if (c == NULL) {
+        return;
+    }
+    client_t** chain;
+    rl_shard_t* shard = shard_of(c->addr, &chain);
+    pthread_mutex_lock(&shard->lock);
+    c->open--;
+    put(c);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+bool ratelimit_allow_request(client_t* c, int* retry_after) {
+    if (c == NULL || ratelimit_rate <= 0) {
+        return true;
+    }
+    client_t** chain;
+    rl_shard_t* shard = shard_of(c->addr, &chain);
+    double rate = ratelimit_rate * c->weight, burst = ratelimit_burst * c->weight;
+    long long now = now_ms();
+    bool allowed;
+
+    pthread_mutex_lock(&shard->lock);
+    c->tokens += (now - c->refilled_ms) * rate / 1000;
+    if (c->tokens > burst) {
+        c->tokens = burst;
+    }
+    c->refilled_ms = now;
+    if ((allowed = c->tokens >= 1)) {
+        c->tokens -= 1;
+    } else {
+        //rounded up: a client that comes back when it's told to gets in.
+        *retry_after = (int)((1 - c->tokens) / rate) + 1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    if (!allowed) {
+        atomic_fetch_add(&limited, 1);
+    }
+    return allowed;
+}
+
+uint64_t ratelimit_pacing(const client_t* c) {
+    int weight = c != NULL ? c->weight : 1;
+    uint64_t rate = ratelimit_conn_bps * weight;
+    if (c != NULL && ratelimit_client_bps > 0) {
+        //read without the lock: a rate that's off by a connection for one response is fine.
+        int open = __atomic_load_n(&c->open, __ATOMIC_RELAXED);
+        uint64_t share = ratelimit_client_bps * weight / (open > 0 ? open : 1);
+        if (rate == 0 || share < rate) {
+            rate = share;
+        }
+    }
+    return rate;
+}
+
+//how many workers c may tie up at once while the pool is full: its weight's worth of the pool, split between the clients using it
+//(c included). alone it gets all of it.
+static int share_of(const client_t* c) {
+    int share = pool_workers * c->weight / atomic_load(&active_weight);
+    return share > 0 ? share : 1;
+}
+
+static void append_waiting(client_t* c) {
+    pthread_mutex_lock(&waiting_lock);
+    c->waiting_next = NULL;
+    if (waiting_tail != NULL) {
+        waiting_tail->waiting_next = c;
+    } else {
+        waiting_head = c;
+    }
+    waiting_tail = c;
+    pthread_mutex_unlock(&waiting_lock);
+}
+
+fair_verdict_t ratelimit_fair_enter(client_t* c, int client_socket, void* owner, bool spare) {
+    client_t** chain;
+    rl_shard_t* shard = shard_of(c->addr, &chain);
+    fair_verdict_t verdict = FAIR_SERVE;
+    bool append = false;
+
+    pthread_mutex_lock(&shard->lock);
+    if (c->serving == 0 && c->line_len == 0) {
+        atomic_fetch_add(&active_weight, c->weight);
+    }
+    //a worker with nothing else to do serves anyone. only a full pool makes a client wait for its share.
+    if (!spare && (c->serving >= share_of(c) || c->line_len > 0)) {
+        //behind its own connections, never in front of them.
+        if (c->line == NULL) {
+            c->line = malloc(RL_MAX_DEFERRED * sizeof(deferred_t));
+        }
+        if (c->line_len == RL_MAX_DEFERRED && atomic_load(&active_weight) == c->weight) {
+            //alone, there's nobody to shed it for. it queues in the pool like it would without -F.
+            c->serving++;
+            c->refs++;
+        } else if (c->line_len == RL_MAX_DEFERRED) {
+            verdict = FAIR_SHED;
+        } else {
+            c->line[(c->line_head + c->line_len++) % RL_MAX_DEFERRED] = (deferred_t){ client_socket, owner };
+            c->refs++;
+            verdict = FAIR_DEFERRED;
+            if (!c->waiting) {
+                c->waiting = true;
+                c->refs++;
+                append = true;
+            }
+        }
+    } else {
+        c->serving++;
+        c->refs++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (append) {
+        append_waiting(c);
+    }
+    if (verdict == FAIR_DEFERRED) {
+        atomic_fetch_add(&deferred_now, 1);
+        atomic_fetch_add(&deferrals, 1);
+    }
+    return verdict;
+}
+
+int ratelimit_fair_leave(client_t* c, int* sockets, void** owners, int max) {
+    client_t** chain;
+    rl_shard_t* shard = shard_of(c->addr, &chain);
+    int n = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    c->serving--;
+    put(c);
+    while (n < max && c->line_len > 0 && c->serving < share_of(c)) {
+        deferred_t* d = &c->line[c->line_head];
+        sockets[n] = d->socket;
+        owners[n] = d->owner;
+        n++;
+        c->line_head = (c->line_head + 1) % RL_MAX_DEFERRED;
+        c->line_len--;
+        c->serving++;
+    }
+    if (c->serving == 0 && c->line_len == 0) {
+        atomic_fetch_sub(&active_weight, c->weight);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_sub(&deferred_now, n);
+    return n;
+}
+
+int ratelimit_fair_next(int* sockets, client_t** clients, int max) {
+    int n = 0;
+    //unlocked peek: a client that joins the list right after is picked up by the next worker that frees up, or the monitor.
+    while (n < max && __atomic_load_n(&waiting_head, __ATOMIC_RELAXED) != NULL) {
+        pthread_mutex_lock(&waiting_lock);
+        client_t* c = waiting_head;
+        if (c != NULL && (waiting_head = c->waiting_next) == NULL) {
+            waiting_tail = NULL;
+        }
+        pthread_mutex_unlock(&waiting_lock);
+        if (c == NULL) {
+            break;
+        }
+
+        client_t** chain;
+        rl_shard_t* shard = shard_of(c->addr, &chain);
+        bool again;
+        pthread_mutex_lock(&shard->lock);
+        //one connection per client per turn, round robin.
+        if (c->line_len > 0) {
+            sockets[n] = c->line[c->line_head].socket;
+            clients[n] = c;
+            n++;
+            c->line_head = (c->line_head + 1) % RL_MAX_DEFERRED;
+            c->line_len--;
+            c->serving++;
+            atomic_fetch_sub(&deferred_now, 1);
+        }
+        if (!(again = c->line_len > 0)) {
+            c->waiting = false;
+            put(c);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        if (again) {
+            append_waiting(c);
+        }
+    }
+    return n;
+}
+
+void ratelimit_get_stats(ratelimit_stats_t* stats) {
+    stats->clients = atomic_load(&clients);
+    stats->untracked = atomic_load(&untracked);
+    stats->limited = atomic_load(&limited);
+    stats->deferred = atomic_load(&deferred_now);
+    stats->deferrals = atomic_load(&deferrals);
+}
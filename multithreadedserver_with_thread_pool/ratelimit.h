@@ -0,0 +1,96 @@
+#ifndef RATELIMIT_H_
+#define RATELIMIT_H_
+
+#include<stdbool.h>
+#include<stdint.h>
+#include<netinet/in.h>
+
+//per-client limits, a client being a source IP address. each one has an entry in a hash table split into shards with a lock each
+//(like filecache.c), found by the address accept() hands back:
+//- a token bucket of requests (-R rate:burst). a request that finds it empty is answered with a 429 and a Retry-After, and the
+//  connection stays open.
+//- an egress limit per connection and per client (-B), which the kernel enforces by pacing the socket (SO_MAX_PACING_RATE): a
+//  connection over its rate just sees a slower socket, so nobody sleeps for it. a client's rate is split evenly over its open
+//  connections, so opening more of them doesn't buy more bandwidth.
+//- pool mode with -F: a fair share of the workers. as long as the pool has a worker to spare anyone gets it, so a client can use
+//  all of them. once it's full, a client with more connections in service than its share has the rest wait in a line of its own.
+//  each of its connections that finishes lets the next one in, and a worker that frees up with nothing queued takes one from the
+//  lines, a client at a time. everyone else's go straight to the pool, so a client with hundreds of sockets slows down itself
+//  rather than the pool. past a full line connections are shed, unless the client is alone: then they queue in the pool like they
+//  would without -F. a worker holds a connection until it closes: nothing in service is taken back.
+//-W addr/bits=weight gives matching clients a bigger (or smaller) share of everything: weight times the rates and bursts, and that
+//many shares of the pool. the default weight is 1.
+//entries outlive their connections for a while, so reconnecting doesn't refill the bucket, and go once they've been idle long enough.
+#define RL_SHARDS 64
+#define RL_BUCKETS 256              //hash chains per shard
+#define RL_MAX_CLIENTS 65536        //clients tracked at once. past that new ones go unlimited (and are counted)
+#define RL_IDLE_MS 60000            //how long an entry with no connections is kept
+#define RL_MAX_DEFERRED 64          //a client's connections waiting for its share of the pool. past that they're shed
+#define RL_MAX_WEIGHTS 16           //-W rules
+
+struct client;
+
+typedef struct ratelimit_stats {
+    long clients;           //tracked right now
+    long untracked;         //connections from clients the table had no room for
+    long limited;           //requests answered with 429
+    long deferred;          //connections waiting for their client's share of the pool, right now
+    long deferrals;         //...and in total
+} ratelimit_stats_t;
+
+//-R: requests per second per client, and the burst on top. 0 turns it off.
+extern double ratelimit_rate;
+extern double ratelimit_burst;
+//-B: bytes per second per connection, and per client (over all of its connections). 0 for no limit.
+extern uint64_t ratelimit_conn_bps;
+extern uint64_t ratelimit_client_bps;
+
+// parses -R "rate[:burst]" and -B "conn_kb[:client_kb]" (KiB/s).
+bool ratelimit_parse_rate(const char* arg);
+bool ratelimit_parse_egress(const char* arg);
+
+// adds a -W "addr[/bits]=weight" rule. the first rule that matches a client decides its weight.
+bool ratelimit_add_weight(const char* arg);
+
+// sets up the table. fair_workers is how many workers the pool(s) can run at most, for the fair shares. 0 turns them off (always
+// outside pool mode).
+void ratelimit_init(int fair_workers);
+
+// whether anything is tracked at all. with no limits and no pool to share, every client is NULL.
+bool ratelimit_enabled();
+
+// whether the pool is shared out fairly (-F).
+bool ratelimit_fair();
+
+// the entry for a new connection from addr, referenced until ratelimit_detach(). NULL when nothing is limited or the table is full.
+struct client* ratelimit_attach(in_addr_t addr);
+
+void ratelimit_detach(struct client* client);
+
+// takes a token for a request. false if there's none: *retry_after says in how many seconds there will be.
+bool ratelimit_allow_request(struct client* client, int* retry_after);
+
+// the pacing rate (bytes per second) for one of client's connections right now, 0 for none.
+uint64_t ratelimit_pacing(const struct client* client);
+
+typedef enum {
+    FAIR_SERVE,     //within the client's share. ratelimit_fair_leave() once it's done
+    FAIR_DEFERRED,  //parked in the client's line. ratelimit_fair_leave() hands it back when it's its turn
+    FAIR_SHED,      //the line is full
+} fair_verdict_t;
+
+// pool mode: whether client_socket (one of client's connections, bound for owner's pool) may be served now. spare says whether the
+// pool has a worker free (or may add one), in which case it always may.
+fair_verdict_t ratelimit_fair_enter(struct client* client, int client_socket, void* owner, bool spare);
+
+// one of client's connections is done with the pool. fills in (up to max of) its deferred connections that may be served now,
+// already counted in, and returns how many.
+int ratelimit_fair_leave(struct client* client, int* sockets, void** owners, int max);
+
+// a worker is free and nothing is queued for it: takes up to max deferred connections off the clients' lines, one client at a
+// time, already counted in. clients[i] is whose sockets[i] is.
+int ratelimit_fair_next(int* sockets, struct client** clients, int max);
+
+void ratelimit_get_stats(ratelimit_stats_t* stats);
+
+#endif
@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<poll.h>
+#include<signal.h>
+#include<pthread.h>
+#include<sched.h>
+#include<stdatomic.h>
+#include<limits.h>
+#include<sys/socket.h>
+#include<sys/wait.h>
+#include "server.h"
+#include "reload.h"
+#include "filecache.h"
+#include "admission.h"
+#include "log.h"
+
+#define WAKE_SIGNAL (SIGRTMIN + 1)
+#define MAX_WARM_PATHS (CACHE_SHARDS * CACHE_ENTRIES_PER_SHARD)
+
+//what goes with the fds: listeners come first, then the metrics socket if there is one.
+typedef struct handoff {
+    int listeners;
+    int metrics;
+} handoff_t;
+
+extern char** environ;
+
+static const int* our_listeners;
+static int our_nlisteners;
+static int our_metrics = -1;
+static char** our_argv;
+static char our_binary[PATH_MAX];
+
+static int handoff_fd = -1;        //to the process that started us, until we're ready
+static int* inherited;
+static int ninherited;
+static int inherited_metrics = -1;
+
+static atomic_bool draining;
+static pthread_mutex_t acceptors_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t acceptors[CPU_SETSIZE];
+static int nacceptors;
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static bool write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == SOCKETERROR && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+void reload_take_over() {
+    const char* value = getenv(RELOAD_HANDOFF_ENV);
+    if (value == NULL) {
+        return;
+    }
+    handoff_fd = atoi(value);
+    unsetenv(RELOAD_HANDOFF_ENV);
+    fcntl(handoff_fd, F_SETFD, FD_CLOEXEC);
+
+    handoff_t h;
+    char control[CMSG_SPACE((RELOAD_MAX_LISTENERS + 1) * sizeof(int))];
+    struct iovec iov = { &h, sizeof(h) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t got;
+    while ((got = recvmsg(handoff_fd, &msg, MSG_CMSG_CLOEXEC)) == SOCKETERROR && errno == EINTR) {
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (got != sizeof(h) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN((h.listeners + h.metrics) * sizeof(int))) {
+        fprintf(stderr, "reload: bad handoff from the old process\n");
+        exit(1);
+    }
+    int* fds = (int*)CMSG_DATA(cmsg);
+    ninherited = h.listeners;
+    inherited = malloc(ninherited * sizeof(int));
+    memcpy(inherited, fds, ninherited * sizeof(int));
+    if (h.metrics) {
+        inherited_metrics = fds[ninherited];
+    }
+
+    //then one cached path per line, up to an empty one. loading them is the point of the whole exercise: the old process is
+    //still serving while we do it, so a miss here costs nobody anything.
+    FILE* in = fdopen(dup(handoff_fd), "r");
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int warmed = 0;
+    long long start = now_ms();
+    while ((len = getline(&line, &cap, in)) > 1) {
+        line[len - 1] = 0;
+        bool hit;
+        cache_entry_t* entry = cache_enabled() ? cache_get(line, NULL, &hit) : NULL;
+        if (entry != NULL) {
+            cache_put(entry);
+            warmed++;
+        }
+    }
+    free(line);
+    fclose(in);
+    log_info("reload: took over %d listener%s from pid %d, warmed %d cached files in %lld ms", ninherited, ninherited > 1 ? "s" : "",
+             getppid(), warmed, now_ms() - start);
+}
+
+int reload_listeners(int** fds) {
+    *fds = inherited;
+    return ninherited;
+}
+
+int reload_metrics_socket() {
+    return inherited_metrics;
+}
+
+void reload_ready() {
+    if (handoff_fd == -1) {
+        return;
+    }
+    write_all(handoff_fd, "R", 1);
+    close(handoff_fd);
+    handoff_fd = -1;
+}
+
+bool reload_draining() {
+    return atomic_load_explicit(&draining, memory_order_relaxed);
+}
+
+void reload_register_acceptor() {
+    pthread_mutex_lock(&acceptors_lock);
+    acceptors[nacceptors++] = pthread_self();
+    pthread_mutex_unlock(&acceptors_lock);
+}
+
+void reload_acceptor_stopped() {
+    pthread_mutex_lock(&acceptors_lock);
+    for (int i=0;i<nacceptors;i++) {
+        if (pthread_equal(acceptors[i], pthread_self())) {
+            acceptors[i] = acceptors[--nacceptors];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&acceptors_lock);
+}
+
+//wakes every thread that still accepts. the signal can land just before one goes to sleep, so this is repeated until they've all stopped.
+static int wake_acceptors() {
+    pthread_mutex_lock(&acceptors_lock);
+    int n = nacceptors;
+    for (int i=0;i<n;i++) {
+        pthread_kill(acceptors[i], WAKE_SIGNAL);
+    }
+    pthread_mutex_unlock(&acceptors_lock);
+    return n;
+}
+
+static void on_wake(int sig) {
+    //nothing to do: being interrupted is the point.
+}
+
+//starts the new process. returns its pid and our end of the socketpair, or -1.
+static pid_t spawn(int* fd) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == SOCKETERROR) {
+        return -1;
+    }
+    //the environment is put together before the fork: after it, only async-signal-safe calls are allowed until the exec.
+    int n = 0;
+    while (environ[n] != NULL) {
+        n++;
+    }
+    char** env = calloc(n + 2, sizeof(char*));
+    char handoff[64];
+    int j = 0;
+    for (int i=0;i<n;i++) {
+        if (strncmp(environ[i], RELOAD_HANDOFF_ENV "=", strlen(RELOAD_HANDOFF_ENV) + 1) != 0) {
+            env[j++] = environ[i];
+        }
+    }
+    snprintf(handoff, sizeof(handoff), "%s=%d", RELOAD_HANDOFF_ENV, pair[1]);
+    env[j++] = handoff;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        //the child's end must survive the exec. the signals we block for our own sigwait() threads are blocked in it too, which
+        //is what the new process wants anyway.
+        fcntl(pair[1], F_SETFD, 0);
+        execve(our_binary, our_argv, env);
+        _exit(127);
+    }
+    free(env);
+    close(pair[1]);
+    if (pid == SOCKETERROR) {
+        close(pair[0]);
+        return -1;
+    }
+    *fd = pair[0];
+    return pid;
+}
+
+static bool send_handoff(int fd) {
+    handoff_t h = { .listeners = our_nlisteners, .metrics = our_metrics != -1 };
+    int nfds = h.listeners + h.metrics;
+    char control[CMSG_SPACE((RELOAD_MAX_LISTENERS + 1) * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { &h, sizeof(h) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = CMSG_SPACE(nfds * sizeof(int)) };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    int* fds = (int*)CMSG_DATA(cmsg);
+    memcpy(fds, our_listeners, our_nlisteners * sizeof(int));
+    if (h.metrics) {
+        fds[our_nlisteners] = our_metrics;
+    }
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(h)) {
+        return false;
+    }
+
+    char** paths = malloc(MAX_WARM_PATHS * sizeof(char*));
+    int npaths = cache_paths(paths, MAX_WARM_PATHS);
+    bool ok = true;
+    for (int i=0;i<npaths;i++) {
+        //a newline would end the path early. such files are just not warmed.
+        if (ok && strchr(paths[i], '\n') == NULL) {
+            ok = write_all(fd, paths[i], strlen(paths[i])) && write_all(fd, "\n", 1);
+        }
+        free(paths[i]);
+    }
+    free(paths);
+    return ok && write_all(fd, "\n", 1);
+}
+
+//waits for the new process's "R". false if it died, or took too long and was killed.
+static bool wait_ready(int fd, pid_t pid) {
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    char c;
+    int ready;
+    while ((ready = poll(&p, 1, RELOAD_READY_TIMEOUT_MS)) == SOCKETERROR && errno == EINTR) {
+    }
+    if (ready == 1 && read(fd, &c, 1) == 1 && c == 'R') {
+        return true;
+    }
+    if (ready == 0) {
+        log_warn("reload: pid %d not ready after %d ms, killing it", pid, RELOAD_READY_TIMEOUT_MS);
+        kill(pid, SIGKILL);
+    }
+    waitpid(pid, NULL, 0);
+    return false;
+}
+
+static void drain_and_exit(pid_t successor) {
+    long long deadline = now_ms() + RELOAD_DRAIN_MS;
+    atomic_store(&draining, true);
+    log_info("reload: pid %d is serving, draining %d connections", successor, admission_inflight());
+    while (true) {
+        int accepting = wake_acceptors();
+        int inflight = admission_inflight();
+        if (accepting == 0 && inflight == 0) {
+            break;
+        }
+        if (now_ms() >= deadline) {
+            log_warn("reload: gave up draining with %d connections still open", inflight);
+            break;
+        }
+        usleep(100 * 1000);
+    }
+    log_info("reload: drained, exiting");
+    log_flush();
+    exit(0);
+}
+
+static void* reload_thread(void* arg) {
+    sigset_t sigs;
+    int sig;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGUSR2);
+    while (sigwait(&sigs, &sig) == 0) {
+        int fd;
+        log_info("reload: %s, starting %s", sig == SIGHUP ? "SIGHUP" : "SIGUSR2", our_binary);
+        pid_t pid = spawn(&fd);
+        if (pid == SOCKETERROR) {
+            log_warn("reload: can't start a new process: %s", strerror(errno));
+            continue;
+        }
+        bool ok = send_handoff(fd) && wait_ready(fd, pid);
+        close(fd);
+        if (ok) {
+            drain_and_exit(pid);
+        }
+        log_warn("reload: pid %d didn't take over, carrying on", pid);
+    }
+    return NULL;
+}
+
+void reload_init(const int* listeners, int n, int metrics_socket, char** argv) {
+    //without -r every loop shares one listener. each socket only needs to go over once.
+    int* distinct = malloc(n * sizeof(int));
+    int ndistinct = 0;
+    for (int i=0;i<n;i++) {
+        if (ndistinct == 0 || listeners[i] != distinct[ndistinct - 1]) {
+            distinct[ndistinct++] = listeners[i];
+        }
+    }
+    our_listeners = distinct;
+    our_nlisteners = ndistinct;
+    our_metrics = metrics_socket;
+    our_argv = argv;
+    //resolved now: argv[0] may be relative, and the path must still lead to the binary after it has been replaced.
+    if (realpath(argv[0], our_binary) == NULL) {
+        snprintf(our_binary, sizeof(our_binary), "/proc/self/exe");
+    }
+
+    //no SA_RESTART: a blocked accept() or epoll_wait() has to come back with EINTR.
+    struct sigaction sa = { .sa_handler = on_wake };
+    sigemptyset(&sa.sa_mask);
+    sigaction(WAKE_SIGNAL, &sa, NULL);
+
+    if (ndistinct > RELOAD_MAX_LISTENERS) {
+        log_warn("reload: %d listeners are more than one handoff can carry, SIGHUP/SIGUSR2 disabled", ndistinct);
+        return;
+    }
+    pthread_t t;
+    pthread_create(&t, NULL, reload_thread, NULL);
+}
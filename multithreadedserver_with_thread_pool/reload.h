@@ -0,0 +1,41 @@
+#ifndef RELOAD_H_
+#define RELOAD_H_
+
+#include<stdbool.h>
+
+//zero-downtime restarts. SIGHUP or SIGUSR2 starts the binary again with the same arguments: whatever file is at argv[0] by then,
+//so a deploy that replaced it gets the new build. the old process hands it the listening sockets over a socketpair (SCM_RIGHTS):
+//they are never closed, so nobody gets a connection refused. it also sends the paths in its file cache, and the new one loads them before it says it's ready, so the switch doesn't
+//land on a cold cache. from then on the old one accepts nothing more. it answers what it has in flight with "Connection: close"
+//and exits once the last connection is gone, or after RELOAD_DRAIN_MS.
+//if the new process dies or doesn't get ready in time, the old one carries on as if nothing happened.
+#define RELOAD_HANDOFF_ENV "WEBSERVER_HANDOFF_FD"
+#define RELOAD_READY_TIMEOUT_MS 60000   //for the new process to start up (e.g. index a big docroot) and warm its cache
+#define RELOAD_DRAIN_MS 30000           //for the old process's connections to finish
+#define RELOAD_MAX_LISTENERS 250        //one SCM_RIGHTS message holds at most 253 fds
+
+// if this process was started by a reload, receives the old process's sockets and loads the paths it had cached. call once the
+// cache (and docroot index) are set up, before anything binds.
+void reload_take_over();
+
+// the old process's listeners, if we took over: returns how many and points *fds at them. 0 if we start from scratch.
+int reload_listeners(int** fds);
+
+// the old process's metrics socket, or -1.
+int reload_metrics_socket();
+
+// arms SIGHUP/SIGUSR2 (block them in every thread before calling this). listeners are what a reload hands over, argv how to start it.
+void reload_init(const int* listeners, int n, int metrics_socket, char** argv);
+
+// tells the process that started us (if one did) that we're serving, so it can stop.
+void reload_ready();
+
+// threads that accept connections register, and are woken (by a signal that interrupts whatever they are blocked in) when the
+// process starts draining. they call reload_acceptor_stopped() once they accept no more.
+void reload_register_acceptor();
+void reload_acceptor_stopped();
+
+// true once a new process has taken over and this one is on its way out.
+bool reload_draining();
+
+#endif
@@ -0,0 +1,130 @@
+//benchmark: throughput and sender CPU cost of each file send method over a localhost TCP connection.
+//usage: ./sendbench [-j] [file] [megabytes per method]
+//  -j  JSON lines (see bench.h) instead of the table
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<pthread.h>
+#include<time.h>
+#include<netinet/in.h>
+#include<sys/resource.h>
+#include<sys/stat.h>
+#include "server.h"
+#include "filesend.h"
+#include "bench.h"
+
+#define DEFAULT_FILE "../multithreadedserver/tmp/testfiles/5.txt"
+#define DEFAULT_MB 512
+
+//the receiving end just throws bytes away as fast as it can.
+static void* drain(void* arg) {
+    int sock = *(int*)arg;
+    static char sink[1 << 16];
+    while (read(sock, sink, sizeof(sink)) > 0) {
+    }
+    return NULL;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//cpu time (user + system) burnt by the calling thread only, so the drain thread doesn't skew the numbers.
+static double thread_cpu() {
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void connect_pair(int* sender, int* receiver) {
+    SA_IN addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK), .sin_port = 0 };
+    socklen_t len = sizeof(addr);
+    int listener;
+
+    check(listener = socket(AF_INET, SOCK_STREAM, 0), "socket failed");
+    check(bind(listener, (SA*)&addr, sizeof(addr)), "bind failed");
+    check(listen(listener, 1), "listen failed");
+    check(getsockname(listener, (SA*)&addr, &len), "getsockname failed");
+    check(*sender = socket(AF_INET, SOCK_STREAM, 0), "socket failed");
+    check(connect(*sender, (SA*)&addr, sizeof(addr)), "connect failed");
+    check(*receiver = accept(listener, NULL, NULL), "accept failed");
+    close(listener);
+}
+
+int check(int exp, const char* msg) {
+    if (exp == SOCKETERROR) {
+        perror(msg);
+        exit(1);
+    }
+    return exp;
+}
+
+int main(int argc, char** argv) {
+    bool json = argc > 1 && strcmp(argv[1], "-j") == 0;
+    argc -= json;
+    argv += json;
+    const char* path = argc > 1 ? argv[1] : DEFAULT_FILE;
+    long long target = (long long)(argc > 2 ? atol(argv[2]) : DEFAULT_MB) << 20;
+    const char* names[] = { "sendfile", "splice", "copy", "mmap" };
+    char buffer[BUFSIZE];
+    struct stat st;
+
+    int file_fd = open(path, O_RDONLY);
+    check(file_fd, path);
+    check(fstat(file_fd, &st), path);
+    //mmap is what the cache does: map once up front, then every send comes straight from the mapping.
+    char* mapped = filesend_map(file_fd, st.st_size);
+
+    if (!json) {
+        printf("%-10s %12s %14s\n", "method", "MB/s", "cpu s/GB");
+    }
+    for (int m=0;m<4;m++) {
+        int sock, receiver;
+        pthread_t t;
+        long long sent = 0;
+
+        connect_pair(&sock, &receiver);
+        pthread_create(&t, NULL, drain, &receiver);
+        parse_send_method(names[m], &send_method);
+
+        //one sender for the whole run, like a keep-alive connection: splice keeps its pipe from one file to the next.
+        file_sender_t sender;
+        filesend_setup(&sender);
+        double start = now(), cpu_start = thread_cpu();
+        while (sent < target) {
+            if (send_method == SEND_MMAP && mapped != NULL) {
+                filesend_init_memory(&sender, mapped, st.st_size);
+            } else if (!filesend_init(&sender, file_fd, buffer)) {
+                fprintf(stderr, "%s: send failed\n", names[m]);
+                exit(1);
+            }
+            if (filesend(&sender, sock) != SEND_DONE) {
+                fprintf(stderr, "%s: send failed\n", names[m]);
+                exit(1);
+            }
+            sent += sender.size;
+        }
+        filesend_release(&sender);
+        double elapsed = now() - start, cpu = thread_cpu() - cpu_start;
+
+        close(sock);
+        pthread_join(t, NULL);
+        close(receiver);
+        double mbps = sent / elapsed / (1 << 20), cpu_per_gb = cpu / (sent / (double)(1 << 30));
+        if (json) {
+            char name[64];
+            snprintf(name, sizeof(name), "%s throughput", names[m]);
+            bench_json("send", name, mbps, "MB/s", false);
+            snprintf(name, sizeof(name), "%s cpu", names[m]);
+            bench_json("send", name, cpu_per_gb, "s/GB", true);
+        } else {
+            printf("%-10s %12.1f %14.3f\n", names[m], mbps, cpu_per_gb);
+        }
+    }
+    return 0;
+}
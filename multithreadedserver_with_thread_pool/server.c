@@ -1,76 +1,318 @@
+#define _GNU_SOURCE
 #include<stdio.h>
 #include<stdlib.h>
 #include<string.h>
 #include<unistd.h>
+#include<errno.h>
 #include<sys/socket.h>
 #include<arpa/inet.h>
 #include<stdbool.h>
 #include<limits.h>
 #include<pthread.h>
-#include "myqueue.h"
+#include<signal.h>
+#include<getopt.h>
+#include<fcntl.h>
+#include<sys/resource.h>
+#include<sched.h>
+#include "server.h"
+#include "workpool.h"
+#include "eventloop.h"
+#include "filesend.h"
+#include "filecache.h"
+#include "connection.h"
+#include "uring.h"
+#include "tls.h"
+#include "log.h"
+#include "slab.h"
+#include "metrics.h"
+#include "docroot.h"
+#include "admission.h"
+#include "encoding.h"
+#include "reload.h"
+#include "iopool.h"
+#include "ratelimit.h"
 
-#define SERVERPORT 8989
-#define BUFSIZE 4096
-#define SOCKETERROR (-1)
-#define SERVER_BACKLOG 100
-#define THREAD_POOL_SIZE 20
+//a pool shard: a listener and the worker pool (see workpool.c) its accept loop feeds.
+//without -r there is a single shard on the one listener. with -r there is one per CPU, and its acceptor and workers are all pinned
+//to that CPU, so a connection is accepted, queued and served without leaving the core (or its caches).
+typedef struct shard {
+    int index;          //-1: not pinned
+    int server_socket;
+    workpool_t* pool;
+} shard_t;
 
-//thread pool
-pthread_t pool[THREAD_POOL_SIZE];
+int listen_backlog = SERVER_BACKLOG;
 
-//mutex for avoiding race conditions
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static shard_t* shards;
+static atomic_int nshards;   //published once the shards are set up
 
-//condition variable. a condition variable allows threads to wait till some event occurs. This event is usually a pre-requisite for the thread to do it's work.
-//This avoids busy waiting and burning up CPU cycles doing nothing. The threads are suspended till this event occurs.
-//Each thread waits till another thread (usually the main thread) calls signal().
-pthread_cond_t condition_var = PTHREAD_COND_INITIALIZER;
+//how connections are served. picked at startup with -m.
+typedef enum {
+    MODE_POOL,      //blocking reads/writes, one pool thread per in-flight connection
+    MODE_EPOLL,     //non-blocking, edge-triggered epoll reactors (see eventloop.c)
+    MODE_URING,     //completion-based io_uring rings (see uring.c)
+} server_mode_t;
 
-typedef struct sockaddr_in SA_IN;
-typedef struct sockaddr SA;
+void handle_connection(int client_socket, struct client* client);
+void* accept_loop(void* arg);
+void* stats_thread(void* arg);
+void write_gauges(FILE* out);
 
-void * handle_connection(void* p_client_socket);
-int check(int exp, const char* msg);
-void* thread_function(void* arg);
+static void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-m pool|epoll|uring] [-t threads] [-r] [-w min:max] [-p port] [-s sendfile|splice|copy|mmap] [-c cache_mb] [-M metrics_port|/socket/path] [-d docroot] [-L max_inflight] [-q max_queued] [-b backlog] [-z compress_threads] [-e] [-A max_age] [-T cert.pem] [-K key.pem] [-o io_threads[:depth]] [-D io_delay_ms] [-R requests_per_s[:burst]] [-B conn_kb_per_s[:client_kb_per_s]] [-W addr[/bits]=weight]... [-F]\n", prog);
+    exit(1);
+}
 
 int main(int argc, char** argv) {
-    int server_socket, client_socket, addr_size;
-    SA_IN server_addr, client_addr;
+    server_mode_t mode = MODE_POOL;
+    int loop_threads = 0;
+    bool reuseport = false;
+    int min_workers = POOL_MIN_WORKERS;
+    int max_workers = POOL_MAX_WORKERS;
+    int port = SERVERPORT;
+    long cache_mb = CACHE_DEFAULT_MB;
+    const char* metrics_at = NULL;
+    const char* docroot = NULL;
+    const char* tls_cert = NULL;
+    const char* tls_key = NULL;
+    int compress_threads = ENC_DEFAULT_THREADS;
+    int io_threads = IOPOOL_DEFAULT_THREADS;
+    int io_depth = IOPOOL_DEFAULT_DEPTH;
+    bool fair = false;
+    int opt;
+    pthread_t stats;
+    sigset_t sigs;
 
-    //create the thread pool
-    for (int i=0;i<THREAD_POOL_SIZE;i++) {
-        pthread_create(&pool[i], NULL, thread_function, NULL);
+    while ((opt = getopt(argc, argv, "m:t:rw:p:s:c:M:d:L:q:b:z:eA:T:K:o:D:R:B:W:F")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "pool") == 0) {
+                    mode = MODE_POOL;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    mode = MODE_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    mode = MODE_URING;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                if ((loop_threads = atoi(optarg)) <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'r':
+                reuseport = true;
+                break;
+            case 'w':
+                if (!workpool_parse_size(optarg, &min_workers, &max_workers)) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'p':
+                if ((port = atoi(optarg)) <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 's':
+                if (!parse_send_method(optarg, &send_method)) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'c':
+                if ((cache_mb = atol(optarg)) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'M':
+                metrics_at = optarg;
+                break;
+            case 'd':
+                docroot = optarg;
+                break;
+            case 'L':
+                if ((admission_max_inflight = atoi(optarg)) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'q':
+                if ((admission_max_queued = atoi(optarg)) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'b':
+                if ((listen_backlog = atoi(optarg)) <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'z':
+                if ((compress_threads = atoi(optarg)) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'e':
+                cache_content_etags = true;
+                break;
+            case 'A':
+                if ((connection_max_age = atoi(optarg)) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'T':
+                tls_cert = optarg;
+                break;
+            case 'K':
+                tls_key = optarg;
+                break;
+            case 'o':
+                //"threads" or "threads:depth"
+                if (sscanf(optarg, "%d:%d", &io_threads, &io_depth) < 1 || io_threads < 0 || io_depth <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'D':
+                if ((iopool_latency_ms = atoi(optarg)) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'R':
+                if (!ratelimit_parse_rate(optarg)) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'B':
+                if (!ratelimit_parse_egress(optarg)) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'W':
+                if (!ratelimit_add_weight(optarg)) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'F':
+                fair = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
     }
-    
-    check((server_socket = socket(AF_INET, SOCK_STREAM, 0)), "Failed to create socket");
 
-    //initialize the address struct
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SERVERPORT);
+    if (tls_key != NULL && tls_cert == NULL) {
+        usage(argv[0]);
+    }
+    if (tls_cert != NULL && mode == MODE_URING) {
+        fprintf(stderr, "TLS (-T) works with -m pool and -m epoll only\n");
+        exit(1);
+    }
+    //uring's multishot accept doesn't say who connected, and its sockets have no fd to set a pacing rate on.
+    if ((ratelimit_rate > 0 || ratelimit_conn_bps > 0 || ratelimit_client_bps > 0) && mode == MODE_URING) {
+        fprintf(stderr, "rate limits (-R, -B) work with -m pool and -m epoll only\n");
+        exit(1);
+    }
+    if (fair && mode != MODE_POOL) {
+        fprintf(stderr, "fair shares (-F) work with -m pool only\n");
+        exit(1);
+    }
 
-    check(bind(server_socket, (SA*)&server_addr, sizeof(server_addr)), "Bind Failed!");
-    check(listen(server_socket, SERVER_BACKLOG), "Listen Failed!");
+    //a client that hangs up mid-response must not kill the whole server.
+    signal(SIGPIPE, SIG_IGN);
 
-    while(true) {
-        printf("Waiting for connections...\n");
-        addr_size = sizeof(SA_IN);
-        check(client_socket = accept(server_socket, (SA*)&client_addr, (socklen_t*)&addr_size), "accept failed");
-        printf("Connected!\n");
+    //SIGUSR1 dumps the counters, SIGHUP and SIGUSR2 reload. block them before any other thread exists so only stats_thread and
+    //reload.c's thread ever receive them.
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    pthread_create(&stats, NULL, stats_thread, NULL);
+    log_init(STDOUT_FILENO);
+    //every mode holds an fd per connection, the pool's queued ones included. -L has to fit in whatever we end up with.
+    raise_fd_limit();
+    admission_fit_fd_limit(send_method == SEND_SPLICE ? 4 : 2);
+    if (tls_cert != NULL) {
+        tls_init(tls_cert, tls_key);
+    }
 
-        //put the connection information somewhere where any thread can find it once it becomes available.
+    cache_init(cache_mb);
+    encoding_init(compress_threads);
+    iopool_init(io_threads, io_depth);
+    if (docroot != NULL) {
+        docroot_init(docroot);
+    }
+    reload_take_over();
+    if (metrics_at != NULL) {
+        metrics_serve(metrics_at, write_gauges);
+    }
 
-        int *pclient = malloc(sizeof(int));
-        *pclient = client_socket;
+    //-t counts event loop threads, or pool shards with -r. by default -r runs one of each per CPU.
+    if (loop_threads == 0) {
+        loop_threads = reuseport ? shard_cpus() : EVENT_LOOP_THREADS;
+    }
+    //after a reload the listeners are the old process's, -p or not. how many there are decides -r and, with it, -t: a handed-over
+    //SO_REUSEPORT socket nobody accepts from would strand the connections the kernel gives it.
+    int* taken;
+    int ntaken = reload_listeners(&taken);
+    if (ntaken > 0) {
+        if (ntaken != (reuseport ? loop_threads : 1)) {
+            log_warn("reload: took over %d listener%s, running %d %s", ntaken, ntaken > 1 ? "s" : "", ntaken > 1 ? ntaken : loop_threads,
+                     ntaken > 1 ? "-r shards" : "threads without -r");
+        }
+        reuseport = ntaken > 1;
+        if (reuseport) {
+            loop_threads = ntaken;
+        }
+    }
+    //loop (or shard) i accepts from listeners[i]. without -r that's the same socket for all of them.
+    int* listeners = malloc(loop_threads * sizeof(int));
+    listeners[0] = ntaken > 0 ? taken[0] : open_listener(port, reuseport);
+    for (int i=1;i<loop_threads;i++) {
+        listeners[i] = !reuseport ? listeners[0] : ntaken > 0 ? taken[i] : open_listener(port, true);
+    }
+    reload_init(listeners, loop_threads, metrics_listener(), argv);
 
-        pthread_mutex_lock(&mutex);
-        enqueue(pclient);
-        //wakes up one of the threads. the woken up thread will handle the task.
-        pthread_cond_signal(&condition_var);
-        pthread_mutex_unlock(&mutex);
+    if (mode == MODE_EPOLL) {
+        ratelimit_init(0);
+        reload_ready();
+        run_event_loop(listeners, loop_threads, reuseport);
+        return 0;
+    }
+    if (mode == MODE_URING) {
+        ratelimit_init(0);
+        reload_ready();
+        run_uring(listeners, loop_threads, reuseport);
+        return 0;
     }
 
-    return 0;
+    //with -r every shard gets an even share of the worker limits.
+    int n = reuseport ? loop_threads : 1;
+    if (reuseport) {
+        min_workers = (min_workers + n - 1) / n;
+        max_workers = (max_workers + n - 1) / n;
+        if (max_workers < SHARD_MIN_WORKERS) {
+            max_workers = SHARD_MIN_WORKERS;
+        }
+    }
+    //the fair shares are of every worker the shards may run between them.
+    ratelimit_init(fair ? max_workers * n : 0);
+    shards = calloc(n, sizeof(shard_t));
+    for (int i=0;i<n;i++) {
+        pthread_t t;
+        shards[i].index = reuseport ? i : -1;
+        shards[i].server_socket = listeners[i];
+        //create the shard's thread pool
+        shards[i].pool = workpool_create(min_workers, max_workers, shards[i].index, handle_connection);
+        if (i > 0) {
+            pthread_create(&t, NULL, accept_loop, &shards[i]);
+        }
+    }
+    //only now that every shard has a pool may the stats and metrics threads look at them.
+    nshards = n;
+    log_info("Serving with %d pool shard%s of %d-%d workers...", nshards, nshards > 1 ? "s" : "", min_workers, max_workers);
+    reload_ready();
+    //the main thread accepts for shard 0. when a reload stops it, the workers carry on until the process exits (see reload.c).
+    accept_loop(&shards[0]);
+    pthread_exit(NULL);
 }
 
 int check(int exp, const char* msg) {
@@ -81,68 +323,262 @@ int check(int exp, const char* msg) {
     return exp;
 }
 
-void* thread_function(void* arg) {
-    while(true) {
-        int* pclient;
-        pthread_mutex_lock(&mutex);
-//the thread waits till another thread calls signal(). so, the thread stops just before dequeuing any task.
-//once a task is received, the main thread will call signal(), which will wake up one of the threads which will start executing from the line just after wait. here, the thread will start from dequeue().
-//when the thread is suspended, it also releases the lock. that's why the mutex was passed.
-//when signal is called, the suspended thread first re-acquires the lock before wait() returns i.e the thread only starts executing AFTER re-acquiring the lock.
-//call wait ONLY IF there are no new connections coming in AND there is no existing work in the queue.
-        if ((pclient = dequeue()) == NULL) {
-            pthread_cond_wait(&condition_var, &mutex);
-            pclient = dequeue();
-        }
-        pthread_mutex_unlock(&mutex);
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
 
-        if (pclient != NULL) {
-            handle_connection(pclient);
-        }
+int open_listener(int port, bool reuseport) {
+    int server_socket;
+    SA_IN server_addr;
+
+    check((server_socket = socket(AF_INET, SOCK_STREAM, 0)), "Failed to create socket");
+    //lets us rebind straight away after a restart instead of waiting out TIME_WAIT from the last benchmark run.
+    int reuse = 1;
+    check(setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)), "setsockopt failed");
+    if (reuseport) {
+        check(setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)), "setsockopt(SO_REUSEPORT) failed");
     }
+
+    //initialize the address struct
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    check(bind(server_socket, (SA*)&server_addr, sizeof(server_addr)), "Bind Failed!");
+    check(listen(server_socket, listen_backlog), "Listen Failed!");
+    return server_socket;
 }
 
+//the CPUs we're allowed on, grouped by NUMA node so consecutive shards fill up one node before moving on to the next.
+//a pinned shard's threads first-touch all of its memory (connections, buffers, stacks), so it ends up on the shard's own node.
+static int cpu_list[CPU_SETSIZE];
+static int cpu_count;
+static pthread_once_t cpu_list_once = PTHREAD_ONCE_INIT;
+
+static void add_cpu(int cpu, const cpu_set_t* allowed, cpu_set_t* added) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, allowed) && !CPU_ISSET(cpu, added)) {
+        CPU_SET(cpu, added);
+        cpu_list[cpu_count++] = cpu;
+    }
+}
 
-void * handle_connection(void* p_client_socket) {
-    int client_socket = *((int*)p_client_socket);
-    free(p_client_socket);
-    char buffer[BUFSIZE];
-    size_t bytes_read;
-    int msgsize = 0;
-    char actualpath[PATH_MAX+1];
+static void load_cpu_list() {
+    cpu_set_t allowed, added;
+    char path[64];
 
-    while((bytes_read = read(client_socket, buffer+msgsize, sizeof(buffer) - msgsize - 1)) > 0) {
-        msgsize += bytes_read;
-        if (msgsize > BUFSIZE - 1 || buffer[msgsize-1] == '\n'){
+    CPU_ZERO(&added);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == SOCKETERROR) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+    //each node's cpulist looks like "0-3,8-11".
+    for (int node=0;;node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* f = fopen(path, "r");
+        if (f == NULL) {
             break;
         }
+        int first, last, c;
+        while (fscanf(f, "%d", &first) == 1) {
+            last = first;
+            if ((c = fgetc(f)) == '-' && fscanf(f, "%d", &last) == 1) {
+                c = fgetc(f);
+            }
+            for (int cpu=first;cpu<=last;cpu++) {
+                add_cpu(cpu, &allowed, &added);
+            }
+            if (c != ',') {
+                break;
+            }
+        }
+        fclose(f);
+    }
+    //no NUMA information (or holes in the node numbering): whatever is left goes at the end.
+    for (int cpu=0;cpu<CPU_SETSIZE;cpu++) {
+        add_cpu(cpu, &allowed, &added);
+    }
+}
+
+int shard_cpus() {
+    pthread_once(&cpu_list_once, load_cpu_list);
+    return cpu_count;
+}
+
+void pin_to_shard(int shard, int listener) {
+    cpu_set_t set;
+    int cpu = cpu_list[shard % shard_cpus()];
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (listener != -1) {
+        //SO_REUSEPORT picks a listener by hashing the 4-tuple. listeners tagged with the CPU the packet came in on score higher,
+        //so where the NIC spreads flows across queues, a connection stays on the core that took its interrupt.
+        setsockopt(listener, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+    }
+}
+
+void* stats_thread(void* arg) {
+    sigset_t sigs;
+    int sig;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    while (sigwait(&sigs, &sig) == 0) {
+        cache_stats_t cs;
+        cache_get_stats(&cs);
+        log_info("cache: hits=%ld misses=%ld evictions=%ld invalidations=%ld entries=%ld bytes=%ld mapped=%ld",
+                 cs.hits, cs.misses, cs.evictions, cs.invalidations, cs.entries, cs.bytes, cs.mapped);
+        encoding_stats_t es;
+        encoding_get_stats(&es);
+        log_info("encoding: compressed=%ld incompressible=%ld dropped=%ld bytes_in=%ld bytes_out=%ld",
+                 es.compressed, es.incompressible, es.dropped, es.bytes_in, es.bytes_out);
+        iopool_stats_t is;
+        iopool_get_stats(&is);
+        log_info("io: threads=%ld queued=%ld busy=%ld offloaded=%ld inline=%ld", is.threads, is.queued, is.busy, is.offloaded, is.inline_);
+        log_info("log: dropped=%llu", (unsigned long long)log_dropped());
+        if (docroot_enabled) {
+            docroot_stats_t ds;
+            docroot_get_stats(&ds);
+            log_info("docroot: files=%ld watches=%ld rescans=%ld", ds.files, ds.watches, ds.rescans);
+        }
+        log_info("admission: inflight=%d (max %d) shed inflight=%ld queue=%ld codel=%ld fair=%ld", admission_inflight(), admission_max_inflight,
+                 admission_shed(SHED_INFLIGHT), admission_shed(SHED_QUEUE), admission_shed(SHED_CODEL), admission_shed(SHED_FAIR));
+        if (ratelimit_enabled()) {
+            ratelimit_stats_t rs;
+            ratelimit_get_stats(&rs);
+            log_info("clients: tracked=%ld untracked=%ld limited=%ld deferred=%ld deferrals=%ld",
+                     rs.clients, rs.untracked, rs.limited, rs.deferred, rs.deferrals);
+        }
+        slab_stats_t ss;
+        slab_get_stats(&ss);
+        log_info("connections: slabs=%ld in_use=%ld free=%ld peak=%ld bytes=%ld",
+                 ss.slabs, ss.in_use, ss.capacity - ss.in_use, ss.peak, ss.bytes);
+        for (int i=0;i<nshards;i++) {
+            workpool_log_stats(shards[i].pool);
+        }
     }
-    check(bytes_read, "recv_error");
-    buffer[msgsize-1] = 0;
+    return NULL;
+}
 
-    printf("REQUEST: %s\n", buffer);
-    fflush(stdout);
+//what metrics.c can't count itself, read fresh on every scrape.
+void write_gauges(FILE* out) {
+    cache_stats_t cs;
+    slab_stats_t ss;
+    cache_get_stats(&cs);
+    slab_get_stats(&ss);
 
-    if (realpath(buffer, actualpath) == NULL) {
-        printf("ERROR(bad path): %s\n", buffer);
-        close(client_socket);
-        return NULL;
+    fprintf(out, "# HELP webserver_cache_lookups_total File cache lookups.\n# TYPE webserver_cache_lookups_total counter\n");
+    fprintf(out, "webserver_cache_lookups_total{result=\"hit\"} %ld\nwebserver_cache_lookups_total{result=\"miss\"} %ld\n", cs.hits, cs.misses);
+    fprintf(out, "# HELP webserver_cache_bytes File contents held by the cache, on the heap or mapped.\n# TYPE webserver_cache_bytes gauge\n");
+    fprintf(out, "webserver_cache_bytes{kind=\"heap\"} %ld\nwebserver_cache_bytes{kind=\"mapped\"} %ld\n", cs.bytes, cs.mapped);
+    encoding_stats_t es;
+    encoding_get_stats(&es);
+    fprintf(out, "# HELP webserver_compressions_total Compressed copies made on the fly, by outcome.\n# TYPE webserver_compressions_total counter\n");
+    fprintf(out, "webserver_compressions_total{result=\"kept\"} %ld\nwebserver_compressions_total{result=\"incompressible\"} %ld\n", es.compressed, es.incompressible);
+    fprintf(out, "webserver_compressions_total{result=\"dropped\"} %ld\n", es.dropped);
+    fprintf(out, "# HELP webserver_compression_bytes_total Bytes fed to and produced by the compressor threads.\n# TYPE webserver_compression_bytes_total counter\n");
+    fprintf(out, "webserver_compression_bytes_total{direction=\"in\"} %ld\nwebserver_compression_bytes_total{direction=\"out\"} %ld\n", es.bytes_in, es.bytes_out);
+    iopool_stats_t is;
+    iopool_get_stats(&is);
+    fprintf(out, "# HELP webserver_io_queue_depth Cache misses waiting for an I/O thread.\n# TYPE webserver_io_queue_depth gauge\nwebserver_io_queue_depth %ld\n", is.queued);
+    fprintf(out, "# HELP webserver_io_threads_busy I/O threads loading a file right now.\n# TYPE webserver_io_threads_busy gauge\nwebserver_io_threads_busy %ld\n", is.busy);
+    fprintf(out, "# HELP webserver_connection_objects Connection objects held by the epoll/uring slabs.\n# TYPE webserver_connection_objects gauge\n");
+    fprintf(out, "webserver_connection_objects{state=\"in_use\"} %ld\nwebserver_connection_objects{state=\"free\"} %ld\n", ss.in_use, ss.capacity - ss.in_use);
+    if (docroot_enabled) {
+        docroot_stats_t ds;
+        docroot_get_stats(&ds);
+        fprintf(out, "# HELP webserver_docroot_files Files in the docroot index.\n# TYPE webserver_docroot_files gauge\nwebserver_docroot_files %ld\n", ds.files);
+        fprintf(out, "# HELP webserver_docroot_rescans_total Full rescans after the inotify queue overflowed.\n# TYPE webserver_docroot_rescans_total counter\n");
+        fprintf(out, "webserver_docroot_rescans_total %ld\n", ds.rescans);
+    }
+    fprintf(out, "# HELP webserver_inflight_connections Admitted connections not yet closed.\n# TYPE webserver_inflight_connections gauge\n");
+    fprintf(out, "webserver_inflight_connections %d\n", admission_inflight());
+    fprintf(out, "# HELP webserver_connections_shed_total Connections answered with 503 and closed, by reason.\n# TYPE webserver_connections_shed_total counter\n");
+    fprintf(out, "webserver_connections_shed_total{reason=\"inflight\"} %ld\n", admission_shed(SHED_INFLIGHT));
+    fprintf(out, "webserver_connections_shed_total{reason=\"queue\"} %ld\n", admission_shed(SHED_QUEUE));
+    fprintf(out, "webserver_connections_shed_total{reason=\"codel\"} %ld\n", admission_shed(SHED_CODEL));
+    fprintf(out, "webserver_connections_shed_total{reason=\"fair\"} %ld\n", admission_shed(SHED_FAIR));
+    if (ratelimit_enabled()) {
+        ratelimit_stats_t rs;
+        ratelimit_get_stats(&rs);
+        fprintf(out, "# HELP webserver_clients_tracked Client addresses with an entry for the per-client limits.\n# TYPE webserver_clients_tracked gauge\n");
+        fprintf(out, "webserver_clients_tracked %ld\n", rs.clients);
+        fprintf(out, "# HELP webserver_deferred_connections Pool mode: connections waiting for their client's fair share of the workers.\n");
+        fprintf(out, "# TYPE webserver_deferred_connections gauge\nwebserver_deferred_connections %ld\n", rs.deferred);
+    }
+    fprintf(out, "# HELP webserver_log_dropped_total Log lines dropped because a ring was full.\n# TYPE webserver_log_dropped_total counter\n");
+    fprintf(out, "webserver_log_dropped_total %llu\n", (unsigned long long)log_dropped());
+    if (nshards > 0) {
+        fprintf(out, "# HELP webserver_pool_workers Pool worker threads.\n# TYPE webserver_pool_workers gauge\n");
+        for (int i=0;i<nshards;i++) {
+            fprintf(out, "webserver_pool_workers{shard=\"%d\",state=\"busy\"} %d\n", i, atomic_load(&shards[i].pool->nworkers) - atomic_load(&shards[i].pool->nidle));
+            fprintf(out, "webserver_pool_workers{shard=\"%d\",state=\"idle\"} %d\n", i, atomic_load(&shards[i].pool->nidle));
+        }
+        fprintf(out, "# HELP webserver_pool_queued Accepted connections waiting for a worker.\n# TYPE webserver_pool_queued gauge\n");
+        for (int i=0;i<nshards;i++) {
+            fprintf(out, "webserver_pool_queued{shard=\"%d\"} %d\n", i, workpool_queued(shards[i].pool));
+        }
+        fprintf(out, "# HELP webserver_pool_overloaded 1 while CoDel sees a standing queue and sheds.\n# TYPE webserver_pool_overloaded gauge\n");
+        for (int i=0;i<nshards;i++) {
+            fprintf(out, "webserver_pool_overloaded{shard=\"%d\"} %d\n", i, (int)atomic_load(&shards[i].pool->overloaded));
+        }
     }
-    sleep(1);   //simulate intensive I/O task.
+}
+
+void* accept_loop(void* arg) {
+    shard_t* shard = arg;
+    int client_socket, addr_size;
+    SA_IN client_addr;
 
-    FILE* fp = fopen(actualpath, "r");
-    if (fp == NULL) {
-        printf("ERROR(open): %s\n", buffer);
-        close(client_socket);
-        return NULL;
+    if (shard->index != -1) {
+        pin_to_shard(shard->index, shard->server_socket);
     }
+    reload_register_acceptor();
+    bool starved = false;
+    while(!reload_draining()) {
+        log_debug("Waiting for connections...");
+        addr_size = sizeof(SA_IN);
+        client_socket = accept(shard->server_socket, (SA*)&client_addr, (socklen_t*)&addr_size);
+        if (client_socket == SOCKETERROR && (errno == EINTR || errno == ECONNABORTED)) {
+            continue;   //maybe a reload woke us: look at reload_draining() again
+        }
+        if (client_socket == SOCKETERROR && (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)) {
+            //out of fds (or kernel memory) for now. the backlog holds the connections until closing ones give some back.
+            if (!starved) {
+                log_warn("accept failed: %s, backing off", strerror(errno));
+                starved = true;
+            }
+            usleep(ACCEPT_BACKOFF_MS * 1000);
+            continue;
+        }
+        check(client_socket, "accept failed");
+        starved = false;
+        log_debug("Connected!");
+        metrics_count(M_ACCEPTED, 1);
+        if (!admission_admit()) {
+            admission_reject(client_socket, SHED_INFLIGHT);
+            continue;
+        }
 
-    while ((bytes_read = fread(buffer, 1, BUFSIZE, fp)) > 0) {
-        printf("sending %zu bytes\n", bytes_read);
-        write(client_socket, buffer, bytes_read);
+        workpool_submit(shard->pool, client_socket, ratelimit_attach(client_addr.sin_addr.s_addr));
     }
-    close(client_socket);
-    fclose(fp);
-    printf("closing connection\n");
+    reload_acceptor_stopped();
     return NULL;
-}
\ No newline at end of file
+}
+
+void handle_connection(int client_socket, struct client* client) {
+    //~8KB of buffers. fine on a pool thread's stack.
+    connection_t conn;
+
+    connection_init(&conn, client_socket, true);
+    conn.client = client;
+    //the socket is blocking, so this only comes back once the client is done with the connection.
+    while (connection_run(&conn) != CONN_CLOSE) {
+    }
+    connection_close(&conn);
+    log_debug("closing connection");
+}
@@ -0,0 +1,37 @@
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include<stdbool.h>
+#include<sys/socket.h>
+#include<arpa/inet.h>
+
+#define SERVERPORT 8989
+#define BUFSIZE 4096
+#define SOCKETERROR (-1)
+#define SERVER_BACKLOG 511      //default for -b. deep enough to ride out a burst, shallow enough that admission control sees the load
+#define ACCEPT_BACKOFF_MS 10    //how long the pool's acceptor waits after accept() ran out of fds before it tries again
+#define SHARD_MIN_WORKERS 4     //-r splits the pool limits between CPUs, but lets each grow to at least this many workers
+
+typedef struct sockaddr_in SA_IN;
+typedef struct sockaddr SA;
+
+extern int listen_backlog;
+
+// exits the program with the error message if exp is SOCKETERROR, otherwise returns exp.
+int check(int exp, const char* msg);
+
+// lifts the soft RLIMIT_NOFILE to the hard limit. every connection is a file descriptor, so the default (usually 1024) caps us long before epoll or io_uring do.
+void raise_fd_limit();
+
+// creates a socket listening on port. with reuseport every call gets its own socket on the same port, and the kernel
+// spreads incoming connections between them so each shard can accept on its own.
+int open_listener(int port, bool reuseport);
+
+// how many CPUs we may run on, i.e. how many shards -r starts by default.
+int shard_cpus();
+
+// pins the calling thread to the CPU of shard i (wrapping around). CPUs are handed out NUMA node by node.
+// if listener isn't -1, it's the shard's own SO_REUSEPORT socket and the kernel is asked to prefer it for connections arriving on that CPU.
+void pin_to_shard(int shard, int listener);
+
+#endif
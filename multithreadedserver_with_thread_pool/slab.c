@@ -0,0 +1,67 @@
+#include<stdlib.h>
+#include<stdio.h>
+#include "slab.h"
+
+static _Atomic(slab_t*) slabs;
+
+//adds a chunk's worth of objects to the free list. chunks are never given back: the memory is kept for the next burst.
+static void grow(slab_t* s) {
+    char* chunk = aligned_alloc(64, s->object_size * SLAB_CHUNK_OBJECTS);
+    if (chunk == NULL) {
+        perror("slab chunk allocation failed");
+        exit(1);
+    }
+    for (int i=SLAB_CHUNK_OBJECTS-1;i>=0;i--) {
+        void* obj = chunk + i * s->object_size;
+        *(void**)obj = s->free_list;
+        s->free_list = obj;
+    }
+    atomic_fetch_add_explicit(&s->capacity, SLAB_CHUNK_OBJECTS, memory_order_relaxed);
+}
+
+void slab_init(slab_t* s, size_t object_size) {
+    //keep every object 64-byte aligned so neighbours don't share cache lines.
+    s->object_size = (object_size + 63) & ~(size_t)63;
+    s->free_list = NULL;
+    atomic_init(&s->in_use, 0);
+    atomic_init(&s->capacity, 0);
+    atomic_init(&s->peak, 0);
+    grow(s);
+
+    s->next = atomic_load(&slabs);
+    while (!atomic_compare_exchange_weak(&slabs, &s->next, s)) {
+    }
+}
+
+void* slab_alloc(slab_t* s) {
+    if (s->free_list == NULL) {
+        grow(s);
+    }
+    void* obj = s->free_list;
+    s->free_list = *(void**)obj;
+    //single writer, so a plain load + store is enough to keep the counters right.
+    size_t used = atomic_load_explicit(&s->in_use, memory_order_relaxed) + 1;
+    atomic_store_explicit(&s->in_use, used, memory_order_relaxed);
+    if (used > atomic_load_explicit(&s->peak, memory_order_relaxed)) {
+        atomic_store_explicit(&s->peak, used, memory_order_relaxed);
+    }
+    return obj;
+}
+
+void slab_free(slab_t* s, void* obj) {
+    *(void**)obj = s->free_list;
+    s->free_list = obj;
+    atomic_store_explicit(&s->in_use, atomic_load_explicit(&s->in_use, memory_order_relaxed) - 1, memory_order_relaxed);
+}
+
+void slab_get_stats(slab_stats_t* stats) {
+    *stats = (slab_stats_t){ 0 };
+    for (slab_t* s = atomic_load(&slabs); s != NULL; s = s->next) {
+        size_t capacity = atomic_load_explicit(&s->capacity, memory_order_relaxed);
+        stats->slabs++;
+        stats->in_use += atomic_load_explicit(&s->in_use, memory_order_relaxed);
+        stats->capacity += capacity;
+        stats->peak += atomic_load_explicit(&s->peak, memory_order_relaxed);
+        stats->bytes += capacity * s->object_size;
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include<stddef.h>
+#include<stdatomic.h>
+
+//fixed-size object allocator for connections. objects are carved out of big chunks and recycled through a free list, so once a server
+//has seen its peak number of connections, accepting and closing one never touches malloc.
+//a slab belongs to one thread (an event loop allocates and frees its own connections) and takes no locks. the counters are atomics
+//only so the stats thread can read them.
+#define SLAB_CHUNK_OBJECTS 64
+
+typedef struct slab {
+    size_t object_size;
+    void* free_list;            //next pointer lives in the first bytes of each free object
+    atomic_size_t in_use;
+    atomic_size_t capacity;     //objects carved so far
+    atomic_size_t peak;
+    struct slab* next;          //all slabs, for the stats
+} slab_t;
+
+typedef struct slab_stats {
+    long slabs;
+    long in_use;
+    long capacity;
+    long peak;
+    long bytes;
+} slab_stats_t;
+
+// sets s up for objects of object_size bytes and preallocates the first chunk.
+void slab_init(slab_t* s, size_t object_size);
+void* slab_alloc(slab_t* s);
+void slab_free(slab_t* s, void* obj);
+
+// totals over every slab in the process.
+void slab_get_stats(slab_stats_t* stats);
+
+#endif
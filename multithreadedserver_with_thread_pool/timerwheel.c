@@ -0,0 +1,135 @@
+#include<string.h>
+#include<time.h>
+#include "timerwheel.h"
+
+#define LEVEL_SHIFT(level) (WHEEL_BITS * (level))
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+#define MAX_DELTA ((1ULL << LEVEL_SHIFT(WHEEL_LEVELS)) - 1)
+
+uint64_t wheel_clock_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void wheel_init(timer_wheel_t* w) {
+    memset(w, 0, sizeof(*w));
+    w->now_ms = wheel_clock_ms();
+    w->tick = w->now_ms / WHEEL_TICK_MS;
+}
+
+//files t under the coarsest level whose slots are still finer than the time it has left. it moves down from there as the
+//wheels turn (see run_slot()), landing in level 0 in time for its tick.
+static void insert(timer_wheel_t* w, wheel_timer_t* t) {
+    uint64_t delta = t->expires - w->tick;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        t->expires = w->tick + delta;
+    }
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= 1ULL << LEVEL_SHIFT(level + 1)) {
+        level++;
+    }
+    int index = (t->expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    wheel_timer_t** head = &w->slots[level][index];
+    t->next = *head;
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = head;
+    *head = t;
+    t->slot = level * WHEEL_SLOTS + index;
+    w->occupied[level] |= 1ULL << index;
+    w->count++;
+}
+
+static void unlink_timer(timer_wheel_t* w, wheel_timer_t* t) {
+    int level = t->slot / WHEEL_SLOTS;
+    int index = t->slot % WHEEL_SLOTS;
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    if (w->slots[level][index] == NULL) {
+        w->occupied[level] &= ~(1ULL << index);
+    }
+    t->slot = -1;
+    w->count--;
+}
+
+void wheel_schedule(timer_wheel_t* w, wheel_timer_t* t, uint64_t timeout_ms) {
+    if (wheel_pending(t)) {
+        unlink_timer(w, t);
+    }
+    t->expires = (w->now_ms + timeout_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if (t->expires <= w->tick) {
+        t->expires = w->tick + 1;
+    }
+    insert(w, t);
+}
+
+void wheel_cancel(timer_wheel_t* w, wheel_timer_t* t) {
+    if (wheel_pending(t)) {
+        unlink_timer(w, t);
+    }
+}
+
+//empties one slot: timers that are due go off, the rest (only ever in levels above 0) move down to a finer level.
+static int run_slot(timer_wheel_t* w, int level, int index, void (*expire)(wheel_timer_t* t, void* arg), void* arg) {
+    wheel_timer_t** head = &w->slots[level][index];
+    wheel_timer_t* t;
+    int fired = 0;
+    //one at a time off the head, so expire() can cancel or schedule whatever it likes.
+    while ((t = *head) != NULL) {
+        unlink_timer(w, t);
+        if (t->expires <= w->tick) {
+            fired++;
+            expire(t, arg);
+        } else {
+            insert(w, t);
+        }
+    }
+    return fired;
+}
+
+int wheel_advance(timer_wheel_t* w, void (*expire)(wheel_timer_t* t, void* arg), void* arg) {
+    return wheel_advance_to(w, wheel_clock_ms(), expire, arg);
+}
+
+int wheel_advance_to(timer_wheel_t* w, uint64_t now_ms, void (*expire)(wheel_timer_t* t, void* arg), void* arg) {
+    w->now_ms = now_ms;
+    uint64_t target = w->now_ms / WHEEL_TICK_MS;
+    int fired = 0;
+
+    while (w->tick < target) {
+        if (w->count == 0) {
+            //nothing to move or fire on the way, so skip straight there.
+            w->tick = target;
+            break;
+        }
+        uint64_t tick = ++w->tick;
+        //each level whose wheel below has just come full circle hands its current slot down. the coarsest one goes first,
+        //so whatever it hands down is there when the level below takes its turn.
+        int top = 0;
+        while (top < WHEEL_LEVELS - 1 && (tick & ((1ULL << LEVEL_SHIFT(top + 1)) - 1)) == 0) {
+            top++;
+        }
+        for (int level=top;level>=0;level--) {
+            fired += run_slot(w, level, (tick >> LEVEL_SHIFT(level)) & SLOT_MASK, expire, arg);
+        }
+    }
+    return fired;
+}
+
+int wheel_next_ms(const timer_wheel_t* w) {
+    if (w->count == 0) {
+        return -1;
+    }
+    //the next occupied slot of level 0 in this turn of the wheel or, failing that, the end of the turn, when the levels above
+    //hand down their next slot. anything else is further away than that.
+    int index = w->tick & SLOT_MASK;
+    uint64_t later = index == SLOT_MASK ? 0 : w->occupied[0] & ~((2ULL << index) - 1);
+    uint64_t ticks = later != 0 ? (uint64_t)(__builtin_ctzll(later) - index) : (uint64_t)(WHEEL_SLOTS - index);
+    int64_t ms = (int64_t)((w->tick + ticks) * WHEEL_TICK_MS) - (int64_t)w->now_ms;
+    return ms < 0 ? 0 : (int)ms;
+}
@@ -0,0 +1,61 @@
+#ifndef TIMERWHEEL_H_
+#define TIMERWHEEL_H_
+
+#include<stdint.h>
+#include<stdbool.h>
+
+//hierarchical timing wheel for connection deadlines. WHEEL_LEVELS wheels of WHEEL_SLOTS slots each: level 0 has one slot per tick,
+//every level above covers WHEEL_SLOTS times the span of the one below. a timer goes into the coarsest slot that still tells it apart,
+//and moves down a level whenever the wheel below comes round to that slot. scheduling and cancelling are O(1) (timers are
+//intrusive list nodes), and a tick only looks at the timers that are due, however many connections there are.
+//not thread safe: a wheel belongs to one thread, or to whoever holds its lock.
+#define WHEEL_TICK_MS 100
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4      //64^4 ticks: ~19 days. longer timeouts are cut down to that
+
+typedef struct wheel_timer {
+    struct wheel_timer* next;
+    struct wheel_timer** pprev;     //whatever points at us: the previous timer's next, or the slot itself
+    uint64_t expires;               //tick
+    int slot;                       //level * WHEEL_SLOTS + slot, -1 while not scheduled
+} wheel_timer_t;
+
+typedef struct timer_wheel {
+    uint64_t now_ms;    //the clock as of the last wheel_advance(), or later if the owner brings it up to date. deadlines count from here
+    uint64_t tick;      //every tick up to and including this one has been run
+    long count;
+    uint64_t occupied[WHEEL_LEVELS];    //bit per non-empty slot, to find the next deadline without walking the slots
+    wheel_timer_t* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} timer_wheel_t;
+
+// CLOCK_MONOTONIC_COARSE in ms. a few ms of resolution is plenty for timeouts measured in seconds, and it's cheaper to read.
+uint64_t wheel_clock_ms();
+
+void wheel_init(timer_wheel_t* w);
+
+static inline void wheel_timer_init(wheel_timer_t* t) {
+    t->slot = -1;
+}
+
+static inline bool wheel_pending(const wheel_timer_t* t) {
+    return t->slot != -1;
+}
+
+// (re)schedules t to go off timeout_ms after w->now_ms. rounded up to a whole tick, so never early.
+void wheel_schedule(timer_wheel_t* w, wheel_timer_t* t, uint64_t timeout_ms);
+
+// unschedules t. fine to call on a timer that isn't scheduled.
+void wheel_cancel(timer_wheel_t* w, wheel_timer_t* t);
+
+// reads the clock and calls expire for every timer that's due. t is unscheduled by then, so expire may free it or schedule it again.
+// returns how many went off.
+int wheel_advance(timer_wheel_t* w, void (*expire)(wheel_timer_t* t, void* arg), void* arg);
+
+// the same, with the clock reading passed in (ms, on wheel_clock_ms()'s scale). for tests that can't wait days for a timer.
+int wheel_advance_to(timer_wheel_t* w, uint64_t now_ms, void (*expire)(wheel_timer_t* t, void* arg), void* arg);
+
+// how long (ms from w->now_ms) the owner can sleep before it has to call wheel_advance() again. -1 if nothing is scheduled.
+int wheel_next_ms(const timer_wheel_t* w);
+
+#endif
@@ -0,0 +1,123 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<errno.h>
+#include<limits.h>
+#include<openssl/ssl.h>
+#include<openssl/err.h>
+#include "server.h"
+#include "tls.h"
+#include "log.h"
+#include "metrics.h"
+
+bool tls_enabled = false;
+
+static SSL_CTX* ctx;
+
+void tls_init(const char* cert_file, const char* key_file) {
+    if ((ctx = SSL_CTX_new(TLS_server_method())) == NULL) {
+        ERR_print_errors_fp(stderr);
+        exit(1);
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    //kTLS: OpenSSL hands the keys to the kernel after the handshake, where the kernel and the cipher allow it.
+    //partial writes: SSL_write() returns after each record that got out, like send() does, instead of failing with EAGAIN after a
+    //part of the buffer went out. moving buffer: a retry after EAGAIN may come from another thread's stack or a refilled buffer.
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"webserver", 9);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+    //a client resumes with one ticket at a time. OpenSSL's default of two is a second encryption per handshake for nothing.
+    SSL_CTX_set_num_tickets(ctx, 1);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1
+        || SSL_CTX_use_PrivateKey_file(ctx, key_file != NULL ? key_file : cert_file, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(ctx) != 1) {
+        fprintf(stderr, "can't load TLS certificate %s and key %s:\n", cert_file, key_file != NULL ? key_file : cert_file);
+        ERR_print_errors_fp(stderr);
+        exit(1);
+    }
+    tls_enabled = true;
+    log_info("TLS with %s", cert_file);
+}
+
+struct ssl_st* tls_new(int client_socket) {
+    SSL* ssl = SSL_new(ctx);
+    if (ssl == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (SSL_set_fd(ssl, client_socket) != 1) {
+        SSL_free(ssl);
+        errno = ENOMEM;
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+//turns an OpenSSL result into what read()/send() would have said: -1 and errno, or 0 for a clean close.
+static ssize_t result(SSL* ssl, int ret) {
+    int saved = errno;
+    switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_NONE:
+            return ret;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return SOCKETERROR;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            //the socket failed (errno says how), or the client hung up without a close_notify.
+            ERR_clear_error();
+            errno = saved != 0 ? saved : ECONNRESET;
+            return SOCKETERROR;
+        default:
+            //a protocol error. the queue would otherwise leak into the next call on this thread.
+            ERR_clear_error();
+            errno = EPROTO;
+            return SOCKETERROR;
+    }
+}
+
+int tls_handshake(struct ssl_st* ssl, bool* ktls) {
+    errno = 0;
+    int ret = SSL_do_handshake(ssl);
+    if (ret != 1) {
+        //an EOF mid-handshake (a port scanner, a client that didn't like the certificate) is a failed handshake too.
+        if (result(ssl, ret) == 0) {
+            errno = ECONNRESET;
+        }
+        return SOCKETERROR;
+    }
+    *ktls = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    metrics_count(SSL_session_reused(ssl) ? M_TLS_RESUMED : M_TLS_FULL, 1);
+    if (*ktls) {
+        metrics_count(M_TLS_KTLS, 1);
+    }
+    return 1;
+}
+
+ssize_t tls_read(struct ssl_st* ssl, void* buf, size_t len) {
+    errno = 0;
+    int ret = SSL_read(ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+    return ret > 0 ? ret : result(ssl, ret);
+}
+
+ssize_t tls_write(void* ssl, const void* buf, size_t len) {
+    errno = 0;
+    int ret = SSL_write(ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+    return ret > 0 ? ret : result(ssl, ret);
+}
+
+void tls_close(struct ssl_st* ssl) {
+    //only after a finished handshake, and only once: a client that already went away can't be told anything.
+    if (SSL_is_init_finished(ssl)) {
+        SSL_shutdown(ssl);
+    }
+    ERR_clear_error();
+    SSL_free(ssl);
+}
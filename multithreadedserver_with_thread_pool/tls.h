@@ -0,0 +1,40 @@
+#ifndef TLS_H_
+#define TLS_H_
+
+#include<stdbool.h>
+#include<sys/types.h>
+
+//HTTPS on the listener (-T cert.pem [-K key.pem]), with OpenSSL. the handshake is OpenSSL's, and so is everything we read. what we
+//write depends on kernel TLS: if the kernel took over record encryption for the connection (kTLS, the "tls" ULP), responses go out
+//exactly as they would in the clear, sendfile()/splice() included, and the kernel encrypts them on the way. if it didn't, they go
+//through SSL_write() and the file is copied through user space like -s copy.
+//resumption: a server-side session cache for TLS 1.2 and one session ticket per TLS 1.3 handshake, so a client coming back skips the
+//certificate and key exchange work.
+//epoll and pool modes only. the uring mode's sockets only exist in the ring's file table, where OpenSSL can't get at them.
+#define TLS_SESSION_CACHE 20480     //TLS 1.2 sessions kept for resumption
+#define TLS_SESSION_TIMEOUT 3600    //seconds a session (or ticket) can be resumed for
+
+struct ssl_st;
+
+//set once tls_init() has loaded the certificate.
+extern bool tls_enabled;
+
+// loads the certificate chain and its key (key_file NULL: it's in cert_file too). exits the program if they don't load.
+void tls_init(const char* cert_file, const char* key_file);
+
+// a TLS session for an accepted socket. NULL (errno set) if OpenSSL can't make one.
+struct ssl_st* tls_new(int client_socket);
+
+// runs the handshake as far as the socket allows. returns 1 when it's done, -1 with errno EAGAIN if it has to wait for the socket,
+// or -1 with another errno if it failed. once it's done, *ktls says whether the kernel encrypts what we send.
+int tls_handshake(struct ssl_st* ssl, bool* ktls);
+
+// read() and send() for a TLS connection: the same return values, EAGAIN when the non-blocking socket would block (in either
+// direction: TLS reads may have to write and the other way round), 0 from tls_read() when the client closed the session.
+ssize_t tls_read(struct ssl_st* ssl, void* buf, size_t len);
+ssize_t tls_write(void* ssl, const void* buf, size_t len);
+
+// sends close_notify if it can without waiting, and frees the session. the socket is the caller's to close.
+void tls_close(struct ssl_st* ssl);
+
+#endif
@@ -0,0 +1,648 @@
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<errno.h>
+#include<stdint.h>
+#include<fcntl.h>
+#include<pthread.h>
+#include<linux/io_uring.h>
+#include<sys/mman.h>
+#include<sys/syscall.h>
+#include<sys/uio.h>
+#include "server.h"
+#include "uring.h"
+#include "connection.h"
+#include "log.h"
+#include "slab.h"
+#include "metrics.h"
+#include "admission.h"
+#include "timerwheel.h"
+#include "reload.h"
+
+//io_uring engine, talking to the kernel through the raw syscalls (no liburing).
+//each thread owns a ring. accepted sockets never enter the fd table: multishot accept drops them straight into the ring's registered
+//file table, and every later recv/send/close refers to them by slot. file bodies go out as linked read(file) -> send(socket) pairs
+//through registered buffers, and everything queued while handling a batch of completions is submitted with one io_uring_enter().
+//parsing and deciding what to answer is the same connection.c code the other modes use. only the I/O differs.
+
+//what a completion is for. kept in the low bits of user_data, the rest is the uconn pointer (from the slab, so 64-aligned).
+enum {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_SEND_HEAD,   //the headers, or headers+body in one sendmsg for files held in memory
+    OP_READ_FILE,
+    OP_SEND_BODY,
+    OP_CLOSE,
+    OP_SHUTDOWN,    //the connection timed out: whatever it's waiting on fails, and it closes the usual way
+    OP_CANCEL,      //a reload stops the multishot accept
+    OP_IO_DONE,     //the completion queue's eventfd: the I/O threads loaded files for some of our connections (see iopool.h)
+};
+#define OP_MASK 15
+
+//an SQE that didn't fit in the submission queue, waiting for room.
+typedef struct deferred_sqe {
+    struct io_uring_sqe sqe;
+    struct deferred_sqe* next;
+} deferred_sqe_t;
+
+typedef struct ring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    unsigned tail;      //our copy of the SQ tail, published on the next io_uring_enter()
+    unsigned queued;    //SQEs written since then
+    bool deferring;     //the submission queue ran out of room. new SQEs are set aside, after the ones already waiting
+    deferred_sqe_t* deferred;       //oldest first
+    deferred_sqe_t** deferred_tail;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+} ring_t;
+
+typedef struct uconn {
+    connection_t conn;
+    int slot;           //registered file index of the socket
+    int pending;        //SQEs in flight. a connection only ever has one chain outstanding
+    bool failed;
+    bool admitted;      //holds an admission slot. rejected connections only get their 503 and a close
+    int buf;            //registered buffer lent to us, -1 if we're using conn.buffer
+    char* data;         //where file chunks are read to
+    size_t buf_len;     //bytes of the last chunk that arrived
+    size_t buf_sent;
+    bool eof;
+    struct iovec iov[2];
+    struct msghdr msg;
+} uconn_t;
+
+typedef struct uring_loop {
+    ring_t ring;
+    int server_socket;
+    int index;
+    bool pin;
+    bool accepting;     //false once a reload has cancelled the accept
+    pthread_t thread;
+    char* buffers;
+    int free_bufs[URING_BUFFERS];
+    int nfree;
+    slab_t conns;
+    timer_wheel_t timers;
+    io_completions_t cq;
+    uint64_t io_done;   //where the eventfd's counter is read to
+} uring_loop_t;
+
+static void ring_init(ring_t* r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    //room for a few completions per submission so a burst of accepts can't overflow the CQ.
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER;
+    p.cq_entries = entries * 4;
+    check(r->fd = syscall(__NR_io_uring_setup, entries, &p), "io_uring_setup failed");
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    char* sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    char* cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+        perror("io_uring mmap failed");
+        exit(1);
+    }
+
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->tail = *r->sq_tail;
+    r->queued = 0;
+    r->deferring = false;
+    r->deferred = NULL;
+    r->deferred_tail = &r->deferred;
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+}
+
+//submits everything queued and sleeps until at least one completion is ready, or wait_ms runs out (-1: no limit, 0: don't sleep).
+static void ring_enter(ring_t* r, int wait_ms) {
+    struct __kernel_timespec ts = { .tv_sec = wait_ms / 1000, .tv_nsec = (wait_ms % 1000) * 1000000LL };
+    struct io_uring_getevents_arg arg = { .ts = wait_ms > 0 ? (uintptr_t)&ts : 0 };
+    unsigned flags = wait_ms != 0 ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    while (true) {
+        int ret = syscall(__NR_io_uring_enter, r->fd, r->queued, wait_ms != 0 ? 1 : 0, flags, flags ? &arg : NULL, flags ? sizeof(arg) : 0);
+        if (ret >= 0) {
+            r->queued -= ret;
+            return;
+        }
+        //ETIME: the wait ran out, which only happens with nothing submitted.
+        if (errno == ETIME) {
+            return;
+        }
+        //EINTR: nothing was submitted. a signal may want the loop to look around (see reload.c), so let it.
+        if (errno == EINTR) {
+            return;
+        }
+        //EBUSY: the completion queue is backed up. whatever is still queued goes in on the next call, once we've reaped.
+        if (errno == EBUSY || errno == EAGAIN) {
+            return;
+        }
+        check(ret, "io_uring_enter failed");
+    }
+}
+
+static struct io_uring_sqe* sq_push(ring_t* r) {
+    unsigned idx = r->tail & r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    r->sq_array[idx] = idx;
+    r->tail++;
+    r->queued++;
+    return sqe;
+}
+
+//a free SQE for the caller to fill in. when the submission queue is full (the kernel said EBUSY because the completion queue is
+//backed up, or a burst of completions queued more than it holds), the SQE is set aside in memory instead and goes in with
+//ring_flush_deferred() once we've reaped. submitting from here to make room could split a linked chain across two io_uring_enter()s,
+//and the kernel would start the second half without waiting for the first.
+static struct io_uring_sqe* ring_sqe(ring_t* r) {
+    struct io_uring_sqe* sqe;
+    if (!r->deferring && r->queued < r->sq_entries) {
+        sqe = sq_push(r);
+    } else {
+        deferred_sqe_t* d = malloc(sizeof(deferred_sqe_t));
+        if (d == NULL) {
+            perror("malloc failed");
+            exit(1);
+        }
+        d->next = NULL;
+        *r->deferred_tail = d;
+        r->deferred_tail = &d->next;
+        r->deferring = true;
+        sqe = &d->sqe;
+    }
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+//call before queueing a chain of n linked SQEs: if they wouldn't all fit, they're all set aside and go in together.
+static void ring_reserve(ring_t* r, unsigned n) {
+    if (r->queued + n > r->sq_entries) {
+        r->deferring = true;
+    }
+}
+
+//moves set-aside SQEs into the submission queue, oldest first, as far as they fit. a linked chain only moves whole.
+static void ring_flush_deferred(ring_t* r) {
+    while (r->deferred != NULL) {
+        unsigned n = 1;
+        for (deferred_sqe_t* d = r->deferred; d->next != NULL && (d->sqe.flags & IOSQE_IO_LINK); d = d->next) {
+            n++;
+        }
+        if (r->queued + n > r->sq_entries) {
+            return;
+        }
+        while (n-- > 0) {
+            deferred_sqe_t* d = r->deferred;
+            *sq_push(r) = d->sqe;
+            r->deferred = d->next;
+            free(d);
+        }
+    }
+    r->deferred_tail = &r->deferred;
+    r->deferring = false;
+}
+
+static struct io_uring_cqe* ring_peek(ring_t* r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+static void ring_advance(ring_t* r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+//queues one operation on u's socket (or, for reads, on the file) and counts it as pending.
+static struct io_uring_sqe* queue_op(uring_loop_t* l, uconn_t* u, int op, int opcode, int fd, bool fixed, const void* addr, unsigned len, uint64_t off) {
+    struct io_uring_sqe* sqe = ring_sqe(&l->ring);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->flags = fixed ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (uintptr_t)u | op;
+    if (u != NULL) {
+        u->pending++;
+    }
+    return sqe;
+}
+
+static void arm_accept(uring_loop_t* l) {
+    //slot 0 of the registered file table is the listening socket.
+    struct io_uring_sqe* sqe = queue_op(l, NULL, OP_ACCEPT, IORING_OP_ACCEPT, 0, true, NULL, 0, 0);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+}
+
+//the process that took over accepts from here on. we just finish the connections we have.
+static void stop_accepting(uring_loop_t* l) {
+    struct io_uring_sqe* sqe = queue_op(l, NULL, OP_CANCEL, IORING_OP_ASYNC_CANCEL, -1, false, NULL, 0, 0);
+    sqe->addr = OP_ACCEPT;  //the accept's user_data: no uconn, just the op
+    l->accepting = false;
+    reload_acceptor_stopped();
+}
+
+static void release_buffer(uring_loop_t* l, uconn_t* u) {
+    if (u->buf != -1) {
+        l->free_bufs[l->nfree++] = u->buf;
+        u->buf = -1;
+    }
+}
+
+static void close_uconn(uring_loop_t* l, uconn_t* u) {
+    wheel_cancel(&l->timers, &u->conn.timer);
+    metrics_count(M_CLOSED, 1);
+    if (u->admitted) {
+        admission_release();
+    }
+    connection_release(&u->conn);
+    filesend_release(&u->conn.sender);
+    release_buffer(l, u);
+    //a registered slot is closed through the ring. u is freed when that completes.
+    struct io_uring_sqe* sqe = queue_op(l, u, OP_CLOSE, IORING_OP_CLOSE, 0, false, NULL, 0, 0);
+    sqe->file_index = u->slot + 1;
+}
+
+static void queue_recv(uring_loop_t* l, uconn_t* u) {
+    connection_t* c = &u->conn;
+    queue_op(l, u, OP_RECV, IORING_OP_RECV, u->slot, true, c->in + c->in_len, BUFSIZE - c->in_len, 0);
+    connection_arm_timer(c, &l->timers);
+}
+
+//the connection sat on one operation for too long. shutting the socket down makes whatever is pending fail, and once it has,
+//chain_done() closes the connection.
+static void expire(wheel_timer_t* t, void* arg) {
+    uring_loop_t* l = arg;
+    uconn_t* u = (uconn_t*)connection_of_timer(t);
+    connection_count_timeout(&u->conn);
+    u->failed = true;
+    struct io_uring_sqe* sqe = queue_op(l, u, OP_SHUTDOWN, IORING_OP_SHUTDOWN, u->slot, true, NULL, 0, 0);
+    sqe->len = SHUT_RDWR;
+}
+
+//reads the next chunk of the file and, when we know how much to expect, links the send of that chunk right behind it
+//so both go to the kernel in one submission and the data never surfaces in between.
+static void queue_chunk(uring_loop_t* l, uconn_t* u) {
+    file_sender_t* s = &u->conn.sender;
+    size_t cap;
+
+    if (u->buf == -1 && l->nfree > 0) {
+        u->buf = l->free_bufs[--l->nfree];
+    }
+    if (u->buf != -1) {
+        u->data = l->buffers + (size_t)u->buf * URING_BUFFER_SIZE;
+        cap = URING_BUFFER_SIZE;
+    } else {
+        //every registered buffer is lent out. fall back to a plain read into the connection's own buffer.
+        u->data = u->conn.buffer;
+        cap = BUFSIZE;
+    }
+    //a chunked body is framed in place: room for the size line in front of the data and the CRLF behind it.
+    if (s->chunked) {
+        u->data += CHUNK_HEAD;
+        cap -= CHUNK_HEAD + CHUNK_TAIL;
+    }
+    size_t chunk = cap;
+    if (s->sized && (off_t)chunk > s->size - s->offset) {
+        chunk = s->size - s->offset;
+    }
+    u->buf_len = u->buf_sent = 0;
+
+    //the read and the send behind it have to go to the kernel in the same submission.
+    if (s->sized) {
+        ring_reserve(&l->ring, 2);
+    }
+    struct io_uring_sqe* read;
+    if (u->buf != -1) {
+        read = queue_op(l, u, OP_READ_FILE, IORING_OP_READ_FIXED, s->file_fd, false, u->data, chunk, s->offset);
+        read->buf_index = u->buf;
+    } else {
+        read = queue_op(l, u, OP_READ_FILE, IORING_OP_READ, s->file_fd, false, u->data, chunk, s->offset);
+    }
+    if (s->sized) {
+        //a short read breaks the link and the send completes with -ECANCELED. chain_done() sends what did arrive.
+        read->flags |= IOSQE_IO_LINK;
+        struct io_uring_sqe* send = queue_op(l, u, OP_SEND_BODY, IORING_OP_SEND, u->slot, true, u->data, chunk, 0);
+        send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    }
+}
+
+static void finish_response(uring_loop_t* l, uconn_t* u);
+
+//queues whatever the response in flight needs next. if it needs nothing, the response is complete.
+static void continue_response(uring_loop_t* l, uconn_t* u) {
+    connection_t* c = &u->conn;
+    file_sender_t* s = &c->sender;
+    bool head_left = c->head_off < c->head_len;
+
+    if (c->send_body && s->method == SEND_MEMORY) {
+        //headers and body in a single sendmsg.
+        if (!head_left && s->offset >= s->size) {
+            finish_response(l, u);
+            return;
+        }
+        u->iov[0] = (struct iovec){ c->head + c->head_off, c->head_len - c->head_off };
+        u->iov[1] = (struct iovec){ (char*)s->data + s->offset, s->size - s->offset };
+        memset(&u->msg, 0, sizeof(u->msg));
+        u->msg.msg_iov = u->iov;
+        u->msg.msg_iovlen = 2;
+        struct io_uring_sqe* sqe = queue_op(l, u, OP_SEND_HEAD, IORING_OP_SENDMSG, u->slot, true, &u->msg, 1, 0);
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        connection_arm_timer(c, &l->timers);
+        return;
+    }
+
+    if (c->send_body && u->buf_sent < u->buf_len) {
+        struct io_uring_sqe* sqe = queue_op(l, u, OP_SEND_BODY, IORING_OP_SEND, u->slot, true, u->data + u->buf_sent, u->buf_len - u->buf_sent, 0);
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        connection_arm_timer(c, &l->timers);
+        return;
+    }
+
+    bool body_left = c->send_body && !u->eof && !(s->sized && s->offset >= s->size);
+    if (head_left) {
+        struct io_uring_sqe* sqe = queue_op(l, u, OP_SEND_HEAD, IORING_OP_SEND, u->slot, true, c->head + c->head_off, c->head_len - c->head_off, 0);
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (body_left ? MSG_MORE : 0);
+        if (body_left) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+    }
+    if (body_left) {
+        queue_chunk(l, u);
+    }
+    if (u->pending == 0) {
+        finish_response(l, u);
+    } else {
+        connection_arm_timer(c, &l->timers);
+    }
+}
+
+//parses the next buffered request and starts answering it, or goes back to reading if there isn't a whole one yet.
+//a request whose file went to the I/O threads waits with nothing queued: OP_IO_DONE picks it up again.
+static void advance(uring_loop_t* l, uconn_t* u) {
+    if (connection_next_request(&u->conn)) {
+        continue_response(l, u);
+    } else if (u->conn.state == CONN_OPENING) {
+        connection_arm_timer(&u->conn, &l->timers);
+    } else {
+        queue_recv(l, u);
+    }
+}
+
+static void arm_io_done(uring_loop_t* l) {
+    queue_op(l, NULL, OP_IO_DONE, IORING_OP_READ, l->cq.efd, false, &l->io_done, sizeof(l->io_done), 0);
+}
+
+//the eventfd was read, so it's reset: re-arm before looking, and a job completed from here on gets us another completion.
+static void on_io_done(uring_loop_t* l, int res) {
+    if (res < 0 && res != -EAGAIN && res != -EINTR) {
+        log_warn("eventfd read failed: %s", strerror(-res));
+    }
+    arm_io_done(l);
+    io_job_t* job = iocq_take(&l->cq, false);
+    while (job != NULL) {
+        io_job_t* next = job->next;
+        uconn_t* u = (uconn_t*)connection_of_job(job);
+        connection_resume(&u->conn);
+        continue_response(l, u);
+        job = next;
+    }
+}
+
+static void finish_response(uring_loop_t* l, uconn_t* u) {
+    release_buffer(l, u);
+    u->buf_len = u->buf_sent = 0;
+    u->eof = false;
+    if (!connection_response_done(&u->conn)) {
+        close_uconn(l, u);
+        return;
+    }
+    if (u->conn.state != CONN_READING) {
+        continue_response(l, u);    //the next part of a multipart body
+        return;
+    }
+    advance(l, u);
+}
+
+//runs once every operation of the connection's current chain has completed.
+static void chain_done(uring_loop_t* l, uconn_t* u) {
+    if (u->failed) {
+        close_uconn(l, u);
+    } else if (u->conn.state == CONN_READING) {
+        advance(l, u);
+    } else {
+        continue_response(l, u);
+    }
+}
+
+static void on_accept(uring_loop_t* l, struct io_uring_cqe* cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE) && l->accepting) {
+        //the multishot accept ended (e.g. the slot table was full). put it back.
+        arm_accept(l);
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ENFILE && cqe->res != -ECANCELED) {
+            log_warn("accept failed: %s", strerror(-cqe->res));
+        }
+        return;
+    }
+    metrics_count(M_ACCEPTED, 1);
+    uconn_t* u = slab_alloc(&l->conns);
+    connection_init(&u->conn, cqe->res, false);
+    u->conn.cq = &l->cq;
+    u->slot = cqe->res;
+    u->pending = 0;
+    u->failed = false;
+    u->buf = -1;
+    u->buf_len = u->buf_sent = 0;
+    u->eof = false;
+    //the socket only exists in the ring's file table, so a rejection goes out through the ring like any other response.
+    if (!(u->admitted = admission_admit())) {
+        admission_count_shed(SHED_INFLIGHT);
+        connection_reject(&u->conn);
+        continue_response(l, u);
+        return;
+    }
+    queue_recv(l, u);
+}
+
+static void on_completion(uring_loop_t* l, struct io_uring_cqe* cqe) {
+    int op = cqe->user_data & OP_MASK;
+    uconn_t* u = (uconn_t*)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+    int res = cqe->res;
+
+    if (op == OP_ACCEPT) {
+        on_accept(l, cqe);
+        return;
+    }
+    if (op == OP_CANCEL) {
+        return;
+    }
+    if (op == OP_IO_DONE) {
+        on_io_done(l, res);
+        return;
+    }
+    u->pending--;
+    switch (op) {
+        case OP_CLOSE:
+            slab_free(&l->conns, u);
+            return;
+        case OP_SHUTDOWN:
+            break;
+        case OP_RECV:
+            if (res <= 0) {
+                u->failed = true;
+            } else {
+                u->conn.in_len += res;
+            }
+            break;
+        case OP_SEND_HEAD: {
+            connection_t* c = &u->conn;
+            if (res < 0) {
+                u->failed = true;
+                break;
+            }
+            //sent bytes cover the headers first, then (for the single sendmsg) the body.
+            size_t head_part = c->head_len - c->head_off;
+            if ((size_t)res < head_part) {
+                c->head_off += res;
+            } else {
+                c->head_off = c->head_len;
+                c->sender.offset += res - head_part;
+            }
+            break;
+        }
+        case OP_READ_FILE:
+            if (u->conn.sender.chunked && res >= 0) {
+                //the empty read becomes the last chunk, which still has to go out.
+                u->data = filesend_frame_chunk(u->data, res, &u->buf_len);
+                u->conn.sender.offset += res;
+                u->eof = res == 0;
+            } else if (res == 0 && u->conn.sender.sized) {
+                //the file shrank under us. the client was promised the rest, so the connection can't carry on.
+                u->failed = true;
+            } else if (res == 0) {
+                u->eof = true;
+            } else if (res > 0) {
+                u->buf_len = res;
+                u->conn.sender.offset += res;
+            } else if (res != -ECANCELED) {
+                u->failed = true;
+            }
+            break;
+        case OP_SEND_BODY:
+            if (res > 0) {
+                u->buf_sent += res;
+            } else if (res != -ECANCELED) {
+                u->failed = true;
+            }
+            break;
+    }
+    if (u->pending == 0) {
+        chain_done(l, u);
+    }
+}
+
+static void* uring_thread(void* arg) {
+    uring_loop_t* l = arg;
+    ring_t* r = &l->ring;
+
+    //pin before creating the ring so its memory is allocated on our node.
+    if (l->pin) {
+        pin_to_shard(l->index, l->server_socket);
+    }
+    ring_init(r, URING_ENTRIES);
+    slab_init(&l->conns, sizeof(uconn_t));
+    wheel_init(&l->timers);
+
+    int* files = malloc(URING_MAX_CONNECTIONS * sizeof(int));
+    files[0] = l->server_socket;
+    for (int i=1;i<URING_MAX_CONNECTIONS;i++) {
+        files[i] = -1;
+    }
+    check(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, files, URING_MAX_CONNECTIONS), "io_uring file registration failed");
+    free(files);
+    //accepted sockets get allocated from slot 1 up. slot 0 stays the listener.
+    struct io_uring_file_index_range range = { .off = 1, .len = URING_MAX_CONNECTIONS - 1 };
+    check(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILE_ALLOC_RANGE, &range, 0), "io_uring alloc range failed");
+
+    struct iovec iov[URING_BUFFERS];
+    l->buffers = aligned_alloc(4096, (size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    for (int i=0;i<URING_BUFFERS;i++) {
+        iov[i] = (struct iovec){ l->buffers + (size_t)i * URING_BUFFER_SIZE, URING_BUFFER_SIZE };
+        l->free_bufs[i] = i;
+    }
+    l->nfree = URING_BUFFERS;
+    check(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS), "io_uring buffer registration failed");
+
+    //the ring does the waiting on the eventfd. on a non-blocking one its read would come straight back with EAGAIN.
+    iocq_init(&l->cq, false);
+    check(fcntl(l->cq.efd, F_SETFL, fcntl(l->cq.efd, F_GETFL) & ~O_NONBLOCK), "fcntl failed");
+    arm_io_done(l);
+
+    reload_register_acceptor();
+    l->accepting = true;
+    arm_accept(l);
+    while (true) {
+        if (l->accepting && reload_draining()) {
+            stop_accepting(l);
+        }
+        //one syscall submits everything queued while handling the last batch and waits for the next one, or the next deadline.
+        //SQEs still set aside mean the kernel is backed up: reap what it has and try again rather than sleep.
+        ring_flush_deferred(r);
+        ring_enter(r, r->deferring ? 0 : wheel_next_ms(&l->timers));
+        l->timers.now_ms = wheel_clock_ms();
+        struct io_uring_cqe* cqe;
+        while ((cqe = ring_peek(r)) != NULL) {
+            struct io_uring_cqe done = *cqe;
+            ring_advance(r);
+            on_completion(l, &done);
+        }
+        wheel_advance(&l->timers, expire, l);
+    }
+    return NULL;
+}
+
+void run_uring(const int* listeners, int nthreads, bool pin) {
+    uring_loop_t* loops = calloc(nthreads, sizeof(uring_loop_t));
+
+    for (int i=0;i<nthreads;i++) {
+        loops[i].server_socket = listeners[i];
+        loops[i].index = i;
+        loops[i].pin = pin;
+        pthread_create(&loops[i].thread, NULL, uring_thread, &loops[i]);
+    }
+    log_info("Serving with %d io_uring threads...", nthreads);
+
+    for (int i=0;i<nthreads;i++) {
+        pthread_join(loops[i].thread, NULL);
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef URING_H_
+#define URING_H_
+
+#define URING_ENTRIES 1024              //submission queue size of each ring
+#define URING_MAX_CONNECTIONS 4096      //registered file slots per ring. slot 0 is the listening socket
+#define URING_BUFFERS 64                //registered buffers per ring, lent to connections while they send a file
+#define URING_BUFFER_SIZE (64 * 1024)
+
+#include<stdbool.h>
+
+// serves connections on nthreads io_uring rings, one thread each. ring i accepts from listeners[i]. with pin, thread i is pinned
+// to shard i's CPU (see pin_to_shard()). never returns.
+void run_uring(const int* listeners, int nthreads, bool pin);
+
+#endif
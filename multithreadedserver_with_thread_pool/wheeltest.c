@@ -0,0 +1,202 @@
+//behaviour checks for the timer wheel (timerwheel.c): timers on every level cascade down and go off on their tick, never early
+//and never late, from wherever in its turn the wheel starts, and whether it's stepped a tick at a time or woken when
+//wheel_next_ms() says. the clock is driven by hand through wheel_advance_to().
+//usage: ./wheeltest (make test). prints the cases that fail and exits 1 if there are any.
+#include<stdio.h>
+#include<stdlib.h>
+#include<stddef.h>
+#include "timerwheel.h"
+
+static int checks, failures;
+
+#define expect(cond, ...) do { \
+    checks++; \
+    if (!(cond)) { \
+        failures++; \
+        printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+        printf(__VA_ARGS__); \
+        printf("\n"); \
+    } \
+} while (0)
+
+#define TICKS(level) (1ULL << (WHEEL_BITS * (level)))   //span of one slot of this level
+
+typedef struct test_timer {
+    wheel_timer_t timer;
+    uint64_t timeout_ms;
+    uint64_t due;       //the tick it has to go off on
+    uint64_t fired_at;
+    int fired;
+    int repeat;         //goes off this many more times, timeout_ms apart
+} test_timer_t;
+
+//timeouts either side of where each level starts, so every timer but the first few is filed above level 0 and has to cascade.
+static const uint64_t timeouts_ms[] = {
+    0, 1, WHEEL_TICK_MS, WHEEL_TICK_MS + 1,
+    (TICKS(1) - 1) * WHEEL_TICK_MS, TICKS(1) * WHEEL_TICK_MS, (TICKS(1) + 1) * WHEEL_TICK_MS + 50,
+    (TICKS(2) - 1) * WHEEL_TICK_MS, TICKS(2) * WHEEL_TICK_MS, TICKS(2) * WHEEL_TICK_MS + 7 * TICKS(1) * WHEEL_TICK_MS + 30,
+    (TICKS(3) - 1) * WHEEL_TICK_MS, TICKS(3) * WHEEL_TICK_MS + 1, 2 * TICKS(3) * WHEEL_TICK_MS + 123456,
+};
+#define NTIMERS (sizeof(timeouts_ms) / sizeof(timeouts_ms[0]))
+
+//where the wheel's clock starts: at the start of a turn, just before every level comes round, and somewhere in between.
+static const uint64_t starts_ms[] = {
+    0,
+    (TICKS(1) - 1) * WHEEL_TICK_MS,
+    (TICKS(2) - 1) * WHEEL_TICK_MS + 99,
+    (TICKS(3) - 1) * WHEEL_TICK_MS,
+    (5 * TICKS(3) + 3 * TICKS(2) + 17 * TICKS(1) + 42) * WHEEL_TICK_MS + 37,
+};
+
+static void expire(wheel_timer_t* t, void* arg) {
+    timer_wheel_t* w = arg;
+    test_timer_t* tt = (test_timer_t*)((char*)t - offsetof(test_timer_t, timer));
+    expect(!wheel_pending(t), "timer still scheduled when it goes off");
+    tt->fired++;
+    tt->fired_at = w->tick;
+    if (tt->repeat > 0) {
+        tt->repeat--;
+        wheel_schedule(w, t, tt->timeout_ms);
+        tt->due = (w->now_ms + tt->timeout_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+        if (tt->due <= w->tick) {
+            tt->due = w->tick + 1;
+        }
+    }
+}
+
+static void start(timer_wheel_t* w, uint64_t start_ms, test_timer_t* timers) {
+    wheel_init(w);
+    w->now_ms = start_ms;
+    w->tick = start_ms / WHEEL_TICK_MS;
+    for (size_t i=0;i<NTIMERS;i++) {
+        test_timer_t* t = &timers[i];
+        wheel_timer_init(&t->timer);
+        t->timeout_ms = timeouts_ms[i];
+        t->due = (start_ms + t->timeout_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+        if (t->due <= w->tick) {
+            t->due = w->tick + 1;
+        }
+        t->fired = 0;
+        t->repeat = 0;
+        wheel_schedule(w, &t->timer, t->timeout_ms);
+    }
+}
+
+static uint64_t last_due(const test_timer_t* timers) {
+    uint64_t last = 0;
+    for (size_t i=0;i<NTIMERS;i++) {
+        if (timers[i].due > last) {
+            last = timers[i].due;
+        }
+    }
+    return last;
+}
+
+static void check_fired(const timer_wheel_t* w, const test_timer_t* timers, uint64_t start_ms, const char* how) {
+    for (size_t i=0;i<NTIMERS;i++) {
+        expect(timers[i].fired == 1 && timers[i].fired_at == timers[i].due,
+               "%s from %llu ms: %llu ms timer went off %d times, last on tick %llu, due on %llu", how,
+               (unsigned long long)start_ms, (unsigned long long)timers[i].timeout_ms, timers[i].fired,
+               (unsigned long long)timers[i].fired_at, (unsigned long long)timers[i].due);
+    }
+    expect(w->count == 0, "%s from %llu ms: %ld timers left", how, (unsigned long long)start_ms, w->count);
+    expect(wheel_next_ms(w) == -1, "%s from %llu ms: next deadline %d with nothing scheduled", how, (unsigned long long)start_ms,
+           wheel_next_ms(w));
+}
+
+//one wheel_advance_to() per tick, like a loop that's never idle.
+static void test_every_tick() {
+    static timer_wheel_t w;
+    test_timer_t timers[NTIMERS];
+    for (size_t s=0;s<sizeof(starts_ms)/sizeof(starts_ms[0]);s++) {
+        start(&w, starts_ms[s], timers);
+        uint64_t end = last_due(timers);
+        for (uint64_t tick=w.tick+1;tick<=end;tick++) {
+            wheel_advance_to(&w, tick * WHEEL_TICK_MS, expire, &w);
+        }
+        check_fired(&w, timers, starts_ms[s], "every tick");
+    }
+}
+
+//sleeping as long as wheel_next_ms() allows, like an idle event loop. it must never sleep past a deadline.
+static void test_sleeping() {
+    static timer_wheel_t w;
+    test_timer_t timers[NTIMERS];
+    for (size_t s=0;s<sizeof(starts_ms)/sizeof(starts_ms[0]);s++) {
+        start(&w, starts_ms[s], timers);
+        int wakeups = 0;
+        int next;
+        while ((next = wheel_next_ms(&w)) != -1) {
+            uint64_t wake = w.now_ms + next;
+            for (size_t i=0;i<NTIMERS;i++) {
+                expect(timers[i].fired > 0 || wake <= timers[i].due * WHEEL_TICK_MS,
+                       "sleeping from %llu ms: would sleep until %llu ms, past the %llu ms timer due at %llu ms",
+                       (unsigned long long)starts_ms[s], (unsigned long long)wake, (unsigned long long)timers[i].timeout_ms,
+                       (unsigned long long)(timers[i].due * WHEEL_TICK_MS));
+            }
+            wheel_advance_to(&w, wake, expire, &w);
+            if (++wakeups > 100000) {
+                break;
+            }
+        }
+        check_fired(&w, timers, starts_ms[s], "sleeping");
+        //a wake-up per turn of level 0 at most, plus one per timer.
+        expect(wakeups <= (int)((last_due(timers) - starts_ms[s] / WHEEL_TICK_MS) / TICKS(1) + 2 * NTIMERS),
+               "sleeping from %llu ms: %d wake-ups", (unsigned long long)starts_ms[s], wakeups);
+    }
+}
+
+//a single jump over every deadline still runs each timer, on its own tick.
+static void test_jump() {
+    static timer_wheel_t w;
+    test_timer_t timers[NTIMERS];
+    for (size_t s=0;s<sizeof(starts_ms)/sizeof(starts_ms[0]);s++) {
+        start(&w, starts_ms[s], timers);
+        int fired = wheel_advance_to(&w, last_due(timers) * WHEEL_TICK_MS + 12345, expire, &w);
+        expect(fired == (int)NTIMERS, "jump from %llu ms: %d went off", (unsigned long long)starts_ms[s], fired);
+        check_fired(&w, timers, starts_ms[s], "jump");
+    }
+}
+
+//cancelling a timer on a high level before it cascades, rescheduling one onto a lower level, and a timer that reschedules
+//itself from expire().
+static void test_cancel_and_reschedule() {
+    static timer_wheel_t w;
+    test_timer_t timers[NTIMERS];
+    uint64_t start_ms = starts_ms[4];
+    start(&w, start_ms, timers);
+
+    test_timer_t* high = &timers[NTIMERS - 1];
+    wheel_cancel(&w, &high->timer);
+    expect(!wheel_pending(&high->timer), "cancelled timer still scheduled");
+    wheel_cancel(&w, &high->timer);
+    high->due = 0;
+
+    test_timer_t* moved = &timers[NTIMERS - 2];
+    moved->timeout_ms = 2 * WHEEL_TICK_MS;
+    moved->due = (start_ms + moved->timeout_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    wheel_schedule(&w, &moved->timer, moved->timeout_ms);
+
+    test_timer_t* periodic = &timers[5];
+    periodic->repeat = 3;
+
+    uint64_t end = last_due(timers) + 4 * TICKS(1);
+    for (uint64_t tick=w.tick+1;tick<=end;tick++) {
+        wheel_advance_to(&w, tick * WHEEL_TICK_MS, expire, &w);
+    }
+    expect(high->fired == 0, "cancelled timer went off %d times", high->fired);
+    expect(moved->fired == 1 && moved->fired_at == moved->due, "rescheduled timer went off %d times, on tick %llu, due on %llu",
+           moved->fired, (unsigned long long)moved->fired_at, (unsigned long long)moved->due);
+    expect(periodic->fired == 4 && periodic->fired_at == periodic->due, "periodic timer went off %d times, last on tick %llu, due on %llu",
+           periodic->fired, (unsigned long long)periodic->fired_at, (unsigned long long)periodic->due);
+    expect(w.count == 0, "%ld timers left", w.count);
+}
+
+int main(int argc, char** argv) {
+    test_every_tick();
+    test_sleeping();
+    test_jump();
+    test_cancel_and_reschedule();
+    printf("wheeltest: %d checks, %d failed\n", checks, failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,415 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<unistd.h>
+#include<stdbool.h>
+#include<stdint.h>
+#include<time.h>
+#include<sys/resource.h>
+#include "server.h"
+#include "workpool.h"
+#include "log.h"
+#include "metrics.h"
+#include "admission.h"
+#include "ratelimit.h"
+
+//pushed onto a parked worker's own queue to wake it up without giving it anything. it then goes looking on the other queues.
+//waking it through its queue (rather than poking the futex directly) means the wake-up can't slip in between its last look and its sleep.
+#define POOL_POKE (-2)
+
+//when each fd was accepted, for the queue wait stats, and which client it came from. indexed by fd: between accept and pickup
+//the fd belongs to exactly one connection, and the queue's release/acquire orders the writes before the worker's reads.
+static uint64_t* accepted_at;
+static struct client** accepted_by;
+static int accepted_size;
+static pthread_once_t accepted_once = PTHREAD_ONCE_INIT;
+
+static void init_accepted_at() {
+    struct rlimit rl;
+    accepted_size = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? (int)rl.rlim_cur : 65536;
+    accepted_at = calloc(accepted_size, sizeof(uint64_t));
+    accepted_by = calloc(accepted_size, sizeof(struct client*));
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* worker_main(void* arg);
+
+static void spawn_worker(workpool_t* pool) {
+    pthread_mutex_lock(&pool->spawn_lock);
+    if (atomic_load(&pool->nworkers) < pool->max) {
+        for (int i=0;i<pool->max;i++) {
+            pool_worker_t* w = &pool->workers[i];
+            if (atomic_load(&w->running)) {
+                continue;
+            }
+            if (w->queue == NULL) {
+                w->queue = queue_create();
+                //publish the queue before thieves can see the slot.
+                if (atomic_load(&pool->slots_used) <= i) {
+                    atomic_store(&pool->slots_used, i + 1);
+                }
+            }
+            atomic_store(&w->idle, 0);
+            atomic_store(&w->running, 1);
+            atomic_fetch_add(&pool->nworkers, 1);
+            atomic_fetch_add(&pool->spawned, 1);
+
+            pthread_t t;
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            pthread_create(&t, &attr, worker_main, w);
+            pthread_attr_destroy(&attr);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->spawn_lock);
+}
+
+//takes a parked worker off the idle list, or returns NULL if nobody is parked.
+static pool_worker_t* claim_idle(workpool_t* pool) {
+    if (atomic_load(&pool->nidle) == 0) {
+        return NULL;
+    }
+    int used = atomic_load(&pool->slots_used);
+    unsigned start = atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed);
+    for (int i=0;i<used;i++) {
+        pool_worker_t* w = &pool->workers[(start + i) % used];
+        int one = 1;
+        if (atomic_load_explicit(&w->idle, memory_order_relaxed) && atomic_compare_exchange_strong(&w->idle, &one, 0)) {
+            atomic_fetch_sub(&pool->nidle, 1);
+            return w;
+        }
+    }
+    return NULL;
+}
+
+//own queue first, then everybody else's, starting with the next slot over so thieves spread out.
+static int take(workpool_t* pool, pool_worker_t* self) {
+    int client_socket;
+    while ((client_socket = queue_pop(self->queue)) != -1) {
+        if (client_socket != POOL_POKE) {
+            atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+            return client_socket;
+        }
+    }
+    int used = atomic_load(&pool->slots_used);
+    for (int i=1;i<used;i++) {
+        queue_t* q = pool->workers[(self->index + i) % used].queue;
+        while ((client_socket = queue_pop(q)) != -1) {
+            if (client_socket != POOL_POKE) {
+                atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+                atomic_fetch_add_explicit(&pool->stolen, 1, memory_order_relaxed);
+                return client_socket;
+            }
+        }
+    }
+    return -1;
+}
+
+//closes the CoDel interval if it's over. whoever gets there first (a worker dequeueing, or the acceptor) does it.
+static void codel_roll(workpool_t* pool, uint64_t now) {
+    unsigned long long end = atomic_load_explicit(&pool->codel_interval_end, memory_order_relaxed);
+    if (now < end || !atomic_compare_exchange_strong(&pool->codel_interval_end, &end, now + POOL_CODEL_INTERVAL_MS * 1000000ULL)) {
+        return;
+    }
+    uint64_t min = atomic_exchange(&pool->codel_min_wait, UINT64_MAX);
+    //no dequeues at all for a whole interval, with connections waiting, is as bad as it gets.
+    bool standing = min == UINT64_MAX ? atomic_load(&pool->queued) > 0 : min > POOL_CODEL_TARGET_MS * 1000000ULL;
+    if (standing != atomic_load(&pool->overloaded)) {
+        atomic_store(&pool->overloaded, standing);
+        log_info("pool %d: %s", pool->shard, standing ? "overloaded, shedding" : "recovered");
+    }
+}
+
+static void codel_observe(workpool_t* pool, uint64_t now, uint64_t wait) {
+    unsigned long long min = atomic_load_explicit(&pool->codel_min_wait, memory_order_relaxed);
+    while (wait < min && !atomic_compare_exchange_weak(&pool->codel_min_wait, &min, wait)) {
+    }
+    codel_roll(pool, now);
+}
+
+static void dispatch(workpool_t* pool, int client_socket, struct client* client);
+
+//whether the pool could start on a connection right now: someone is parked, or it may grow.
+static bool spare(workpool_t* pool) {
+    return atomic_load(&pool->nidle) > 0 || atomic_load(&pool->nworkers) < pool->max;
+}
+
+//takes up to max deferred connections off the clients' lines (see ratelimit.h) for this pool. they were bound for whichever shard
+//accepted them, but this is the pool with the worker to spare.
+static void pull_deferred(workpool_t* pool, int max) {
+    int sockets[4];
+    struct client* clients[4];
+    int n = ratelimit_fair_next(sockets, clients, max < 4 ? max : 4);
+    for (int i=0;i<n;i++) {
+        dispatch(pool, sockets[i], clients[i]);
+    }
+}
+
+//the pool is done with one of client's connections: the next of its deferred ones, if any, may go in. if none of them may and the
+//worker would be left with nothing to do, it takes someone else's.
+static void leave(workpool_t* pool, struct client* client) {
+    if (!ratelimit_fair()) {
+        return;
+    }
+    int n = 0;
+    if (client != NULL) {
+        int sockets[4];
+        void* owners[4];
+        n = ratelimit_fair_leave(client, sockets, owners, 4);
+        for (int i=0;i<n;i++) {
+            dispatch(owners[i], sockets[i], client);
+        }
+    }
+    if (n == 0 && atomic_load_explicit(&pool->queued, memory_order_relaxed) == 0) {
+        pull_deferred(pool, 1);
+    }
+}
+
+//sheds a connection that got as far as the pool, and lets go of everything it held.
+static void drop(workpool_t* pool, int client_socket, struct client* client, shed_reason_t reason, bool in_service) {
+    admission_reject(client_socket, reason);
+    admission_release();
+    if (in_service) {
+        leave(pool, client);
+    }
+    if (client != NULL) {
+        ratelimit_detach(client);
+    }
+}
+
+static void serve(workpool_t* pool, int client_socket) {
+    uint64_t start = now_ns();
+    struct client* client = NULL;
+    if (client_socket < accepted_size) {
+        uint64_t wait = start - accepted_at[client_socket];
+        client = accepted_by[client_socket];
+        hdr_record_atomic(pool->wait, wait);
+        metrics_observe_ns(H_QUEUE_WAIT, wait);
+        codel_observe(pool, start, wait);
+        if (wait > POOL_CODEL_TARGET_MS * 1000000ULL && atomic_load_explicit(&pool->overloaded, memory_order_relaxed)) {
+            drop(pool, client_socket, client, SHED_CODEL, true);
+            return;
+        }
+    }
+    atomic_fetch_add_explicit(&pool->tasks, 1, memory_order_relaxed);
+    //the handler gives the client's connection reference back when it closes the connection. the pool's own goes in leave().
+    pool->handler(client_socket, client);
+    hdr_record_atomic(pool->service, now_ns() - start);
+    admission_release();
+    leave(pool, client);
+}
+
+static bool retire(workpool_t* pool, pool_worker_t* w) {
+    int n = atomic_load(&pool->nworkers);
+    while (n > pool->min) {
+        if (atomic_compare_exchange_weak(&pool->nworkers, &n, n - 1)) {
+            atomic_fetch_add(&pool->retired, 1);
+            //whatever still lands on our queue gets stolen by the others, or picked up by the next worker in this slot.
+            atomic_store(&w->running, 0);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* worker_main(void* arg) {
+    pool_worker_t* w = arg;
+    workpool_t* pool = w->pool;
+
+    if (pool->shard != -1) {
+        pin_to_shard(pool->shard, -1);
+    }
+    while (true) {
+        int client_socket = take(pool, w);
+        if (client_socket == -1) {
+            //park. announce it before the last look around, so a connection pushed onto a busy worker's queue meanwhile is either
+            //seen here or the acceptor sees us parked and pokes us (both sides fence between their write and their read).
+            atomic_store(&w->idle, 1);
+            atomic_fetch_add(&pool->nidle, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            uint64_t parked = now_ns();
+            if ((client_socket = take(pool, w)) == -1) {
+                client_socket = queue_pop_wait_timeout(w->queue, POOL_IDLE_MS);
+                //take() does this for the connections it finds. this one came straight off the queue.
+                if (client_socket >= 0) {
+                    atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+                }
+            }
+            //if we can't clear our own flag, the acceptor claimed us and something is on its way to our queue.
+            int one = 1;
+            bool claimed = !atomic_compare_exchange_strong(&w->idle, &one, 0);
+            if (!claimed) {
+                atomic_fetch_sub(&pool->nidle, 1);
+            }
+            if (client_socket < 0) {
+                if (!claimed && now_ns() - parked >= POOL_IDLE_MS * 1000000ULL && retire(pool, w)) {
+                    return NULL;
+                }
+                continue;
+            }
+        }
+        serve(pool, client_socket);
+    }
+}
+
+//wakes a parked worker to come and steal, or if nobody is parked, adds a worker. returns false if the pool is already at max.
+static bool rescue(workpool_t* pool) {
+    pool_worker_t* idle = claim_idle(pool);
+    if (idle != NULL) {
+        while (!queue_push(idle->queue, POOL_POKE)) {
+            usleep(1000);
+        }
+        return true;
+    }
+    if (atomic_load(&pool->nworkers) < pool->max) {
+        spawn_worker(pool);
+        return true;
+    }
+    return false;
+}
+
+//safety net for connections stranded on the queue of a worker that is busy (or retired) while someone else could take them,
+//e.g. when a worker parked between the acceptor's two looks.
+static void* monitor_main(void* arg) {
+    workpool_t* pool = arg;
+    while (true) {
+        usleep(POOL_MONITOR_MS * 1000);
+        //and for deferred connections left waiting while a worker parked: a client's line only moves when a worker frees up.
+        if (ratelimit_fair() && atomic_load(&pool->queued) == 0 && atomic_load(&pool->nidle) > 0) {
+            pull_deferred(pool, atomic_load(&pool->nidle));
+        }
+        int used = atomic_load(&pool->slots_used);
+        for (int i=0;i<used;i++) {
+            pool_worker_t* w = &pool->workers[i];
+            if (queue_length(w->queue) > 0 && (!atomic_load(&w->running) || !atomic_load(&w->idle))) {
+                if (!rescue(pool)) {
+                    break;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+workpool_t* workpool_create(int min, int max, int shard, void (*handler)(int client_socket, struct client* client)) {
+    workpool_t* pool = calloc(1, sizeof(workpool_t));
+
+    pthread_once(&accepted_once, init_accepted_at);
+    pool->min = min;
+    pool->max = max;
+    pool->shard = shard;
+    pool->handler = handler;
+    pool->workers = aligned_alloc(CACHE_LINE, max * sizeof(pool_worker_t));
+    memset(pool->workers, 0, max * sizeof(pool_worker_t));
+    for (int i=0;i<max;i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+    }
+    pthread_mutex_init(&pool->spawn_lock, NULL);
+    pool->wait = hdr_create();
+    pool->service = hdr_create();
+    atomic_init(&pool->codel_min_wait, UINT64_MAX);
+
+    for (int i=0;i<min;i++) {
+        spawn_worker(pool);
+    }
+    pthread_t t;
+    pthread_create(&t, NULL, monitor_main, pool);
+    return pool;
+}
+
+void workpool_submit(workpool_t* pool, int client_socket, struct client* client) {
+    if (client_socket >= accepted_size && client != NULL) {
+        //nowhere to note whose it is. it goes in unlimited.
+        ratelimit_detach(client);
+        client = NULL;
+    }
+    if (client != NULL && ratelimit_fair()) {
+        switch (ratelimit_fair_enter(client, client_socket, pool, spare(pool))) {
+            case FAIR_SERVE:
+                break;
+            case FAIR_DEFERRED:
+                //one of the client's own connections lets it in when it's done (see leave()).
+                return;
+            case FAIR_SHED:
+                drop(pool, client_socket, client, SHED_FAIR, false);
+                return;
+        }
+    }
+    dispatch(pool, client_socket, client);
+}
+
+//submits a connection that may be served now as far as its client's share goes.
+static void dispatch(workpool_t* pool, int client_socket, struct client* client) {
+    uint64_t now = now_ns();
+    codel_roll(pool, now);
+    int queued = atomic_load_explicit(&pool->queued, memory_order_relaxed);
+    bool shed_queue = admission_max_queued > 0 && queued >= admission_max_queued;
+    if (shed_queue || (queued > atomic_load(&pool->nworkers) && atomic_load_explicit(&pool->overloaded, memory_order_relaxed))) {
+        drop(pool, client_socket, client, shed_queue ? SHED_QUEUE : SHED_CODEL, true);
+        return;
+    }
+    if (client_socket < accepted_size) {
+        accepted_at[client_socket] = now;
+        accepted_by[client_socket] = client;
+    }
+    atomic_fetch_add_explicit(&pool->queued, 1, memory_order_relaxed);
+
+    pool_worker_t* w = claim_idle(pool);
+    bool parked = w != NULL;
+    if (!parked) {
+        //everyone is busy. queue it on one of them for now (round robin, so no single queue grows long)...
+        int used = atomic_load(&pool->slots_used);
+        unsigned start = atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed);
+        w = &pool->workers[start % used];
+        for (int i=0;i<used && !atomic_load(&w->running);i++) {
+            w = &pool->workers[(start + i) % used];
+        }
+    }
+    //put the connection somewhere where a worker can find it. queue_push() wakes the owner if it's asleep.
+    //if every slot is taken, stop accepting for a moment and let the kernel's listen backlog absorb the burst.
+    while (!queue_push(w->queue, client_socket)) {
+        usleep(1000);
+    }
+    if (!parked) {
+        //...and then get it out of there: wake whoever parked since we looked, or grow the pool rather than have it wait
+        //behind a connection that may take seconds.
+        atomic_thread_fence(memory_order_seq_cst);
+        rescue(pool);
+    }
+}
+
+int workpool_queued(workpool_t* pool) {
+    return atomic_load(&pool->queued);
+}
+
+bool workpool_parse_size(const char* arg, int* min, int* max) {
+    char* end;
+    long lo = strtol(arg, &end, 10);
+    long hi = lo;
+    if (*end == ':') {
+        hi = strtol(end + 1, &end, 10);
+    }
+    if (*end != 0 || lo < 1 || hi < lo || hi > 4096) {
+        return false;
+    }
+    *min = lo;
+    *max = hi;
+    return true;
+}
+
+void workpool_log_stats(workpool_t* pool) {
+    log_info("pool %d: workers=%d idle=%d (min %d max %d) tasks=%lu stolen=%lu spawned=%lu retired=%lu",
+             pool->shard, atomic_load(&pool->nworkers), atomic_load(&pool->nidle), pool->min, pool->max,
+             atomic_load(&pool->tasks), atomic_load(&pool->stolen), atomic_load(&pool->spawned), atomic_load(&pool->retired));
+    log_info("pool %d: queue wait p50=%.1fus p99=%.1fus max=%.1fus, service mean=%.2fms p99=%.2fms",
+             pool->shard, hdr_percentile(pool->wait, 50) / 1e3, hdr_percentile(pool->wait, 99) / 1e3, pool->wait->max / 1e3,
+             hdr_mean(pool->service) / 1e6, hdr_percentile(pool->service, 99) / 1e6);
+}
@@ -0,0 +1,77 @@
+#ifndef WORKPOOL_H_
+#define WORKPOOL_H_
+
+#include<stdatomic.h>
+#include<pthread.h>
+#include "myqueue.h"
+#include "hdrhist.h"
+
+//the pool behind -m pool. every worker has its own queue. the acceptor hands a connection straight to a parked worker if there is one,
+//otherwise it lands on a busy worker's queue and whichever worker frees up first steals it. when every worker is busy the pool grows
+//(up to max) instead of letting connections wait behind blocked threads, and workers that sit idle for POOL_IDLE_MS retire (down to min).
+#define POOL_MIN_WORKERS 4
+#define POOL_MAX_WORKERS 128
+#define POOL_IDLE_MS 5000       //how long a parked worker waits before retiring, if the pool is above min
+#define POOL_MONITOR_MS 10      //how often the monitor looks for stranded connections
+
+//CoDel on the queue wait. a queue that is only briefly long (a burst) is fine. one whose *shortest* wait stays above target for a
+//whole interval is a standing queue: the pool is at max and falling behind. while that lasts, connections that have already waited
+//longer than target are answered with a 503 when they're dequeued instead of being served late, and new ones are shed at accept
+//while there's more than one queued per worker. the queue drains down to about target and tail latency stays bounded.
+#define POOL_CODEL_TARGET_MS 10
+#define POOL_CODEL_INTERVAL_MS 100
+
+struct client;
+
+typedef struct pool_worker {
+    _Alignas(CACHE_LINE) atomic_int idle;   //1 while parked. the acceptor claims a parked worker by swapping it to 0
+    atomic_int running;                     //a thread owns this slot
+    queue_t* queue;                         //allocated the first time the slot is used, then kept: others may still steal from it
+    struct workpool* pool;
+    int index;
+} pool_worker_t;
+
+typedef struct workpool {
+    int min;
+    int max;
+    int shard;                  //pin workers to this shard's CPU, -1 for no pinning
+    void (*handler)(int client_socket, struct client* client);
+    pool_worker_t* workers;     //max slots
+    atomic_int slots_used;      //slots that have ever had a queue
+    atomic_int nworkers;
+    atomic_int nidle;
+    atomic_uint next;           //round robin over busy workers
+    atomic_int queued;          //connections on the queues, waiting for a worker
+    pthread_mutex_t spawn_lock;
+
+    atomic_ullong codel_interval_end;
+    atomic_ullong codel_min_wait;   //shortest queue wait seen this interval
+    atomic_bool overloaded;         //the last interval's shortest wait was above target
+
+    atomic_ulong tasks;
+    atomic_ulong stolen;
+    atomic_ulong spawned;
+    atomic_ulong retired;
+    hdr_hist_t* wait;           //accept -> a worker picks the connection up
+    hdr_hist_t* service;        //how long a worker was tied up with it (mostly blocked on I/O)
+} workpool_t;
+
+// starts min workers, each serving connections with handler. client is what the connection was submitted with.
+workpool_t* workpool_create(int min, int max, int shard, void (*handler)(int client_socket, struct client* client));
+
+// hands a freshly accepted (and admitted, see admission.h) connection to the pool, or sheds it if the pool is overloaded.
+// either way the pool gives the admission slot back once it's done with the connection.
+// client (from ratelimit_attach(), may be NULL) gets its fair share of the pool with -F: once the pool is full, past that its
+// connections wait for its own to finish. the handler takes over the reference, or the pool gives it back if the connection is shed.
+void workpool_submit(workpool_t* pool, int client_socket, struct client* client);
+
+// one line of counters and one of queue wait/service times, through log.c.
+void workpool_log_stats(workpool_t* pool);
+
+// connections sitting on the workers' queues, waiting for someone to pick them up.
+int workpool_queued(workpool_t* pool);
+
+// parses "min:max" (or a single number for both) into *min and *max.
+bool workpool_parse_size(const char* arg, int* min, int* max);
+
+#endif
@@ -0,0 +1,54 @@
+//benchmark: bin2hex() from common.c, which tcps runs over every request it reads, in MB of input per second.
+//usage: ./hexbench [-j] [milliseconds per size]
+//  -j  one JSON object per line instead of the table (see ../multithreadedserver_with_thread_pool/bench.h)
+#include "common.h"
+#include<stdbool.h>
+#include<time.h>
+
+#define DEFAULT_MS 300
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//returns MB of input converted per second. the result is freed every time, like a caller that doesn't leak would.
+static double run(const unsigned char* input, size_t len, int ms) {
+    double start = now(), deadline = start + ms / 1e3;
+    long calls = 0;
+    do {
+        for (int i=0;i<100;i++) {
+            char* hex = bin2hex(input, len);
+            //keep the call from being optimized away.
+            __asm__ volatile("" : : "r"(hex) : "memory");
+            free(hex);
+        }
+        calls += 100;
+    } while (now() < deadline);
+    return calls * len / (now() - start) / (1 << 20);
+}
+
+int main(int argc, char** argv) {
+    bool json = argc > 1 && strcmp(argv[1], "-j") == 0;
+    int ms = argc > 1 + json ? atoi(argv[1 + json]) : DEFAULT_MS;
+    //a short request line, a typical browser request, and the most tcps ever reads at once.
+    size_t sizes[] = { 64, 512, MAXLINE - 1 };
+    unsigned char input[MAXLINE];
+
+    for (int i=0;i<MAXLINE;i++) {
+        input[i] = (unsigned char)(i * 131 + 7);
+    }
+    if (!json) {
+        printf("%-8s %10s\n", "bytes", "MB/s");
+    }
+    for (size_t s=0;s<sizeof(sizes)/sizeof(sizes[0]);s++) {
+        double mbps = run(input, sizes[s], ms);
+        if (json) {
+            printf("{\"bench\":\"bin2hex\",\"case\":\"%zu bytes\",\"value\":%.6g,\"unit\":\"MB/s\",\"better\":\"higher\"}\n", sizes[s], mbps);
+        } else {
+            printf("%-8zu %10.1f\n", sizes[s], mbps);
+        }
+    }
+    return 0;
+}